@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Generates synthetic OpenMP offload programs for benchmarking OMPDart.
+
+The size and shape of the generated program is controlled by the number of
+functions, kernels per function, arrays per function, nesting depth of host
+control flow around kernels, loop depth inside kernels and the shape of the
+call graph. The output is deterministic for a given seed.
+"""
+
+import argparse
+import random
+import sys
+
+CALL_GRAPHS = ["none", "chain", "tree", "random", "recursive"]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-o", "--output", default="-",
+                        help="output file (default: stdout)")
+    parser.add_argument("--functions", type=int, default=16,
+                        help="number of functions")
+    parser.add_argument("--kernels", type=int, default=4,
+                        help="target regions per function")
+    parser.add_argument("--vars", type=int, default=6,
+                        help="arrays used by each function")
+    parser.add_argument("--nesting", type=int, default=1,
+                        help="depth of host loops/conditionals around kernels")
+    parser.add_argument("--loop-depth", type=int, default=1,
+                        help="depth of the loop nest inside each kernel")
+    parser.add_argument("--call-graph", choices=CALL_GRAPHS, default="chain",
+                        help="shape of the call graph")
+    parser.add_argument("--seed", type=int, default=0)
+    args = parser.parse_args()
+    for name in ["functions", "kernels", "vars", "loop_depth"]:
+        if getattr(args, name) < 1:
+            parser.error("--%s must be at least 1" % name.replace("_", "-"))
+    if args.nesting < 0:
+        parser.error("--nesting must not be negative")
+    return args
+
+
+def build_call_graph(shape, num_functions, rng):
+    """Returns the list of callees of each function."""
+    callees = [[] for _ in range(num_functions)]
+    for f in range(num_functions):
+        if shape == "chain" or shape == "recursive":
+            if f + 1 < num_functions:
+                callees[f].append(f + 1)
+        elif shape == "tree":
+            callees[f] = [c for c in (2 * f + 1, 2 * f + 2)
+                          if c < num_functions]
+        elif shape == "random":
+            later = list(range(f + 1, num_functions))
+            callees[f] = sorted(rng.sample(later, min(2, len(later))))
+    if shape == "recursive" and num_functions > 1:
+        # Close the chain into a cycle so every function is in one component.
+        callees[num_functions - 1].append(0)
+    return callees
+
+
+class Writer:
+    def __init__(self, out):
+        self.out = out
+        self.indent = 0
+
+    def line(self, text=""):
+        self.out.write(("  " * self.indent + text).rstrip() + "\n")
+
+    def open(self, text):
+        self.line(text + " {")
+        self.indent += 1
+
+    def close(self, text="}"):
+        self.indent -= 1
+        self.line(text)
+
+
+def params(num_params):
+    return ", ".join("double *p%d" % i for i in range(num_params))
+
+
+def emit_kernel(w, arrays, loop_depth, rng):
+    dst, src = rng.sample(arrays, 2) if len(arrays) > 1 else (arrays[0],) * 2
+    w.line("#pragma omp target teams distribute parallel for")
+    w.open("for (int i0 = 0; i0 < n; ++i0)")
+    for d in range(1, loop_depth):
+        w.open("for (int i%d = 0; i%d < %d; ++i%d)" % (d, d, 4, d))
+    other = rng.choice(arrays)
+    w.line("%s[i0] = %s[i0] * s + %s[i0];" % (dst, src, other))
+    for _ in range(1, loop_depth):
+        w.close()
+    w.close()
+
+
+def emit_host_access(w, arrays, rng):
+    var = rng.choice(arrays)
+    if rng.random() < 0.5:
+        w.open("for (int j = 0; j < n; ++j)")
+        w.line("acc += %s[j];" % var)
+        w.close()
+    else:
+        w.line("%s[0] = acc;" % var)
+
+
+def emit_function(w, f, args, callees, rng):
+    num_params = min(args.vars, 3)
+    num_locals = args.vars - num_params
+    w.open("void f%d(%s, int n, int depth)" % (f, params(num_params)))
+    arrays = ["p%d" % i for i in range(num_params)]
+    for i in range(num_locals):
+        w.line("double *l%d = (double *)malloc(n * sizeof(double));" % i)
+        arrays.append("l%d" % i)
+    for i in range(num_locals):
+        w.line("for (int j = 0; j < n; ++j)")
+        w.line("  l%d[j] = j;" % i)
+    w.line("double s = %d.5;" % (f % 7))
+    w.line("double acc = 0.0;")
+
+    for k in range(args.kernels):
+        closers = 0
+        for d in range(args.nesting):
+            if (k + d) % 2 == 0:
+                w.open("for (int t%d = 0; t%d < 2; ++t%d)" % (d, d, d))
+            else:
+                w.open("if (acc >= %d.0)" % d)
+            closers += 1
+        emit_kernel(w, arrays, args.loop_depth, rng)
+        emit_host_access(w, arrays, rng)
+        for _ in range(closers):
+            w.close()
+
+    if callees:
+        w.open("if (depth > 0)")
+        for c in callees:
+            call_args = ", ".join(rng.choice(arrays)
+                                  for _ in range(min(args.vars, 3)))
+            w.line("f%d(%s, n, depth - 1);" % (c, call_args))
+        w.close()
+
+    w.line("p0[0] += acc;")
+    for i in range(num_locals):
+        w.line("free(l%d);" % i)
+    w.close()
+    w.line()
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.seed)
+    callees = build_call_graph(args.call_graph, args.functions, rng)
+    called = {c for cs in callees for c in cs}
+    roots = [f for f in range(args.functions) if f not in called] or [0]
+
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    w = Writer(out)
+    w.line("// Generated by bench/generate.py " + " ".join(sys.argv[1:]))
+    w.line("#include <cstdio>")
+    w.line("#include <cstdlib>")
+    w.line()
+    num_params = min(args.vars, 3)
+    for f in range(args.functions):
+        w.line("void f%d(%s, int n, int depth);" % (f, params(num_params)))
+    w.line()
+    for f in range(args.functions):
+        emit_function(w, f, args, callees[f], rng)
+
+    w.open("int main()")
+    w.line("const int n = 1 << 16;")
+    for i in range(num_params):
+        w.line("double *a%d = (double *)calloc(n, sizeof(double));" % i)
+    a = ", ".join("a%d" % i for i in range(num_params))
+    for r in roots:
+        w.line("f%d(%s, n, %d);" % (r, a, args.functions))
+    w.line('printf("%%f\\n", a0[0]);')
+    for i in range(num_params):
+        w.line("free(a%d);" % i)
+    w.line("return 0;")
+    w.close()
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
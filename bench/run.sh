@@ -0,0 +1,105 @@
+#!/bin/bash
+
+# Runs OMPDart on generated programs of increasing size and records the wall
+# time and peak resident set size of each run as CSV.
+#
+#   bash bench/run.sh [--plugin <libompdart.so>] [--clang <clang>]
+#                     [--out <dir>] [--quick]
+
+DIR=$(dirname "$0")
+PLUGIN_LIB="$DIR/../build/src/libompdart.so"
+CLANG=clang
+OUT="$DIR/../build/bench"
+QUICK=0
+
+while [ "$1" != "" ]; do
+    case $1 in
+        --plugin)
+            shift;
+            PLUGIN_LIB=$1
+            shift;
+            ;;
+
+        --clang)
+            shift;
+            CLANG=$1
+            shift;
+            ;;
+
+        --out)
+            shift;
+            OUT=$1
+            shift;
+            ;;
+
+        --quick)
+            shift;
+            QUICK=1
+            ;;
+
+        * )
+            echo "unknown argument $1"
+            exit 1
+            ;;
+    esac
+done
+
+if [ ! -x /usr/bin/time ]; then
+    echo "/usr/bin/time is required to measure peak memory usage"
+    exit 1
+fi
+
+mkdir -p "$OUT"
+RESULTS="$OUT/results.csv"
+echo "name,functions,kernels,vars,nesting,loop_depth,call_graph,wall_seconds,max_rss_kb,status" > "$RESULTS"
+
+# Runs one configuration.
+# usage: bench <functions> <kernels> <vars> <nesting> <loop_depth> <call_graph>
+bench() {
+    NAME="f$1_k$2_v$3_n$4_l$5_$6"
+    SRC="$OUT/$NAME.cpp"
+    python3 "$DIR/generate.py" --functions $1 --kernels $2 --vars $3 \
+        --nesting $4 --loop-depth $5 --call-graph $6 -o "$SRC" || exit 1
+
+    /usr/bin/time -f "%e,%M" -o "$OUT/$NAME.time" \
+        $CLANG -fopenmp -fsyntax-only -Xclang -load -Xclang "$PLUGIN_LIB" \
+        -Xclang -plugin -Xclang ompdart \
+        -Xclang -plugin-arg-ompdart -Xclang --output \
+        -Xclang -plugin-arg-ompdart -Xclang "$OUT/$NAME.out.cpp" \
+        "$SRC" > "$OUT/$NAME.log" 2>&1
+    STATUS=$?
+
+    echo "$NAME,$1,$2,$3,$4,$5,$6,$(tail -n 1 "$OUT/$NAME.time"),$STATUS" >> "$RESULTS"
+    echo "$NAME: $(tail -n 1 "$OUT/$NAME.time") (wall s, max rss KB)"
+}
+
+if [ $QUICK -eq 1 ]; then
+    FUNCTIONS="8 32 128"
+    KERNELS="2 8"
+    VARS="4 16"
+else
+    FUNCTIONS="8 32 128 512 2048"
+    KERNELS="2 8 32"
+    VARS="4 16 64"
+fi
+
+# Scaling in the number of functions, for each call graph shape.
+for SHAPE in none chain tree random recursive; do
+    for F in $FUNCTIONS; do
+        bench $F 4 6 1 1 $SHAPE
+    done
+done
+
+# Scaling of a single function's access log.
+for K in $KERNELS; do
+    for V in $VARS; do
+        bench 4 $K $V 2 2 chain
+    done
+done
+
+# Deeply nested control flow and loops.
+for D in 1 4 8; do
+    bench 16 4 6 $D $D tree
+done
+
+echo "Results written to $RESULTS"
@@ -32,6 +32,25 @@ while [ "$1" != "" ]; do
             shift;
             ;;
 	    
+        -j | --jobs)
+            shift;
+	    COMMAND="$COMMAND -Xclang -plugin-arg-$PLUGIN -Xclang --jobs -Xclang -plugin-arg-$PLUGIN -Xclang $1"
+            shift;
+            ;;
+
+        --time-report | --stats | --reuse-device-buffers | --async \
+        | --enter-exit-data | --hoist-callee-regions | --clone-functions)
+	    COMMAND="$COMMAND -Xclang -plugin-arg-$PLUGIN -Xclang $1"
+            shift;
+            ;;
+
+        --emit-summaries | --load-summaries | --library-summaries \
+        | --cache-dir | --stats-json)
+	    COMMAND="$COMMAND -Xclang -plugin-arg-$PLUGIN -Xclang $1 -Xclang -plugin-arg-$PLUGIN -Xclang $2"
+            shift;
+            shift;
+            ;;
+
         -d | --debug)
             shift;
 	    COMMAND="gdb --args $COMMAND"
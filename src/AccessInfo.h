@@ -1,6 +1,9 @@
 #ifndef ACCESSINFO_H
 #define ACCESSINFO_H
 
+#include <string>
+#include <vector>
+
 #include "clang/AST/Decl.h"
 #include "clang/AST/Expr.h"
 
@@ -13,6 +16,11 @@ constexpr uint8_t A_RDWR    = 0b00000011; // ReadWrite Operation
 constexpr uint8_t A_UNKNOWN = 0b00000100; // Unknown Operation
 constexpr uint8_t A_OFFLD   = 0b00001000; // Offloaded Operation
 
+// Properties of a variable's data asserted with `#pragma ompdart`.
+constexpr uint8_t P_READONLY        = 0b00000001; // Only read by calls
+constexpr uint8_t P_DEVICE_RESIDENT = 0b00000010; // Kept on the device
+constexpr uint8_t P_HOST_DEAD       = 0b00000100; // Never read back on host
+
 enum ScopeBarrier : uint8_t {
   None,
   KernelBegin,
@@ -25,12 +33,24 @@ enum ScopeBarrier : uint8_t {
   CondEnd
 };
 
+// A term Coeff * Var, or Coeff * Var * Stride, of an affine array index. A term
+// without a Var is Coeff times the expression E, which has to be invariant.
+struct AffineTerm {
+  const Expr *E;
+  const ValueDecl *Var;
+  int64_t Coeff;
+  const Expr *Stride;
+};
+
 struct ArrayAccess {
   uint8_t Flags;             // Read/Write operations
   size_t LitLower;           // Array access literal lower bound
   size_t LitUpper;           // Array access literal upper bound
   const ValueDecl *VarLower; // Array access variable lower bound
   const ValueDecl *VarUpper; // Array access variable upper bound
+  bool Affine;               // Index is Offset plus the sum of Terms
+  int64_t Offset;
+  std::vector<AffineTerm> Terms;
 };
 
 struct LoopAccess {
@@ -43,12 +63,28 @@ struct LoopAccess {
   int8_t UpperOffByOne;       // Compensation for off by one comparisons.
 };
 
+// One dimension of an OpenMP array section, as the text of its lower bound and
+// length.
+struct SectionDim {
+  std::string Lower;
+  std::string Length;
+};
+
+// The elements of an array touched within a target data region. Dimensions
+// after the last one listed are whole.
+struct ArraySection {
+  std::vector<SectionDim> Dims;
+};
+
 struct AccessInfo {
   const ValueDecl *VD;
   const Stmt *S;
   SourceLocation Loc;
+  unsigned Offset;      // Main file offset of Loc, orders the access log
   uint8_t Flags;        // Read/Write operations
   ScopeBarrier Barrier; // Indicates begin/end of a block scope
+  // The outermost subscript of an element access, and the bounds of the index
+  // of each dimension, starting with the first.
   const ArraySubscriptExpr *ArraySubscript;
   std::vector<ArrayAccess> ArrayBounds;
   const LoopAccess *LoopBounds;
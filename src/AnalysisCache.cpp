@@ -0,0 +1,294 @@
+#include "AnalysisCache.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "CommonUtils.h"
+#include "DataTracker.h"
+
+using namespace clang;
+
+// Bump whenever the analysis changes in a way that invalidates cached results.
+constexpr int64_t CacheVersion = 8;
+
+std::string AnalysisCache::getCachePath(llvm::StringRef Dir,
+                                        const SourceManager &SM) {
+  FileID FID = SM.getMainFileID();
+  llvm::SmallString<256> MainFile(
+      SM.getFilename(SM.getLocForStartOfFile(FID)));
+  llvm::sys::fs::make_absolute(MainFile);
+  llvm::SmallString<256> CachePath(Dir);
+  llvm::sys::path::append(
+      CachePath, llvm::sys::path::filename(MainFile) + "." +
+                     llvm::utohexstr(llvm::xxHash64(MainFile)) + ".json");
+  return std::string(CachePath);
+}
+
+static llvm::json::Array toJSON(const std::vector<CachedAccess> &Accesses) {
+  llvm::json::Array Result;
+  for (const CachedAccess &Access : Accesses)
+    Result.push_back(
+        llvm::json::Array{Access.Entry, Access.Decl, Access.Barrier});
+  return Result;
+}
+
+static llvm::json::Array toJSON(const std::vector<CachedClause> &Clauses) {
+  llvm::json::Array Result;
+  for (const CachedClause &Clause : Clauses)
+    Result.push_back(llvm::json::Array{Clause.Directive, Clause.Decl});
+  return Result;
+}
+
+static llvm::json::Array toJSON(const std::vector<CachedSection> &Sections) {
+  llvm::json::Array Result;
+  for (const CachedSection &Section : Sections) {
+    llvm::json::Array Tuple{Section.Index};
+    for (const std::string &Bound : Section.Bounds)
+      Tuple.push_back(Bound);
+    Result.push_back(std::move(Tuple));
+  }
+  return Result;
+}
+
+/* Reads the array Name of Obj into Out as tuples of N integers. Returns false
+ * if it is malformed.
+ */
+template <size_t N, typename T, typename Fn>
+static bool fromJSON(const llvm::json::Object &Obj, llvm::StringRef Name,
+                     std::vector<T> &Out, Fn Make) {
+  const llvm::json::Array *Items = Obj.getArray(Name);
+  if (!Items)
+    return false;
+  for (const llvm::json::Value &Item : *Items) {
+    const llvm::json::Array *Tuple = Item.getAsArray();
+    if (!Tuple || Tuple->size() != N)
+      return false;
+    int64_t Values[N];
+    for (size_t I = 0; I < N; ++I) {
+      auto Value = (*Tuple)[I].getAsInteger();
+      if (!Value)
+        return false;
+      Values[I] = *Value;
+    }
+    Out.push_back(Make(Values));
+  }
+  return true;
+}
+
+static bool fromJSON(const llvm::json::Object &Obj, llvm::StringRef Name,
+                     std::vector<CachedSection> &Out) {
+  const llvm::json::Array *Items = Obj.getArray(Name);
+  if (!Items)
+    return false;
+  for (const llvm::json::Value &Item : *Items) {
+    // The index followed by the lower bound and length of each dimension.
+    const llvm::json::Array *Tuple = Item.getAsArray();
+    if (!Tuple || Tuple->size() < 3 || Tuple->size() % 2 != 1)
+      return false;
+    auto Index = (*Tuple)[0].getAsInteger();
+    if (!Index)
+      return false;
+    CachedSection Section{*Index, {}};
+    for (size_t I = 1; I < Tuple->size(); ++I) {
+      auto Bound = (*Tuple)[I].getAsString();
+      if (!Bound)
+        return false;
+      Section.Bounds.push_back(Bound->str());
+    }
+    Out.push_back(std::move(Section));
+  }
+  return true;
+}
+
+static bool fromJSON(const llvm::json::Object &Obj, CachedRegion &Region) {
+  auto MakeAccess = [](const int64_t *V) {
+    return CachedAccess{V[0], V[1], static_cast<uint8_t>(V[2])};
+  };
+  auto MakeClause = [](const int64_t *V) { return CachedClause{V[0], V[1]}; };
+
+  auto Begin = Obj.getInteger("begin");
+  auto End = Obj.getInteger("end");
+  auto Parent = Obj.getInteger("parent");
+  if (!Begin || !End || !Parent)
+    return false;
+  Region.BeginOffset = *Begin;
+  Region.EndOffset = *End;
+  Region.Parent = *Parent;
+  return fromJSON<3>(Obj, "map_to", Region.MapTo, MakeAccess) &&
+         fromJSON<3>(Obj, "map_from", Region.MapFrom, MakeAccess) &&
+         fromJSON<3>(Obj, "map_tofrom", Region.MapToFrom, MakeAccess) &&
+         fromJSON<3>(Obj, "map_alloc", Region.MapAlloc, MakeAccess) &&
+         fromJSON<3>(Obj, "update_to", Region.UpdateTo, MakeAccess) &&
+         fromJSON<3>(Obj, "update_from", Region.UpdateFrom, MakeAccess) &&
+         fromJSON<2>(Obj, "private", Region.Private, MakeClause) &&
+         fromJSON<2>(Obj, "firstprivate", Region.FirstPrivate, MakeClause) &&
+         fromJSON(Obj, "sections", Region.Sections) &&
+         fromJSON(Obj, "update_to_sections", Region.UpdateToSections) &&
+         fromJSON(Obj, "update_from_sections", Region.UpdateFromSections);
+}
+
+static bool fromJSON(const llvm::json::Object &Obj, CachedAnalysis &Analysis) {
+  auto MakeDiagnostic = [](const int64_t *V) {
+    return CachedDiagnostic{static_cast<uint8_t>(V[0]), V[1], V[2]};
+  };
+
+  if (!fromJSON<3>(Obj, "diagnostics", Analysis.Diagnostics, MakeDiagnostic))
+    return false;
+  const llvm::json::Array *Regions = Obj.getArray("regions");
+  if (!Regions)
+    return false;
+  for (const llvm::json::Value &Item : *Regions) {
+    const llvm::json::Object *Region = Item.getAsObject();
+    Analysis.Regions.emplace_back();
+    if (!Region || !fromJSON(*Region, Analysis.Regions.back()))
+      return false;
+  }
+  return true;
+}
+
+void AnalysisCache::load(llvm::StringRef Path) {
+  this->Path = Path.str();
+  Entries.clear();
+
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer)
+    return;
+  llvm::Expected<llvm::json::Value> Root =
+      llvm::json::parse((*Buffer)->getBuffer());
+  if (!Root) {
+    llvm::consumeError(Root.takeError());
+    return;
+  }
+  const llvm::json::Object *RootObj = Root->getAsObject();
+  if (!RootObj || RootObj->getInteger("version") != CacheVersion)
+    return;
+  const llvm::json::Object *Functions = RootObj->getObject("functions");
+  if (!Functions)
+    return;
+
+  for (const auto &Function : *Functions) {
+    const llvm::json::Object *Obj = Function.second.getAsObject();
+    if (!Obj)
+      continue;
+    auto KeyStr = Obj->getString("key");
+    uint64_t Key;
+    if (!KeyStr || KeyStr->getAsInteger(16, Key))
+      continue;
+    CacheEntry Entry;
+    Entry.Key = Key;
+    Entry.Used = false;
+    if (fromJSON(*Obj, Entry.Analysis))
+      Entries[Function.first.str()] = std::move(Entry);
+  }
+}
+
+const CachedAnalysis *AnalysisCache::lookup(llvm::StringRef Name,
+                                            uint64_t Key) {
+  auto It = Entries.find(Name);
+  if (It == Entries.end() || It->second.Key != Key)
+    return nullptr;
+  It->second.Used = true;
+  return &It->second.Analysis;
+}
+
+void AnalysisCache::store(llvm::StringRef Name, uint64_t Key,
+                          CachedAnalysis Analysis) {
+  Entries[Name] = {Key, std::move(Analysis), true};
+}
+
+bool AnalysisCache::save() {
+  llvm::json::Object Functions;
+  for (const auto &Entry : Entries) {
+    if (!Entry.second.Used)
+      continue;
+    const CachedAnalysis &Analysis = Entry.second.Analysis;
+    llvm::json::Array Diagnostics;
+    for (const CachedDiagnostic &Diag : Analysis.Diagnostics)
+      Diagnostics.push_back(
+          llvm::json::Array{Diag.Kind, Diag.Entry, Diag.Decl});
+
+    llvm::json::Array Regions;
+    for (const CachedRegion &Region : Analysis.Regions) {
+      Regions.push_back(llvm::json::Object{
+          {"begin", Region.BeginOffset},
+          {"end", Region.EndOffset},
+          {"parent", Region.Parent},
+          {"map_to", toJSON(Region.MapTo)},
+          {"map_from", toJSON(Region.MapFrom)},
+          {"map_tofrom", toJSON(Region.MapToFrom)},
+          {"map_alloc", toJSON(Region.MapAlloc)},
+          {"update_to", toJSON(Region.UpdateTo)},
+          {"update_from", toJSON(Region.UpdateFrom)},
+          {"private", toJSON(Region.Private)},
+          {"firstprivate", toJSON(Region.FirstPrivate)},
+          {"sections", toJSON(Region.Sections)},
+          {"update_to_sections", toJSON(Region.UpdateToSections)},
+          {"update_from_sections", toJSON(Region.UpdateFromSections)},
+      });
+    }
+
+    llvm::json::Object Obj{
+        {"key", llvm::utohexstr(Entry.second.Key)},
+        {"diagnostics", std::move(Diagnostics)},
+        {"regions", std::move(Regions)},
+    };
+    Functions[Entry.first()] = std::move(Obj);
+  }
+
+  if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+    return false;
+  std::error_code ErrorCode;
+  llvm::raw_fd_ostream OutFile(Path, ErrorCode, llvm::sys::fs::OF_None);
+  if (ErrorCode)
+    return false;
+  OutFile << llvm::json::Value(llvm::json::Object{
+      {"version", CacheVersion},
+      {"functions", std::move(Functions)},
+  });
+  OutFile.close();
+  return !OutFile.has_error();
+}
+
+/* Hash of everything DataTracker::analyze() depends on for DT's function: the
+ * ODR hash and source text of the function, and its access log after the
+ * interprocedural analysis. The access log carries the effects of the
+ * function's callees, so the key changes whenever a callee summary does.
+ */
+uint64_t computeAnalysisKey(DataTracker *DT, ASTContext &Context,
+                            bool Aggressive) {
+  SourceManager &SM = Context.getSourceManager();
+  FunctionDecl *FD = const_cast<FunctionDecl *>(DT->getDecl());
+  unsigned BodyBegin = getMainFileOffset(SM, FD->getBody()->getBeginLoc());
+
+  std::string Data;
+  llvm::raw_string_ostream OS(Data);
+  OS << CacheVersion << ':' << Aggressive << ':' << FD->getODRHash() << ':';
+
+  unsigned Begin = getMainFileOffset(SM, FD->getBeginLoc());
+  unsigned End = getMainFileEndOffset(SM, FD->getEndLoc());
+  llvm::StringRef Buffer = SM.getBufferData(SM.getMainFileID());
+  if (Begin <= End && End < Buffer.size())
+    OS << Buffer.slice(Begin, End + 1);
+
+  // Buffer extents passed by callers.
+  for (const ParmVarDecl *Param : FD->parameters()) {
+    if (const ParamExtent *Extent = DT->getParamExtent(Param)) {
+      OS << ';' << Param->getFunctionScopeIndex() << '=' << Extent->Lit;
+      if (Extent->Param)
+        OS << ',' << Extent->Param->getFunctionScopeIndex();
+    }
+  }
+  for (const AccessInfo &Entry : DT->getAccessLog()) {
+    OS << ';' << (Entry.Offset - BodyBegin) << ',' << unsigned(Entry.Flags)
+       << ',' << unsigned(Entry.Barrier);
+    if (Entry.VD)
+      OS << ',' << Entry.VD->getNameAsString();
+  }
+  OS.flush();
+  return llvm::xxHash64(Data);
+}
@@ -0,0 +1,100 @@
+#ifndef ANALYSISCACHE_H
+#define ANALYSISCACHE_H
+
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "clang/AST/ASTContext.h"
+
+using namespace clang;
+
+class DataTracker;
+
+// An entry of a TargetDataRegion, stored as the index of the access log entry
+// it was copied from. The decl and barrier are kept separately since the
+// analysis may change them on the copy.
+struct CachedAccess {
+  int64_t Entry; // -1 if the region entry only names Decl
+  int64_t Decl;  // index of the first access log entry of the decl
+  uint8_t Barrier;
+};
+
+struct CachedClause {
+  int64_t Directive; // index of the access log entry for the directive
+  int64_t Decl;
+};
+
+struct CachedSection {
+  int64_t Index; // decl entry of a mapped section, or index of an update
+  std::vector<std::string> Bounds; // lower bound and length of each dimension
+};
+
+struct CachedDiagnostic {
+  uint8_t Kind;
+  int64_t Entry; // -1 for diagnostics reported on the function itself
+  int64_t Decl;  // -1 for the function itself
+};
+
+// A target data region of a function.
+struct CachedRegion {
+  unsigned BeginOffset = 0;
+  unsigned EndOffset = 0;
+  int64_t Parent = -1; // index of the region it is nested in
+  std::vector<CachedAccess> MapTo;
+  std::vector<CachedAccess> MapFrom;
+  std::vector<CachedAccess> MapToFrom;
+  std::vector<CachedAccess> MapAlloc;
+  std::vector<CachedAccess> UpdateTo;
+  std::vector<CachedAccess> UpdateFrom;
+  std::vector<CachedClause> Private;
+  std::vector<CachedClause> FirstPrivate;
+  std::vector<CachedSection> Sections;
+  std::vector<CachedSection> UpdateToSections;
+  std::vector<CachedSection> UpdateFromSections;
+};
+
+/* Decisions made by DataTracker::analyze() for one function. Source positions
+ * are offsets from the beginning of the function body so they remain valid
+ * when the function moves within the file.
+ */
+struct CachedAnalysis {
+  std::vector<CachedRegion> Regions; // regions precede those nested in them
+  std::vector<CachedDiagnostic> Diagnostics;
+};
+
+/* Persistent per translation unit cache of analysis results. Results are
+ * keyed by the function's name and a hash of everything the analysis depends
+ * on, see computeAnalysisKey().
+ */
+class AnalysisCache {
+private:
+  struct CacheEntry {
+    uint64_t Key;
+    CachedAnalysis Analysis;
+    bool Used;
+  };
+
+  std::string Path;
+  llvm::StringMap<CacheEntry> Entries;
+
+public:
+  // Returns the path of the cache file for the main file of SM in Dir.
+  static std::string getCachePath(llvm::StringRef Dir,
+                                  const SourceManager &SM);
+
+  // A missing or unreadable cache file results in an empty cache.
+  void load(llvm::StringRef Path);
+  const CachedAnalysis *lookup(llvm::StringRef Name, uint64_t Key);
+  void store(llvm::StringRef Name, uint64_t Key, CachedAnalysis Analysis);
+  // Only the entries looked up or stored since loading are written, so
+  // functions that no longer exist are dropped.
+  bool save();
+};
+
+uint64_t computeAnalysisKey(DataTracker *DT, ASTContext &Context,
+                            bool Aggressive);
+
+#endif
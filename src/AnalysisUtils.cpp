@@ -1,30 +1,215 @@
 #include "AnalysisUtils.h"
 
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <optional>
+
+#include "clang/AST/Mangle.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
+#include "CommonUtils.h"
+#include "Statistics.h"
+
 using namespace clang;
 
+OMPDART_STATISTIC(NumCallGraphComponents,
+                  "Strongly connected components of the call graph");
+OMPDART_STATISTIC(NumSummaryEvaluations,
+                  "Function summaries computed by the fixpoint");
+OMPDART_STATISTIC(NumFixpointRounds,
+                  "Functions re-queued until their component converged");
+OMPDART_STATISTIC(NumExternalSummaries,
+                  "Calls resolved with a summary database");
+
+/* Calls between the functions defined in the translation unit. Functions are
+ * identified by their index into FunctionTrackers.
+ */
+struct TrackerCallGraph {
+  std::vector<std::vector<unsigned>> Callees;
+  std::vector<std::vector<unsigned>> Callers;
+};
+
+struct FunctionSummary {
+  std::vector<uint8_t> ParamModes;
+  boost::container::flat_set<const ValueDecl *> Globals;
+  std::vector<uint8_t> GlobalModes;
+
+  bool operator==(const FunctionSummary &Other) const {
+    return ParamModes == Other.ParamModes && Globals == Other.Globals &&
+           GlobalModes == Other.GlobalModes;
+  }
+};
+
+static TrackerCallGraph
+buildCallGraph(const std::vector<DataTracker *> &FunctionTrackers) {
+  TrackerCallGraph Graph;
+  Graph.Callees.resize(FunctionTrackers.size());
+  Graph.Callers.resize(FunctionTrackers.size());
+
+  llvm::DenseMap<const FunctionDecl *, unsigned> TrackerIndex;
+  for (unsigned I = 0; I < FunctionTrackers.size(); ++I)
+    TrackerIndex[FunctionTrackers[I]->getDecl()] = I;
+
+  for (unsigned I = 0; I < FunctionTrackers.size(); ++I) {
+    boost::container::flat_set<unsigned> Seen;
+    for (const CallExpr *CE : FunctionTrackers[I]->getCallExprs()) {
+      const FunctionDecl *Callee = CE->getDirectCallee()->getDefinition();
+      auto It = TrackerIndex.find(Callee);
+      if (It == TrackerIndex.end() || !Seen.insert(It->second).second)
+        continue;
+      Graph.Callees[I].push_back(It->second);
+      Graph.Callers[It->second].push_back(I);
+    }
+  }
+  return Graph;
+}
+
+/* Tarjan's strongly connected components algorithm. An SCC is only emitted
+ * after every SCC it calls into, so the result is in bottom-up order.
+ */
+class SCCFinder {
+private:
+  const TrackerCallGraph &Graph;
+  std::vector<int> Index;
+  std::vector<int> LowLink;
+  std::vector<bool> OnStack;
+  std::vector<unsigned> Stack;
+  int NextIndex = 0;
+  std::vector<std::vector<unsigned>> SCCs;
+
+  void visit(unsigned V) {
+    Index[V] = LowLink[V] = NextIndex++;
+    Stack.push_back(V);
+    OnStack[V] = true;
+
+    for (unsigned W : Graph.Callees[V]) {
+      if (Index[W] < 0) {
+        visit(W);
+        LowLink[V] = std::min(LowLink[V], LowLink[W]);
+      } else if (OnStack[W]) {
+        LowLink[V] = std::min(LowLink[V], Index[W]);
+      }
+    }
+
+    if (LowLink[V] != Index[V])
+      return;
+
+    std::vector<unsigned> SCC;
+    unsigned W;
+    do {
+      W = Stack.back();
+      Stack.pop_back();
+      OnStack[W] = false;
+      SCC.push_back(W);
+    } while (W != V);
+    SCCs.emplace_back(std::move(SCC));
+  }
+
+public:
+  explicit SCCFinder(const TrackerCallGraph &Graph)
+      : Graph(Graph), Index(Graph.Callees.size(), -1),
+        LowLink(Graph.Callees.size(), -1),
+        OnStack(Graph.Callees.size(), false) {}
+
+  std::vector<std::vector<unsigned>> run() {
+    for (unsigned V = 0; V < Graph.Callees.size(); ++V) {
+      if (Index[V] < 0)
+        visit(V);
+    }
+    return std::move(SCCs);
+  }
+};
+
+static FunctionSummary summarize(DataTracker *DT) {
+  FunctionSummary Summary;
+  Summary.ParamModes = DT->getParamAccessModes(false);
+  Summary.Globals = DT->getGlobals();
+  Summary.GlobalModes = DT->getGlobalAccessModes(false);
+  return Summary;
+}
+
 void performInterproceduralAnalysis(
     std::vector<DataTracker *> &FunctionTrackers) {
   // Using the information we have collected about read and writes we can
   // update calls to functions with the details about how a pointer was used
-  // after it was passed. We may need to do this multiple times as we may need
-  // to resolve more information about one function before we can update
-  // another. So we loop until the number of unknown parameters converges.
-  // TODO: This iterative approach is simplier than a recursive algorithm, but
-  //       inherently cannot resolve recursions.
-  int numUpdates;
-  do {
-    numUpdates = 0;
-    for (DataTracker *DT : FunctionTrackers) {
-      for (DataTracker *TmpDT : FunctionTrackers) {
-        numUpdates += TmpDT->updateTouchedByCallee(
-            DT->getDecl(), DT->getParamAccessModes(false), DT->getGlobals(),
-            DT->getGlobalAccessModes(false));
+  // after it was passed. Functions are visited bottom-up by strongly connected
+  // component so a callee's summary is final before its callers read it.
+  // Mutually recursive functions share a component and are iterated on a
+  // worklist until their summaries stop changing.
+  TrackerCallGraph Graph = buildCallGraph(FunctionTrackers);
+  std::vector<std::vector<unsigned>> SCCs = SCCFinder(Graph).run();
+  NumCallGraphComponents += SCCs.size();
+
+  std::vector<unsigned> SCCOf(FunctionTrackers.size());
+  for (unsigned S = 0; S < SCCs.size(); ++S) {
+    for (unsigned V : SCCs[S])
+      SCCOf[V] = S;
+  }
+
+  std::vector<FunctionSummary> Summaries(FunctionTrackers.size());
+  std::vector<bool> Summarized(FunctionTrackers.size(), false);
+  std::vector<bool> Queued(FunctionTrackers.size(), false);
+  for (const std::vector<unsigned> &SCC : SCCs) {
+    // Calls that stay inside the component start out assuming the callee
+    // touches nothing. Summaries can then only grow, so the iteration below
+    // converges on the least fixpoint instead of keeping the A_UNKNOWN the
+    // visitor assigned to every recursive call.
+    for (unsigned V : SCC) {
+      const FunctionDecl *Callee = FunctionTrackers[V]->getDecl();
+      std::vector<uint8_t> NoAccess(Callee->getNumParams(), A_NOP);
+      for (unsigned C : Graph.Callers[V]) {
+        if (SCCOf[C] == SCCOf[V])
+          FunctionTrackers[C]->updateTouchedByCallee(Callee, NoAccess, {}, {});
       }
     }
+
+    std::deque<unsigned> Worklist(SCC.begin(), SCC.end());
+    for (unsigned V : SCC)
+      Queued[V] = true;
+    while (!Worklist.empty()) {
+      unsigned V = Worklist.front();
+      Worklist.pop_front();
+      Queued[V] = false;
+
+      FunctionSummary Summary = summarize(FunctionTrackers[V]);
+      ++NumSummaryEvaluations;
+      if (Summarized[V] && Summary == Summaries[V])
+        continue;
+      Summaries[V] = std::move(Summary);
+      Summarized[V] = true;
+
+      for (unsigned C : Graph.Callers[V]) {
+        if (SCCOf[C] != SCCOf[V])
+          continue;
+        int NumUpdates = FunctionTrackers[C]->updateTouchedByCallee(
+            FunctionTrackers[V]->getDecl(), Summaries[V].ParamModes,
+            Summaries[V].Globals, Summaries[V].GlobalModes);
+        if (NumUpdates > 0 && !Queued[C]) {
+          ++NumFixpointRounds;
+          Worklist.push_back(C);
+          Queued[C] = true;
+        }
+      }
+    }
+
+    // The component is final. Pass its summaries up to the callers outside of
+    // it, which all belong to components that are visited later.
+    for (unsigned V : SCC) {
+      for (unsigned C : Graph.Callers[V]) {
+        if (SCCOf[C] == SCCOf[V])
+          continue;
+        FunctionTrackers[C]->updateTouchedByCallee(
+            FunctionTrackers[V]->getDecl(), Summaries[V].ParamModes,
+            Summaries[V].Globals, Summaries[V].GlobalModes);
+      }
+    }
+  }
 #if DEBUG_LEVEL >= 1
-    llvm::outs() << numUpdates << "\n";
+  llvm::outs() << "Interprocedural analysis visited " << SCCs.size()
+               << " components\n";
 #endif
-  } while (numUpdates > 0);
   return;
 }
 
@@ -44,8 +229,10 @@ void performAggressiveCrossFunctionOffloading(
     GlobalAccessModess.emplace_back(DT->getGlobalAccessModes(true));
   }
 
-  for (DataTracker *DT : FunctionTrackers) {
-    for (int I = 0; I < FunctionTrackers.size(); ++I) {
+  TrackerCallGraph Graph = buildCallGraph(FunctionTrackers);
+  for (unsigned C = 0; C < FunctionTrackers.size(); ++C) {
+    DataTracker *DT = FunctionTrackers[C];
+    for (unsigned I : Graph.Callees[C]) {
 #if DEBUG_LEVEL >= 1
       llvm::outs() << "ParamAccessModess for "
                    << DT->getDecl()->getNameAsString() << " calling "
@@ -58,3 +245,519 @@ void performAggressiveCrossFunctionOffloading(
   }
   return;
 }
+
+/* Determines the number of elements of the buffers passed to pointer
+ * parameters from the allocations at the call sites. A parameter gets an
+ * extent only if every call in the translation unit passes the same one, so
+ * only functions without external linkage are considered. This is iterated so
+ * extents are passed on through chains of calls.
+ */
+void propagateParamExtents(std::vector<DataTracker *> &FunctionTrackers) {
+  TrackerCallGraph Graph = buildCallGraph(FunctionTrackers);
+
+  for (size_t Round = 0; Round <= FunctionTrackers.size(); ++Round) {
+    bool Changed = false;
+    for (unsigned C = 0; C < FunctionTrackers.size(); ++C) {
+      const FunctionDecl *FD = FunctionTrackers[C]->getDecl();
+      // A visible function may be called from other translation units with
+      // buffers of any size, even if this one defines main.
+      if (Graph.Callers[C].empty() || FD->isExternallyVisible())
+        continue;
+
+      for (unsigned I = 0; I < FD->getNumParams(); ++I) {
+        const ParmVarDecl *Param = FD->getParamDecl(I);
+        if (!Param->getType()->isPointerType())
+          continue;
+        std::optional<ParamExtent> Merged;
+        bool Known = true;
+        for (unsigned Caller : Graph.Callers[C]) {
+          DataTracker *CallerDT = FunctionTrackers[Caller];
+          for (const CallExpr *CE : CallerDT->getCallExprs()) {
+            if (CE->getDirectCallee()->getDefinition() != FD)
+              continue;
+            ParamExtent Extent;
+            if (!CallerDT->getArgumentExtent(CE, I, Extent) ||
+                (Merged && !(*Merged == Extent))) {
+              Known = false;
+              break;
+            }
+            Merged = Extent;
+          }
+          if (!Known)
+            break;
+        }
+        if (Known && Merged &&
+            FunctionTrackers[C]->setParamExtent(Param, *Merged))
+          Changed = true;
+      }
+    }
+    if (!Changed)
+      break;
+  }
+}
+
+/* Finds the variables with external linkage declared in DC, by mangled name.
+ * These are the globals a summary from another translation unit can refer to.
+ */
+static void collectExternalGlobals(const DeclContext *DC,
+                                   ASTNameGenerator &NameGen,
+                                   llvm::StringMap<const ValueDecl *> &Found) {
+  for (const Decl *D : DC->decls()) {
+    if (const auto *VD = dyn_cast<VarDecl>(D)) {
+      if (VD->hasGlobalStorage() && VD->isExternallyVisible())
+        Found[NameGen.getName(VD)] = VD;
+    } else if (isa<NamespaceDecl>(D) || isa<LinkageSpecDecl>(D)) {
+      collectExternalGlobals(cast<DeclContext>(D), NameGen, Found);
+    }
+  }
+}
+
+void applyExternalSummaries(
+    std::vector<DataTracker *> &FunctionTrackers,
+    const std::vector<std::unique_ptr<SummaryDatabase>> &Databases,
+    ASTContext &Context) {
+  // Calls to functions that are not defined in this translation unit were
+  // recorded as unknown accesses. Replace those with the summaries that were
+  // computed when the translation unit defining the callee was analyzed.
+  // Summaries are final, so this is done once before the callers are
+  // summarized themselves.
+  if (Databases.empty())
+    return;
+
+  ASTNameGenerator NameGen(Context);
+  llvm::StringMap<const ValueDecl *> ExternalGlobals;
+  collectExternalGlobals(Context.getTranslationUnitDecl(), NameGen,
+                         ExternalGlobals);
+
+  for (DataTracker *DT : FunctionTrackers) {
+    boost::container::flat_set<const FunctionDecl *> Visited;
+    for (const CallExpr *CE : DT->getCallExprs()) {
+      const FunctionDecl *Callee = CE->getDirectCallee();
+      if (Callee->getDefinition() ||
+          !Visited.insert(Callee->getCanonicalDecl()).second)
+        continue;
+
+      ExternalSummary Summary;
+      const SummaryDatabase *Found = nullptr;
+      std::string Name = NameGen.getName(Callee);
+      for (const std::unique_ptr<SummaryDatabase> &DB : Databases) {
+        if (DB->lookup(Name, Summary)) {
+          Found = DB.get();
+          break;
+        }
+      }
+      if (!Found)
+        continue;
+
+      // A_OFFLD tells the caller to map the data itself. The callee only left
+      // that to its callers if it was analyzed aggressively.
+      if (!Found->isAggressive()) {
+        for (uint8_t &Mode : Summary.ParamModes)
+          Mode &= ~A_OFFLD;
+      }
+
+      // Globals are passed in the iteration order of the set.
+      std::vector<std::pair<const ValueDecl *, uint8_t>> Globals;
+      for (const auto &Global : Summary.GlobalModes) {
+        auto It = ExternalGlobals.find(Global.first);
+        if (It == ExternalGlobals.end())
+          continue;
+        uint8_t Mode = Global.second;
+        if (!Found->isAggressive())
+          Mode &= ~A_OFFLD;
+        Globals.emplace_back(It->second, Mode);
+      }
+      std::sort(Globals.begin(), Globals.end());
+      boost::container::flat_set<const ValueDecl *> GlobalsAccessed;
+      std::vector<uint8_t> GlobalModes;
+      for (const auto &Global : Globals) {
+        if (GlobalsAccessed.insert(Global.first).second)
+          GlobalModes.push_back(Global.second);
+      }
+
+#if DEBUG_LEVEL >= 1
+      llvm::outs() << "Applying external summary of " << Name << " to "
+                   << DT->getDecl()->getNameAsString() << "\n";
+#endif
+      DT->updateTouchedByCallee(Callee, Summary.ParamModes, GlobalsAccessed,
+                                GlobalModes);
+      ++NumExternalSummaries;
+    }
+  }
+  return;
+}
+
+void addFunctionSummaries(std::vector<DataTracker *> &FunctionTrackers,
+                          SummaryDatabaseBuilder &Builder,
+                          ASTContext &Context) {
+  // Only functions and globals that other translation units can refer to are
+  // worth summarizing.
+  ASTNameGenerator NameGen(Context);
+  for (DataTracker *DT : FunctionTrackers) {
+    const FunctionDecl *FD = DT->getDecl();
+    if (!FD->isExternallyVisible())
+      continue;
+
+    ExternalSummary Summary;
+    for (const ParmVarDecl *Param : FD->parameters()) {
+      QualType ParamType = Param->getType();
+      if (!ParamType->isPointerType() && !ParamType->isReferenceType())
+        Summary.ParamModes.push_back(A_NOP);
+      else
+        Summary.ParamModes.push_back(DT->getAccessMode(Param));
+    }
+    for (const ValueDecl *Global : DT->getGlobals()) {
+      const auto *VD = dyn_cast<VarDecl>(Global);
+      if (!VD || !VD->hasGlobalStorage() || !VD->isExternallyVisible())
+        continue;
+      Summary.GlobalModes.emplace_back(NameGen.getName(VD),
+                                       DT->getAccessMode(VD));
+    }
+    Builder.add(NameGen.getName(FD), std::move(Summary));
+  }
+  return;
+}
+
+/* Adds to Decls the variables passed as arguments to parameters in Decls if
+ * ToCallers is set, or the parameters that variables in Decls are passed to
+ * otherwise, until no more are found.
+ */
+static void
+propagateThroughCalls(const std::vector<DataTracker *> &FunctionTrackers,
+                      boost::container::flat_set<const ValueDecl *> &Decls,
+                      bool ToCallers) {
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (DataTracker *DT : FunctionTrackers) {
+      for (const CallExpr *CE : DT->getCallExprs()) {
+        const FunctionDecl *Callee = CE->getDirectCallee()->getDefinition();
+        if (!Callee)
+          continue;
+        for (unsigned I = 0;
+             I < CE->getNumArgs() && I < Callee->getNumParams(); ++I) {
+          const DeclRefExpr *DRE =
+              dyn_cast<DeclRefExpr>(CE->getArg(I)->IgnoreParenImpCasts());
+          if (!DRE)
+            continue;
+          const ValueDecl *Arg = DRE->getDecl();
+          const ValueDecl *Param = Callee->getParamDecl(I);
+          if (ToCallers && Decls.contains(Param))
+            Changed |= Decls.insert(Arg).second;
+          else if (!ToCallers && Decls.contains(Arg))
+            Changed |= Decls.insert(Param).second;
+        }
+      }
+    }
+  }
+}
+
+/* Keeps the buffers of local pointers on the device from their allocation
+ * until they are freed, rather than mapping them anew in every target data
+ * region. Only buffers mapped by a region, in their function or in a callee
+ * they are passed to, are kept. The regions mapping them are told the data may
+ * already be present. Returns the number of buffers.
+ */
+unsigned planDeviceAllocations(std::vector<DataTracker *> &FunctionTrackers) {
+  // Variables whose buffer is mapped by a target data region, in the function
+  // itself or in a callee it is passed to.
+  boost::container::flat_set<const ValueDecl *> Offloaded;
+  for (DataTracker *DT : FunctionTrackers) {
+    for (const TargetDataRegion *Region : DT->getTargetDataScopes()) {
+      for (const std::vector<AccessInfo> *Maps :
+           {&Region->getMapTo(), &Region->getMapFrom(),
+            &Region->getMapToFrom(), &Region->getMapAlloc()}) {
+        for (const AccessInfo &Access : *Maps)
+          Offloaded.insert(Access.VD);
+      }
+    }
+  }
+  propagateThroughCalls(FunctionTrackers, Offloaded, true);
+
+  boost::container::flat_set<const ValueDecl *> Entered;
+  unsigned Planned = 0;
+  for (DataTracker *DT : FunctionTrackers) {
+    for (const ValueDecl *Local : DT->getLocals()) {
+      if (!isa<ParmVarDecl>(Local) && Offloaded.contains(Local) &&
+          DT->planDeviceAllocation(Local)) {
+        Entered.insert(Local);
+        ++Planned;
+      }
+    }
+  }
+  if (!Planned)
+    return 0;
+
+  // The regions of callees may be passed an entered buffer as well.
+  propagateThroughCalls(FunctionTrackers, Entered, false);
+  for (DataTracker *DT : FunctionTrackers)
+    DT->markPresentOnEntry(Entered);
+  return Planned;
+}
+
+/* Returns true if a copy of FD under another name can be added after it and
+ * called with the arguments of any call of FD.
+ */
+static bool isClonable(const FunctionDecl *FD) {
+  return !isa<CXXMethodDecl>(FD) && FD->getIdentifier() &&
+         FD->getTemplatedKind() == FunctionDecl::TK_NonTemplate &&
+         !FD->isVariadic() && FD->getLexicalDeclContext()->isFileContext() &&
+         FD->getFirstDecl()->getMinRequiredArguments() == FD->getNumParams();
+}
+
+/* Moves the mappings of pointer parameters that callees only use on the device
+ * out of their target data regions, into regions the callers wrap around the
+ * loops the calls are in. The data is then transferred once per loop rather
+ * than once per call. Callees with internal linkage whose every call is
+ * hoisted this way only look up the device data. If Clones is set, calls that
+ * have mapped more than the others get a copy of the callee that relies on it,
+ * added to Clones. Returns the number of regions created.
+ */
+unsigned hoistCalleeRegions(std::vector<DataTracker *> &FunctionTrackers,
+                            std::vector<FunctionClone> *Clones) {
+  TrackerCallGraph Graph = buildCallGraph(FunctionTrackers);
+  llvm::DenseMap<const FunctionDecl *, unsigned> TrackerIndex;
+  for (unsigned I = 0; I < FunctionTrackers.size(); ++I)
+    TrackerIndex[FunctionTrackers[I]->getDecl()] = I;
+
+  // The data each callee transfers for the parameters it maps and only uses on
+  // the device, to the device if A_RDONLY is set and from it if A_WRONLY is.
+  std::vector<std::vector<std::optional<uint8_t>>> Transfers;
+  for (DataTracker *DT : FunctionTrackers) {
+    const FunctionDecl *FD = DT->getDecl();
+    Transfers.emplace_back(FD->getNumParams());
+    for (unsigned I = 0; I < FD->getNumParams(); ++I) {
+      const ParmVarDecl *Param = FD->getParamDecl(I);
+      if (!Param->getType()->isPointerType() || !DT->isOnlyOffloaded(Param))
+        continue;
+      for (const TargetDataRegion *Region : DT->getTargetDataScopes()) {
+        auto Maps = [Param](const std::vector<AccessInfo> &Accesses) {
+          return std::any_of(
+              Accesses.begin(), Accesses.end(),
+              [Param](const AccessInfo &Access) { return Access.VD == Param; });
+        };
+        uint8_t Flags = A_NOP;
+        if (Maps(Region->getMapTo()))
+          Flags = A_RDONLY;
+        else if (Maps(Region->getMapFrom()))
+          Flags = A_WRONLY;
+        else if (Maps(Region->getMapToFrom()))
+          Flags = A_RDWR;
+        else if (!Maps(Region->getMapAlloc()))
+          continue;
+        Transfers.back()[I] =
+            static_cast<uint8_t>(Transfers.back()[I].value_or(A_NOP) | Flags);
+      }
+    }
+  }
+
+  unsigned Created = 0;
+  llvm::DenseMap<const CallExpr *, std::vector<unsigned>> HoistedArgs;
+  for (DataTracker *DT : FunctionTrackers) {
+    // The calls passing each variable to a parameter that can be hoisted, in
+    // the order of the first call.
+    std::vector<std::pair<const ValueDecl *,
+                          std::vector<std::pair<const CallExpr *, uint8_t>>>>
+        Candidates;
+    std::vector<std::pair<const CallExpr *, unsigned>> Args;
+    for (const CallExpr *CE : DT->getCallExprs()) {
+      auto It = TrackerIndex.find(CE->getDirectCallee()->getDefinition());
+      if (It == TrackerIndex.end())
+        continue;
+      const auto &CalleeTransfers = Transfers[It->second];
+      for (unsigned I = 0;
+           I < CE->getNumArgs() && I < CalleeTransfers.size(); ++I) {
+        const DeclRefExpr *DRE =
+            dyn_cast<DeclRefExpr>(CE->getArg(I)->IgnoreParenImpCasts());
+        if (!CalleeTransfers[I] || !DRE)
+          continue;
+        auto Candidate = std::find_if(
+            Candidates.begin(), Candidates.end(),
+            [DRE](const auto &C) { return C.first == DRE->getDecl(); });
+        if (Candidate == Candidates.end()) {
+          Candidates.push_back({DRE->getDecl(), {}});
+          Candidate = std::prev(Candidates.end());
+        }
+        Candidate->second.emplace_back(CE, *CalleeTransfers[I]);
+        Args.emplace_back(CE, I);
+      }
+    }
+
+    for (const auto &Candidate : Candidates) {
+      std::vector<const CallExpr *> Hoisted;
+      Created +=
+          DT->hoistCalleeMappings(Candidate.first, Candidate.second, Hoisted);
+      for (const auto &Arg : Args) {
+        const DeclRefExpr *DRE = cast<DeclRefExpr>(
+            Arg.first->getArg(Arg.second)->IgnoreParenImpCasts());
+        if (DRE->getDecl() == Candidate.first &&
+            std::find(Hoisted.begin(), Hoisted.end(), Arg.first) !=
+                Hoisted.end())
+          HoistedArgs[Arg.first].push_back(Arg.second);
+      }
+    }
+  }
+
+  for (unsigned C = 0; C < FunctionTrackers.size(); ++C) {
+    const FunctionDecl *FD = FunctionTrackers[C]->getDecl();
+    // The calls by the parameters they have mapped already, with the function
+    // making them.
+    std::vector<std::pair<std::vector<unsigned>,
+                          std::vector<std::pair<const CallExpr *, unsigned>>>>
+        Contexts;
+    for (unsigned Caller : Graph.Callers[C]) {
+      for (const CallExpr *CE : FunctionTrackers[Caller]->getCallExprs()) {
+        if (CE->getDirectCallee()->getDefinition() != FD)
+          continue;
+        std::vector<unsigned> Params = HoistedArgs.lookup(CE);
+        std::sort(Params.begin(), Params.end());
+        Params.erase(std::unique(Params.begin(), Params.end()), Params.end());
+        auto Context = std::find_if(
+            Contexts.begin(), Contexts.end(),
+            [&Params](const auto &Other) { return Other.first == Params; });
+        if (Context == Contexts.end()) {
+          Contexts.push_back({Params, {}});
+          Context = std::prev(Contexts.end());
+        }
+        Context->second.emplace_back(CE, Caller);
+      }
+    }
+    if (Contexts.empty())
+      continue;
+
+    // Parameters that every call has mapped already. A visible function may
+    // be called from other translation units, even if this one defines main.
+    std::vector<unsigned> Common;
+    if (!FD->isExternallyVisible()) {
+      Common = Contexts.front().first;
+      for (const auto &Context : Contexts) {
+        std::vector<unsigned> Both;
+        std::set_intersection(Common.begin(), Common.end(),
+                              Context.first.begin(), Context.first.end(),
+                              std::back_inserter(Both));
+        Common = std::move(Both);
+      }
+    }
+    for (unsigned I : Common)
+      FunctionTrackers[C]->assumePresent(FD->getParamDecl(I));
+    if (!Clones || !isClonable(FD))
+      continue;
+
+    // Calls that have mapped more get a clone of their own. Only the calls in
+    // the translation unit call a clone, so it may rely on them.
+    SourceManager &SM = FD->getASTContext().getSourceManager();
+    unsigned FDOffset = getMainFileOffset(SM, FD->getBeginLoc());
+    unsigned Clone = 0;
+    for (const auto &Context : Contexts) {
+      if (Context.first.size() == Common.size())
+        continue;
+      FunctionClone NewClone;
+      NewClone.Tracker = FunctionTrackers[C];
+      NewClone.Name =
+          FD->getNameAsString() + "_ompdart" + std::to_string(++Clone);
+      for (unsigned I : Context.first)
+        NewClone.Present.push_back(FD->getParamDecl(I));
+      unsigned DeclOffset = FDOffset;
+      for (const auto &Call : Context.second) {
+        const FunctionDecl *CallerFD = FunctionTrackers[Call.second]->getDecl();
+        unsigned CallerOffset = getMainFileOffset(SM, CallerFD->getBeginLoc());
+        // A caller before the clone needs a declaration of it in front.
+        if (Call.second == C ||
+            (CallerOffset < FDOffset &&
+             !CallerFD->getLexicalDeclContext()->isFileContext()))
+          continue;
+        if (CallerOffset < DeclOffset) {
+          DeclOffset = CallerOffset;
+          NewClone.DeclLoc = CallerFD->getBeginLoc();
+        }
+        NewClone.Calls.push_back(Call.first);
+      }
+      if (!NewClone.Calls.empty())
+        Clones->push_back(std::move(NewClone));
+    }
+  }
+  return Created;
+}
+
+static bool isNamed(const ValueDecl *VD, llvm::StringRef Name) {
+  const IdentifierInfo *II = VD->getIdentifier();
+  return II && II->getName() == Name;
+}
+
+/* Finds the variable Name refers to in a pragma at Loc in the function of DT:
+ * the local or parameter of that name declared last before Loc, or else a
+ * global the function uses.
+ */
+static const ValueDecl *findPragmaDecl(DataTracker *DT, llvm::StringRef Name,
+                                       SourceLocation Loc,
+                                       const SourceManager &SM) {
+  const ValueDecl *Found = nullptr;
+  for (const ValueDecl *Local : DT->getLocals()) {
+    if (!isNamed(Local, Name) ||
+        !SM.isBeforeInTranslationUnit(Local->getLocation(), Loc))
+      continue;
+    if (!Found || SM.isBeforeInTranslationUnit(Found->getLocation(),
+                                               Local->getLocation()))
+      Found = Local;
+  }
+  if (Found)
+    return Found;
+  for (const ValueDecl *Global : DT->getGlobals()) {
+    if (isNamed(Global, Name))
+      return Global;
+  }
+  return nullptr;
+}
+
+/* Applies the properties asserted by `#pragma ompdart` in the main file. A
+ * pragma within a function refers to that function's variables and the globals
+ * it uses. One outside of every function refers to a global, in every function
+ * using it. Returns the number of variables given properties.
+ */
+unsigned applyPragmas(std::vector<DataTracker *> &FunctionTrackers,
+                      const std::vector<OmpDartPragma> &Pragmas,
+                      ASTContext &Context) {
+  const SourceManager &SM = Context.getSourceManager();
+  DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+  unsigned Asserted = 0;
+  for (const OmpDartPragma &Pragma : Pragmas) {
+    if (!SM.isInMainFile(Pragma.Loc))
+      continue;
+    auto Function = std::find_if(
+        FunctionTrackers.begin(), FunctionTrackers.end(),
+        [&Pragma](DataTracker *DT) { return DT->contains(Pragma.Loc); });
+
+    for (const std::string &Name : Pragma.Names) {
+      bool Found = false;
+      if (Function != FunctionTrackers.end()) {
+        if (const ValueDecl *VD = findPragmaDecl(*Function, Name, Pragma.Loc,
+                                                 SM)) {
+          (*Function)->assertProperties(VD, Pragma.Properties);
+          Found = true;
+        }
+      } else {
+        const DeclContext::lookup_result Result =
+            Context.getTranslationUnitDecl()->lookup(
+                &Context.Idents.get(Name));
+        Found = std::any_of(Result.begin(), Result.end(),
+                            [](const NamedDecl *D) { return isa<VarDecl>(D); });
+        for (DataTracker *DT : FunctionTrackers) {
+          for (const ValueDecl *Global : DT->getGlobals()) {
+            const auto *Var = dyn_cast<VarDecl>(Global);
+            if (Var && Var->isFileVarDecl() && isNamed(Var, Name))
+              DT->assertProperties(Var, Pragma.Properties);
+          }
+        }
+      }
+      if (Found) {
+        ++Asserted;
+        continue;
+      }
+      const unsigned int DiagID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Warning,
+          "unknown variable '%0' in '#pragma ompdart' - ignoring it");
+      DiagEngine.Report(Pragma.Loc, DiagID) << Name;
+    }
+  }
+  return Asserted;
+}
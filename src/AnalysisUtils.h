@@ -2,10 +2,35 @@
 #define ANALYSISUTILS_H
 
 #include "DataTracker.h"
+#include "OmpDartPragma.h"
+#include "SummaryDatabase.h"
 
 using namespace clang;
 
+// A copy of the function of Tracker named Name, called by Calls instead of the
+// original. Its callers have mapped the data of Present around the calls. A
+// declaration of it goes before DeclLoc if that is valid.
+struct FunctionClone {
+  DataTracker *Tracker;
+  std::string Name;
+  std::vector<const ValueDecl *> Present;
+  std::vector<const CallExpr *> Calls;
+  SourceLocation DeclLoc;
+};
+
 void performInterproceduralAnalysis(std::vector<DataTracker *> &FunctionTrackers);
+void propagateParamExtents(std::vector<DataTracker *> &FunctionTrackers);
 void performAggressiveCrossFunctionOffloading(std::vector<DataTracker *> &FunctionTrackers);
+void applyExternalSummaries(std::vector<DataTracker *> &FunctionTrackers,
+                            const std::vector<std::unique_ptr<SummaryDatabase>> &Databases,
+                            ASTContext &Context);
+void addFunctionSummaries(std::vector<DataTracker *> &FunctionTrackers,
+                          SummaryDatabaseBuilder &Builder, ASTContext &Context);
+unsigned hoistCalleeRegions(std::vector<DataTracker *> &FunctionTrackers,
+                            std::vector<FunctionClone> *Clones);
+unsigned planDeviceAllocations(std::vector<DataTracker *> &FunctionTrackers);
+unsigned applyPragmas(std::vector<DataTracker *> &FunctionTrackers,
+                      const std::vector<OmpDartPragma> &Pragmas,
+                      ASTContext &Context);
 
 #endif
\ No newline at end of file
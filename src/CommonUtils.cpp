@@ -1,9 +1,91 @@
 #include "CommonUtils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <mutex>
+
+#include "clang/AST/ParentMapContext.h"
 #include "clang/AST/StmtOpenMP.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
 
 using namespace clang;
 
+// SourceManager caches the last FileID lookup, so location queries are not
+// safe to make from several analysis threads at once. Each SourceManager
+// shared by such threads has its own mutex.
+static std::mutex SharedManagersMutex;
+static llvm::DenseMap<const SourceManager *, std::unique_ptr<std::mutex>>
+    SharedManagers;
+static std::atomic<unsigned> NumSharedManagers(0);
+
+SharedSourceManager::SharedSourceManager(const SourceManager &SM) : SM(SM) {
+  std::lock_guard<std::mutex> Lock(SharedManagersMutex);
+  SharedManagers[&SM] = std::make_unique<std::mutex>();
+  ++NumSharedManagers;
+}
+
+SharedSourceManager::~SharedSourceManager() {
+  std::lock_guard<std::mutex> Lock(SharedManagersMutex);
+  SharedManagers.erase(&SM);
+  --NumSharedManagers;
+}
+
+/* Locks the mutex of SM if it is shared by several threads.
+ */
+static std::unique_lock<std::mutex> lockSourceManager(const SourceManager &SM) {
+  if (NumSharedManagers == 0)
+    return std::unique_lock<std::mutex>();
+  std::lock_guard<std::mutex> Lock(SharedManagersMutex);
+  auto It = SharedManagers.find(&SM);
+  if (It == SharedManagers.end())
+    return std::unique_lock<std::mutex>();
+  return std::unique_lock<std::mutex>(*It->second);
+}
+
+/* Returns the offset of Loc into the main file. Macro locations use the
+ * position of their expansion. Locations outside of the main file return
+ * UINT_MAX so they never fall within a range of the main file.
+ */
+unsigned getMainFileOffset(const SourceManager &SM, SourceLocation Loc) {
+  auto Lock = lockSourceManager(SM);
+  std::pair<FileID, unsigned> Decomposed = SM.getDecomposedExpansionLoc(Loc);
+  if (Decomposed.first != SM.getMainFileID())
+    return UINT_MAX;
+  return Decomposed.second;
+}
+
+/* Same as getMainFileOffset but for the last location of a range. A range
+ * ending inside a macro expansion ends where the expansion ends.
+ */
+unsigned getMainFileEndOffset(const SourceManager &SM, SourceLocation Loc) {
+  if (Loc.isMacroID()) {
+    auto Lock = lockSourceManager(SM);
+    Loc = SM.getExpansionRange(Loc).getEnd();
+  }
+  return getMainFileOffset(SM, Loc);
+}
+
+/* Returns the text of the token range Range as written in the file, or an
+ * empty string if it does not map to one contiguous piece of a file.
+ */
+std::string getSourceText(const SourceManager &SM, const LangOptions &LangOpts,
+                          SourceRange Range) {
+  auto Lock = lockSourceManager(SM);
+  CharSourceRange CharRange = Lexer::makeFileCharRange(
+      CharSourceRange::getTokenRange(Range), SM, LangOpts);
+  if (CharRange.isInvalid())
+    return "";
+  bool Invalid = false;
+  llvm::StringRef Text =
+      Lexer::getSourceText(CharRange, SM, LangOpts, &Invalid);
+  if (Invalid)
+    return "";
+  return Text.str();
+}
+
 bool isPtrOrRefToConst(QualType Type) {
   if (!Type->isAnyPointerType() && !Type->isReferenceType())
     return false;
@@ -84,3 +166,52 @@ bool isaTargetKernel(const Stmt *S) {
          isa<OMPTargetTeamsDistributeSimdDirective>(S) ||
          isa<OMPTargetTeamsGenericLoopDirective>(S);
 }
+
+/* Finds the outermost Stmt in ContainingStmt that captures S. Returns NULL on
+ * error.
+ */
+const Stmt *getSemiTerminatedStmt(ASTContext &Context, const Stmt *S) {
+  const Stmt *CurrentStmt = S;
+  while (true) {
+#if DEBUG_LEVEL >= 1
+    CurrentStmt->printPretty(llvm::outs(), NULL, PrintingPolicy(LangOptions()));
+    llvm::outs() << "end\n";
+#endif
+    const auto &ImmediateParents = Context.getParents(*CurrentStmt);
+    if (ImmediateParents.size() == 0)
+      return nullptr;
+
+    const Stmt *ParentStmt = ImmediateParents[0].get<Stmt>();
+    if (!ParentStmt) {
+      const VarDecl *VD = ImmediateParents[0].get<VarDecl>();
+      if (VD == nullptr) {
+        // we may need a more specific check here. This was added because a for
+        // loop didn't have a parent. So this works for now.
+        return CurrentStmt;
+      }
+      const auto &VDParents = Context.getParents(*VD);
+      return VDParents[0].get<Stmt>();
+    }
+
+    if (isa<CompoundStmt>(ParentStmt))
+      return CurrentStmt;
+
+    CurrentStmt = ParentStmt;
+  }
+}
+
+/* Returns the statement following S in the compound statement containing it,
+ * or NULL if S is the last one or not directly within a compound statement.
+ */
+const Stmt *getNextStmt(ASTContext &Context, const Stmt *S) {
+  const auto &ImmediateParents = Context.getParents(*S);
+  if (ImmediateParents.size() == 0)
+    return nullptr;
+  const CompoundStmt *Parent = ImmediateParents[0].get<CompoundStmt>();
+  if (!Parent)
+    return nullptr;
+  auto It = std::find(Parent->body_begin(), Parent->body_end(), S);
+  if (It == Parent->body_end() || ++It == Parent->body_end())
+    return nullptr;
+  return *It;
+}
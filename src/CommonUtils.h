@@ -3,15 +3,36 @@
 
 #include "clang/AST/Type.h"
 #include "clang/AST/Expr.h"
+#include "clang/Basic/SourceManager.h"
 
 using namespace clang;
 
+// While alive, location queries on SM are serialized so that functions of its
+// translation unit can be analyzed on several threads. Queries on other
+// SourceManagers, and all queries when none is shared, take no lock.
+class SharedSourceManager {
+private:
+  const SourceManager &SM;
+
+public:
+  explicit SharedSourceManager(const SourceManager &SM);
+  ~SharedSourceManager();
+  SharedSourceManager(const SharedSourceManager &) = delete;
+  SharedSourceManager &operator=(const SharedSourceManager &) = delete;
+};
+
+unsigned getMainFileOffset(const SourceManager &SM, SourceLocation Loc);
+unsigned getMainFileEndOffset(const SourceManager &SM, SourceLocation Loc);
+std::string getSourceText(const SourceManager &SM, const LangOptions &LangOpts,
+                          SourceRange Range);
 bool isPtrOrRefToConst(QualType Type);
 bool isMemAlloc(const FunctionDecl *Callee);
 bool isMemDealloc(const FunctionDecl *Callee);
 const DeclRefExpr *getLeftmostDecl(const Stmt *S);
 bool usedInStmt(const Stmt *S, const ValueDecl *VD);
 bool isaTargetKernel(const Stmt *S);
+const Stmt *getSemiTerminatedStmt(ASTContext &Context, const Stmt *S);
+const Stmt *getNextStmt(ASTContext &Context, const Stmt *S);
 const ArraySubscriptExpr *fetchArraySubscript(ASTContext *Context,
                                               const DeclRefExpr *DRE);
 
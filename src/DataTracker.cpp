@@ -1,13 +1,33 @@
 #include "DataTracker.h"
 
+#include <algorithm>
+#include <cstdint>
+
 #include "clang/AST/ParentMapContext.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/MathExtras.h"
 
 #include "CommonUtils.h"
+#include "Statistics.h"
 
 using namespace clang;
 
+OMPDART_STATISTIC(NumAccessLogEntries, "Access log entries inserted");
+OMPDART_STATISTIC(MaxAccessLogSize, "Largest access log of a function");
+OMPDART_STATISTIC(NumClassifyCalls, "Calls to classifyOffloadedOps");
+OMPDART_STATISTIC(NumValueDeclsAnalyzed, "Declarations analyzed for mapping");
+OMPDART_STATISTIC(NumUpdatesPruned, "Updates redundant on every path removed");
+OMPDART_STATISTIC(NumUpdatesHoisted,
+                  "Updates moved next to the write they transfer");
+OMPDART_PHASE(ClassifyPhase, "classifyOffloadedOps",
+              "Classifying accesses by kernel");
+OMPDART_PHASE(BuildCFGPhase, "buildCFG", "Control flow graph construction");
+OMPDART_PHASE(AnalyzeValueDeclPhase, "analyzeValueDecl",
+              "Per declaration mapping analysis (summed over threads)");
+
 struct LoopDependency {
   bool DataValidOnHost;
   bool DataValidOnDevice;
@@ -27,6 +47,12 @@ DataTracker::DataTracker(FunctionDecl *FD, ASTContext *Context) {
   }
   this->LastKernel = nullptr;
   this->TargetScope = nullptr;
+  this->SortedAccessLogSize = 0;
+
+  SourceManager &SM = Context->getSourceManager();
+  Stmt *Body = FD->getBody();
+  this->BodyBeginOffset = getMainFileOffset(SM, Body->getBeginLoc());
+  this->BodyEndOffset = getMainFileEndOffset(SM, Body->getEndLoc());
 
   this->LastArrayBasePointer = nullptr;
   this->LastArraySubscript = nullptr;
@@ -35,35 +61,68 @@ DataTracker::DataTracker(FunctionDecl *FD, ASTContext *Context) {
 const FunctionDecl *DataTracker::getDecl() const { return FD; }
 
 bool DataTracker::contains(SourceLocation Loc) const {
-  SourceManager &SM = Context->getSourceManager();
-  Stmt *Body = FD->getBody();
-  SourceLocation BodyBeginLoc = Body->getBeginLoc();
-  SourceLocation BodyEndLoc = Body->getEndLoc();
-  return !SM.isBeforeInTranslationUnit(Loc, BodyBeginLoc) &&
-         SM.isBeforeInTranslationUnit(Loc, BodyEndLoc);
+  unsigned Offset = getMainFileOffset(Context->getSourceManager(), Loc);
+  return BodyBeginOffset <= Offset && Offset < BodyEndOffset;
 }
 
 int DataTracker::insertAccessLogEntry(const AccessInfo &NewEntry) {
-  if (AccessLog.empty()) {
-    AccessLog.push_back(NewEntry);
-    return 1;
-  }
+  // Appending keeps recording linear. The log is put back into order of
+  // increasing main file offset by sortAccessLog() before anything reads it in
+  // order.
+  if (NewEntry.VD)
+    AccessIndex[{NewEntry.VD, NewEntry.Loc.getRawEncoding()}] =
+        AccessLog.size();
+  AccessLog.push_back(NewEntry);
+  ++NumAccessLogEntries;
+  MaxAccessLogSize.updateMax(AccessLog.size());
 
-  // Insert into AccessLog. Maintain order of increasing SourceLocation.
-  // New accesses will usually be somewhere within the last few SourceLocations
-  // so iterating backwards is quick.
-  std::vector<AccessInfo>::iterator It = AccessLog.end();
   SourceManager &SM = Context->getSourceManager();
-  do {
-    --It;
-  } while (SM.isBeforeInTranslationUnit(NewEntry.Loc, It->Loc));
-
-  // insert at correct position in AccessLog
-  ++It;
-  AccessLog.insert(It, NewEntry);
+  AccessInfo &Entry = AccessLog.back();
+  switch (Entry.Barrier) {
+  case ScopeBarrier::KernelEnd:
+  case ScopeBarrier::LoopEnd:
+  case ScopeBarrier::CondEnd:
+    Entry.Offset = getMainFileEndOffset(SM, Entry.Loc);
+    break;
+  default:
+    Entry.Offset = getMainFileOffset(SM, Entry.Loc);
+    break;
+  }
   return 1;
 }
 
+/* Sorts the entries appended since the last call and merges them into the
+ * already ordered prefix of the AccessLog. Both steps are stable, so entries
+ * sharing an offset stay in the order they were recorded in.
+ */
+void DataTracker::sortAccessLog() {
+  if (SortedAccessLogSize == AccessLog.size())
+    return;
+
+  auto IsBefore = [](const AccessInfo &A, const AccessInfo &B) {
+    return A.Offset < B.Offset;
+  };
+  auto Middle = AccessLog.begin() + SortedAccessLogSize;
+  std::stable_sort(Middle, AccessLog.end(), IsBefore);
+  std::inplace_merge(AccessLog.begin(), Middle, AccessLog.end(), IsBefore);
+  SortedAccessLogSize = AccessLog.size();
+
+  for (size_t I = 0; I < AccessLog.size(); ++I) {
+    if (AccessLog[I].VD)
+      AccessIndex[{AccessLog[I].VD, AccessLog[I].Loc.getRawEncoding()}] = I;
+  }
+}
+
+/* Returns the log entry recording VD at Loc, or nullptr if there is none.
+ */
+AccessInfo *DataTracker::findAccessLogEntry(const ValueDecl *VD,
+                                            SourceLocation Loc) {
+  auto It = AccessIndex.find({VD, Loc.getRawEncoding()});
+  if (It == AccessIndex.end())
+    return nullptr;
+  return &AccessLog[It->second];
+}
+
 int DataTracker::recordAccess(const ValueDecl *VD, SourceLocation Loc,
                               const Stmt *S, uint8_t Flags, bool overwrite) {
   SourceManager &SM = Context->getSourceManager();
@@ -82,37 +141,28 @@ int DataTracker::recordAccess(const ValueDecl *VD, SourceLocation Loc,
     if (VD->getNameAsString()[0] == '.')
       return 0;
 
-    if (!SM.isBeforeInTranslationUnit(
-            VD->getBeginLoc(), LastKernel->getDirective()->getBeginLoc()) &&
-        SM.isBeforeInTranslationUnit(VD->getBeginLoc(),
-                                     LastKernel->getDirective()->getEndLoc()))
+    unsigned DeclOffset = getMainFileOffset(SM, VD->getBeginLoc());
+    if (LastKernel->directiveContains(DeclOffset))
       return 0;
 
-    if (!SM.isBeforeInTranslationUnit(
-            Loc, LastKernel->getDirective()->getBeginLoc()) &&
-        SM.isBeforeInTranslationUnit(Loc,
-                                     LastKernel->getDirective()->getEndLoc()))
+    unsigned Offset = getMainFileOffset(SM, Loc);
+    if (LastKernel->directiveContains(Offset))
       return 0;
 
-    if (LastKernel->NestedDirectives.size() > 0) {
-      auto *NestedDir = LastKernel->NestedDirectives.back();
-      if (!SM.isBeforeInTranslationUnit(Loc, NestedDir->getBeginLoc()) &&
-          SM.isBeforeInTranslationUnit(Loc, NestedDir->getEndLoc()))
-        return 0;
-    }
+    if (LastKernel->lastNestedDirectiveContains(Offset))
+      return 0;
 
     // if (LastKernel->contains(Loc))
     //   Flags |= A_OFFLD;
   }
 
   // check for existing log entry
-  for (int I = AccessLog.size() - 1; I >= 0; --I) {
-    if (AccessLog[I].VD == VD && AccessLog[I].Loc == Loc) {
-      if (!overwrite || AccessLog[I].Flags == Flags)
-        return 0;
-      AccessLog[I].Flags = Flags;
-      return 1;
-    }
+  if (AccessInfo *Existing = findAccessLogEntry(VD, Loc)) {
+    Flags = getAssertedFlags(VD, Existing->S, Flags);
+    if (!overwrite || Existing->Flags == Flags)
+      return 0;
+    Existing->Flags = Flags;
+    return 1;
   }
 
   if (!Locals.contains(VD))
@@ -122,10 +172,10 @@ int DataTracker::recordAccess(const ValueDecl *VD, SourceLocation Loc,
   NewEntry.VD = VD;
   NewEntry.S = S;
   NewEntry.Loc = Loc;
-  NewEntry.Flags = Flags;
+  NewEntry.Flags = getAssertedFlags(VD, S, Flags);
 
   if (VD && VD == LastArrayBasePointer) {
-    NewEntry.ArraySubscript = LastArraySubscript;
+    attachArraySubscript(NewEntry, LastArraySubscript);
     LastArrayBasePointer = nullptr;
     LastArraySubscript = nullptr;
   }
@@ -133,7 +183,63 @@ int DataTracker::recordAccess(const ValueDecl *VD, SourceLocation Loc,
   return insertAccessLogEntry(NewEntry);
 }
 
-const std::vector<AccessInfo> &DataTracker::getAccessLog() { return AccessLog; }
+/* Returns the flags of an access to VD by S given the properties asserted for
+ * VD. The calls data asserted read-only is passed to, and callees accessing it,
+ * only read it. Writes in the function itself are kept.
+ */
+uint8_t DataTracker::getAssertedFlags(const ValueDecl *VD, const Stmt *S,
+                                      uint8_t Flags) const {
+  auto It = AssertedProperties.find(VD);
+  if (It == AssertedProperties.end() || !(It->second & P_READONLY))
+    return Flags;
+  if ((S && !isa<CallExpr>(S)) || !(Flags & (A_WRONLY | A_UNKNOWN)))
+    return Flags;
+  return (Flags & A_OFFLD) | A_RDONLY;
+}
+
+/* Records Properties (P_* flags) asserted for the data of VD, and applies them
+ * to the accesses recorded so far.
+ */
+void DataTracker::assertProperties(const ValueDecl *VD, uint8_t Properties) {
+  AssertedProperties[VD] |= Properties;
+  for (AccessInfo &Entry : AccessLog) {
+    if (Entry.VD == VD)
+      Entry.Flags = getAssertedFlags(VD, Entry.S, Entry.Flags);
+  }
+}
+
+/* Records a write through argument ArgIndex of CE, a call to a library
+ * function, that replaces all of VD if Extent covers it. The access itself is
+ * recorded as a read and write.
+ */
+int DataTracker::recordLibraryWrite(const ValueDecl *VD, SourceLocation Loc,
+                                    const CallExpr *CE, unsigned ArgIndex,
+                                    const LibraryExtent &Extent) {
+  LibraryWrites.push_back({VD, Loc, CE, ArgIndex, Extent});
+  return 1;
+}
+
+/* Records the library writes whose extents cover all of their variables as
+ * writes only. Returns the number of updated log entries.
+ */
+int DataTracker::confirmLibraryWrites() {
+  int NumUpdates = 0;
+  for (const LibraryWrite &Write : LibraryWrites) {
+    AccessInfo *Entry = findAccessLogEntry(Write.VD, Write.Loc);
+    if (!Entry || (Entry->Flags & A_RDWR) != A_RDWR || !coversVariable(Write))
+      continue;
+    Entry->Flags = getAssertedFlags(Write.VD, Entry->S,
+                                    Entry->Flags & ~A_RDONLY);
+    ++NumUpdates;
+  }
+  LibraryWrites.clear();
+  return NumUpdates;
+}
+
+const std::vector<AccessInfo> &DataTracker::getAccessLog() {
+  sortAccessLog();
+  return AccessLog;
+}
 
 /* Update reads/writes that may have happened on by the Callee parameters passed
  * by pointer.
@@ -210,10 +316,13 @@ int DataTracker::updateTouchedByCallee(
     const boost::container::flat_set<const ValueDecl *> &GlobalsAccessed,
     const std::vector<uint8_t> &GlobalModes) {
   int numUpdates = 0;
-  // Start by finding all the calls to the callee.
+  // Start by finding all the calls to the callee. Matching on the canonical
+  // declaration also finds calls to callees defined in other translation
+  // units.
   std::vector<const CallExpr *> Calls;
   for (const CallExpr *CE : CallExprs) {
-    if (CE->getDirectCallee()->getDefinition() == Callee) {
+    if (CE->getDirectCallee()->getCanonicalDecl() ==
+        Callee->getCanonicalDecl()) {
       Calls.push_back(CE);
 #if DEBUG_LEVEL >= 1
       llvm::outs() << "--> " << this->getDecl()->getNameAsString() << " calls "
@@ -231,7 +340,8 @@ int DataTracker::updateTouchedByCallee(
   return numUpdates;
 }
 
-void DataTracker::printAccessLog() const {
+void DataTracker::printAccessLog() {
+  sortAccessLog();
   SourceManager &SourceMgr = Context->getSourceManager();
   llvm::outs() << "\nAccess Log for function " << FD->getNameAsString() << "\n";
 
@@ -294,15 +404,44 @@ void DataTracker::printAccessLog() const {
   return;
 }
 
+/* Collects the indices of the chain of subscripts ending in Subscript, starting
+ * with the first dimension. Returns the base of the innermost subscript.
+ */
+static const Expr *getSubscriptIndices(const ArraySubscriptExpr *Subscript,
+                                       std::vector<const Expr *> &Indices) {
+  Indices.clear();
+  const Expr *Base = Subscript;
+  while (const auto *ASE = dyn_cast<ArraySubscriptExpr>(Base)) {
+    Indices.push_back(ASE->getIdx());
+    Base = ASE->getBase()->IgnoreParenImpCasts();
+  }
+  std::reverse(Indices.begin(), Indices.end());
+  return Base;
+}
+
+/* Returns true if Inner is one of the subscripts in the chain of Outer.
+ */
+static bool isSubscriptOf(const ArraySubscriptExpr *Inner,
+                          const ArraySubscriptExpr *Outer) {
+  const Expr *Base = Outer;
+  while (const auto *ASE = dyn_cast<ArraySubscriptExpr>(Base)) {
+    if (ASE == Inner)
+      return true;
+    Base = ASE->getBase()->IgnoreParenImpCasts();
+  }
+  return false;
+}
+
 int DataTracker::recordArrayAccess(const ValueDecl *BasePointer,
                                    const ArraySubscriptExpr *Subscript) {
-  auto It = std::find_if(AccessLog.begin(), AccessLog.end(),
-                         [BasePointer, Subscript](AccessInfo &A) {
-                           return A.VD == BasePointer &&
-                                  A.Loc == Subscript->getBeginLoc();
-                         });
+  AccessInfo *Existing =
+      findAccessLogEntry(BasePointer, Subscript->getBeginLoc());
 
-  if (It == AccessLog.end()) {
+  if (!Existing) {
+    // The outer subscripts of a[i][j] are visited first.
+    if (LastArrayBasePointer == BasePointer && LastArraySubscript &&
+        isSubscriptOf(Subscript, LastArraySubscript))
+      return 1;
     // We have parsed the array subscript before determining the access type.
     // Save it so it can be attached when the access is record in the access
     // log.
@@ -311,12 +450,128 @@ int DataTracker::recordArrayAccess(const ValueDecl *BasePointer,
     return 1;
   }
 
-  It->ArraySubscript = Subscript;
+  attachArraySubscript(*Existing, Subscript);
   LastArrayBasePointer = nullptr;
   LastArraySubscript = nullptr;
   return 1;
 }
 
+/* Attaches Subscript to Entry along with the bounds of its indices. The bounds
+ * are evaluated here, while the AST is only used by one thread, since
+ * evaluating an expression may update caches in the ASTContext.
+ */
+void DataTracker::attachArraySubscript(AccessInfo &Entry,
+                                       const ArraySubscriptExpr *Subscript) {
+  // Keep the whole chain of a multidimensional access.
+  if (Entry.ArraySubscript && isSubscriptOf(Subscript, Entry.ArraySubscript))
+    return;
+  Entry.ArraySubscript = Subscript;
+  Entry.ArrayBounds.clear();
+
+  std::vector<const Expr *> Indices;
+  getSubscriptIndices(Subscript, Indices);
+  for (const Expr *Idx : Indices) {
+    ArrayAccess Bounds;
+    Bounds.Flags = A_NOP;
+    Bounds.LitLower = SIZE_MAX;
+    Bounds.LitUpper = SIZE_MAX;
+    Bounds.VarLower = nullptr;
+    Bounds.VarUpper = nullptr;
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "Found var ArraySubscript ";
+    Idx->printPretty(llvm::outs(), nullptr, Context->getLangOpts());
+    llvm::outs() << "\n";
+#endif
+    const ImplicitCastExpr *IdxICE = dyn_cast<ImplicitCastExpr>(Idx);
+    const DeclRefExpr *IdxDRE =
+        IdxICE ? dyn_cast<DeclRefExpr>(*(IdxICE->child_begin())) : nullptr;
+
+    if (IdxDRE) {
+      Bounds.VarLower = IdxDRE->getDecl();
+      Bounds.VarUpper = Bounds.VarLower;
+#if DEBUG_LEVEL >= 1
+      llvm::outs() << "Found var: " << Bounds.VarLower->getNameAsString()
+                   << "\n";
+#endif
+    } else if (Idx->isEvaluatable(*Context)) {
+      Expr::EvalResult Result;
+      bool isConstant = Idx->EvaluateAsInt(Result, *Context);
+      if (isConstant) {
+        Bounds.LitLower = Result.Val.getInt().getExtValue();
+        Bounds.LitUpper = Bounds.LitLower;
+      }
+    }
+    Bounds.Offset = 0;
+    Bounds.Affine = parseAffineIndex(Idx, 1, Bounds);
+    Entry.ArrayBounds.emplace_back(Bounds);
+  }
+}
+
+/* Adds Factor times the index expression E to Bounds as the sum of a constant
+ * and of terms that are each a variable, a variable times an expression, or
+ * any other expression. Returns false if E is too large to track.
+ */
+bool DataTracker::parseAffineIndex(const Expr *E, int64_t Factor,
+                                   ArrayAccess &Bounds) const {
+  // Keeps the coefficients, and the clauses they end up in, small.
+  constexpr int64_t MaxFactor = 1 << 20;
+  if (Bounds.Terms.size() > 4 || Factor < -MaxFactor || MaxFactor < Factor)
+    return false;
+  E = E->IgnoreParenImpCasts();
+
+  Expr::EvalResult Result;
+  if (E->isEvaluatable(*Context) && E->EvaluateAsInt(Result, *Context)) {
+    int64_t Product;
+    return !llvm::MulOverflow(Factor, Result.Val.getInt().getExtValue(),
+                              Product) &&
+           !llvm::AddOverflow(Bounds.Offset, Product, Bounds.Offset);
+  }
+
+  if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+    if (UO->getOpcode() == UO_Minus)
+      return parseAffineIndex(UO->getSubExpr(), -Factor, Bounds);
+    if (UO->getOpcode() == UO_Plus)
+      return parseAffineIndex(UO->getSubExpr(), Factor, Bounds);
+  } else if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+    const Expr *LHS = BO->getLHS()->IgnoreParenImpCasts();
+    const Expr *RHS = BO->getRHS()->IgnoreParenImpCasts();
+    if (BO->getOpcode() == BO_Add)
+      return parseAffineIndex(LHS, Factor, Bounds) &&
+             parseAffineIndex(RHS, Factor, Bounds);
+    if (BO->getOpcode() == BO_Sub)
+      return parseAffineIndex(LHS, Factor, Bounds) &&
+             parseAffineIndex(RHS, -Factor, Bounds);
+    if (BO->getOpcode() == BO_Mul) {
+      Expr::EvalResult Scale;
+      int64_t Scaled;
+      if (LHS->isEvaluatable(*Context) && LHS->EvaluateAsInt(Scale, *Context))
+        return !llvm::MulOverflow(Factor, Scale.Val.getInt().getExtValue(),
+                                  Scaled) &&
+               parseAffineIndex(RHS, Scaled, Bounds);
+      if (RHS->isEvaluatable(*Context) && RHS->EvaluateAsInt(Scale, *Context))
+        return !llvm::MulOverflow(Factor, Scale.Val.getInt().getExtValue(),
+                                  Scaled) &&
+               parseAffineIndex(LHS, Scaled, Bounds);
+      // The row of a flattened array times the length of a row.
+      const auto *DRE = dyn_cast<DeclRefExpr>(LHS);
+      const Expr *Stride = RHS;
+      if (!DRE) {
+        DRE = dyn_cast<DeclRefExpr>(RHS);
+        Stride = LHS;
+      }
+      if (DRE) {
+        Bounds.Terms.push_back({E, DRE->getDecl(), Factor, Stride});
+        return true;
+      }
+    }
+  } else if (const auto *DRE = dyn_cast<DeclRefExpr>(E)) {
+    Bounds.Terms.push_back({E, DRE->getDecl(), Factor, nullptr});
+    return true;
+  }
+  Bounds.Terms.push_back({E, nullptr, Factor, nullptr});
+  return true;
+}
+
 int DataTracker::recordTargetRegion(Kernel *K) {
   LastKernel = K;
   Kernels.push_back(K);
@@ -358,7 +613,7 @@ int DataTracker::recordLoop(const Stmt *S) {
     const Stmt *Cond = dyn_cast<Stmt>(FS->getCond());
     const Stmt *Inc = dyn_cast<Stmt>(FS->getInc());
 
-    LoopAccess *LA = new LoopAccess;
+    LoopAccess *LA = new LoopAccess();
     LA->LitLower = SIZE_MAX;
     LA->LitUpper = SIZE_MAX;
     LA->ExprLower = nullptr;
@@ -369,22 +624,65 @@ int DataTracker::recordLoop(const Stmt *S) {
     const Expr *InitExprBound = nullptr;
     const Expr *CondExprBound = nullptr;
 
+    // Direction the index moves in, 0 if unknown. A step of one can stop at
+    // any bound, larger steps only at an inequality.
     int IncType = 0;
+    bool UnitStep = false;
     // Determine indexing variable
+    auto GetIndex = [](const Expr *E) -> const ValueDecl * {
+      const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE ? DRE->getDecl() : nullptr;
+    };
+    auto GetStep = [&](const Expr *E, int Sign) {
+      Expr::EvalResult Result;
+      if (E->isEvaluatable(*Context) && E->EvaluateAsInt(Result, *Context)) {
+        const llvm::APSInt &Step = Result.Val.getInt();
+        if (Step.isZero())
+          return;
+        IncType = Step.isNegative() ? -Sign : Sign;
+        UnitStep = Step.abs() == 1;
+      }
+    };
     if (Inc && isa<UnaryOperator>(Inc)) {
       const UnaryOperator *UO = dyn_cast<UnaryOperator>(Inc);
       if (UO->isIncrementDecrementOp()) {
-        const DeclRefExpr *DRE = getLeftmostDecl(UO);
-        LA->IndexDecl = DRE->getDecl();
+        LA->IndexDecl = GetIndex(UO->getSubExpr());
         IncType = UO->isIncrementOp() - UO->isDecrementOp();
+        UnitStep = true;
+      }
+    } else if (Inc && isa<CompoundAssignOperator>(Inc)) {
+      // i += step, i -= step
+      const CompoundAssignOperator *CAO = dyn_cast<CompoundAssignOperator>(Inc);
+      if (CAO->getOpcode() == BO_AddAssign ||
+          CAO->getOpcode() == BO_SubAssign) {
+        LA->IndexDecl = GetIndex(CAO->getLHS());
+        GetStep(CAO->getRHS(), CAO->getOpcode() == BO_AddAssign ? 1 : -1);
+      }
+    } else if (Inc && isa<BinaryOperator>(Inc)) {
+      // i = i + step, i = i - step
+      const BinaryOperator *BO = dyn_cast<BinaryOperator>(Inc);
+      const BinaryOperator *Step =
+          dyn_cast<BinaryOperator>(BO->getRHS()->IgnoreParenImpCasts());
+      const ValueDecl *Index = GetIndex(BO->getLHS());
+      if (BO->getOpcode() == BO_Assign && Index && Step &&
+          (Step->getOpcode() == BO_Add || Step->getOpcode() == BO_Sub)) {
+        if (GetIndex(Step->getLHS()) == Index) {
+          LA->IndexDecl = Index;
+          GetStep(Step->getRHS(), Step->getOpcode() == BO_Add ? 1 : -1);
+        } else if (Step->getOpcode() == BO_Add &&
+                   GetIndex(Step->getRHS()) == Index) {
+          LA->IndexDecl = Index;
+          GetStep(Step->getLHS(), 1);
+        }
       }
     }
 
     // Determine bound from Init
     if (LA->IndexDecl && Init && isa<DeclStmt>(Init)) {
       const DeclStmt *DS = dyn_cast<DeclStmt>(Init);
-      const Decl *D = DS->getSingleDecl();
-      if (const VarDecl *VD = dyn_cast<VarDecl>(D)) {
+      const Decl *D = DS->isSingleDecl() ? DS->getSingleDecl() : nullptr;
+      const VarDecl *VD = dyn_cast_or_null<VarDecl>(D);
+      if (VD && VD == LA->IndexDecl && VD->getInit()) {
         if (VD->getInit()->isEvaluatable(*Context)) {
           Expr::EvalResult Result;
           bool isConstant = VD->getInit()->EvaluateAsInt(Result, *Context);
@@ -396,7 +694,8 @@ int DataTracker::recordLoop(const Stmt *S) {
       }
     } else if (LA->IndexDecl && Init && isa<BinaryOperator>(Init)) {
       const BinaryOperator *BO = dyn_cast<BinaryOperator>(Init);
-      if (BO->isAssignmentOp()) {
+      if (BO->getOpcode() == BO_Assign &&
+          GetIndex(BO->getLHS()) == LA->IndexDecl) {
         if (BO->getRHS()->isEvaluatable(*Context)) {
           Expr::EvalResult Result;
           bool isConstant = BO->getRHS()->EvaluateAsInt(Result, *Context);
@@ -412,67 +711,68 @@ int DataTracker::recordLoop(const Stmt *S) {
     if (LA->IndexDecl && Cond && isa<BinaryOperator>(Cond)) {
       const BinaryOperator *BO = dyn_cast<BinaryOperator>(Cond);
       if (BO->isComparisonOp()) {
-        const Stmt *LHS = dyn_cast<Stmt>(BO->getLHS());
-        const Stmt *RHS = dyn_cast<Stmt>(BO->getRHS());
+        // Compare as if the index is on the left hand side.
+        BinaryOperator::Opcode Opcode = BO->getOpcode();
+        const Expr *Bound = nullptr;
+        if (GetIndex(BO->getLHS()) == LA->IndexDecl) {
+          Bound = BO->getRHS();
+        } else if (GetIndex(BO->getRHS()) == LA->IndexDecl) {
+          Bound = BO->getLHS();
+          Opcode = BinaryOperator::reverseComparisonOp(Opcode);
+        }
 
-        const DeclRefExpr *DRE = getLeftmostDecl(LHS);
-        if (DRE && DRE->getDecl() == LA->IndexDecl) {
-          // Index variable on LHS
-          if (BO->getRHS()->isEvaluatable(*Context)) {
+        // A step of unknown size moves towards the bound.
+        if (Bound && IncType == 0) {
+          if (Opcode == BO_LT || Opcode == BO_LE)
+            IncType = 1;
+          else if (Opcode == BO_GT || Opcode == BO_GE)
+            IncType = -1;
+        }
+        // An index that steps over the bound of != never stops at it.
+        if (Opcode == BO_NE && !UnitStep)
+          Bound = nullptr;
+
+        if (Bound) {
+          if (Bound->isEvaluatable(*Context)) {
             Expr::EvalResult Result;
-            bool isConstant = BO->getRHS()->EvaluateAsInt(Result, *Context);
+            bool isConstant = Bound->EvaluateAsInt(Result, *Context);
             if (isConstant)
               CondLitBound = Result.Val.getInt().getExtValue();
           }
           if (CondLitBound == SIZE_MAX)
-            CondExprBound = BO->getRHS();
-
-        } else {
-          DRE = getLeftmostDecl(RHS);
-          if (DRE && DRE->getDecl() == LA->IndexDecl) {
-            // Index variable on RHS
-            if (BO->getLHS()->isEvaluatable(*Context)) {
-              Expr::EvalResult Result;
-              bool isConstant = BO->getLHS()->EvaluateAsInt(Result, *Context);
-              if (isConstant)
-                CondLitBound = Result.Val.getInt().getExtValue();
-            }
-            if (CondLitBound == SIZE_MAX)
-              CondExprBound = BO->getLHS();
-          }
+            CondExprBound = Bound;
         }
 
-        // Determine comparison type for off by one compensation.
-        if (IncType == 1) {
+        // Determine comparison type for off by one compensation. Comparisons
+        // against the direction of the loop bound nothing.
+        if (Bound && IncType == 1) {
           LA->LowerOffByOne = 0;
-          switch (BO->getOpcode()) {
+          switch (Opcode) {
           case BinaryOperator::Opcode::BO_LT:
-          case BinaryOperator::Opcode::BO_GT:
           case BinaryOperator::Opcode::BO_NE:
             LA->UpperOffByOne = 0;
             break;
           case BinaryOperator::Opcode::BO_LE:
-          case BinaryOperator::Opcode::BO_GE:
             LA->UpperOffByOne = 1;
             break;
-          case BinaryOperator::Opcode::BO_EQ:
           default:
+            CondLitBound = SIZE_MAX;
+            CondExprBound = nullptr;
             break;
           }
-        } else if (IncType == -1) {
+        } else if (Bound && IncType == -1) {
           LA->UpperOffByOne = 1;
-          switch (BO->getOpcode()) {
-          case BinaryOperator::Opcode::BO_LT:
+          switch (Opcode) {
           case BinaryOperator::Opcode::BO_GT:
           case BinaryOperator::Opcode::BO_NE:
             LA->LowerOffByOne = 1;
             break;
-          case BinaryOperator::Opcode::BO_LE:
           case BinaryOperator::Opcode::BO_GE:
             LA->LowerOffByOne = 0;
             break;
-          case BinaryOperator::Opcode::BO_EQ:
           default:
+            CondLitBound = SIZE_MAX;
+            CondExprBound = nullptr;
             break;
           }
         }
@@ -585,6 +885,195 @@ int DataTracker::recordLocal(const ValueDecl *VD) {
   return 1;
 }
 
+/* Returns true if E is sizeof(ElementType), of either the type or an
+ * expression of it.
+ */
+static bool isSizeOf(ASTContext &Context, const Expr *E, QualType ElementType) {
+  const UnaryExprOrTypeTraitExpr *SizeOf =
+      dyn_cast<UnaryExprOrTypeTraitExpr>(E->IgnoreParenImpCasts());
+  return SizeOf && SizeOf->getKind() == UETT_SizeOf &&
+         Context.hasSameUnqualifiedType(SizeOf->getTypeOfArgument(),
+                                        ElementType);
+}
+
+/* Finds the number of elements of ElementType in Size bytes, written as
+ * `Count * sizeof(T)`, `sizeof(T) * Count` or `sizeof(T)`. Count is set to
+ * nullptr for a single element.
+ */
+static bool getElementCount(ASTContext &Context, const Expr *Size,
+                            QualType ElementType, const Expr *&Count) {
+  Count = nullptr;
+  if (isSizeOf(Context, Size, ElementType))
+    return true;
+  const BinaryOperator *BO = dyn_cast<BinaryOperator>(Size->IgnoreParens());
+  if (!BO || BO->getOpcode() != BO_Mul)
+    return false;
+  if (isSizeOf(Context, BO->getRHS(), ElementType))
+    Count = BO->getLHS();
+  else if (isSizeOf(Context, BO->getLHS(), ElementType))
+    Count = BO->getRHS();
+  return Count != nullptr;
+}
+
+/* Records a store of Value to the pointer VD. Value is nullptr if the pointer
+ * may have been changed in some other way.
+ */
+int DataTracker::recordPointerDefinition(const ValueDecl *VD,
+                                         const Expr *Value,
+                                         SourceLocation Loc) {
+  PointerDefinition Def = {};
+  Def.Offset = getMainFileOffset(Context->getSourceManager(), Loc);
+  Def.Value = Value;
+  QualType ElementType = VD->getType()->getPointeeType();
+  const Expr *Stripped = Value ? Value->IgnoreParenCasts() : nullptr;
+
+  if (!Stripped) {
+  } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Stripped)) {
+    if (DRE->getType()->isPointerType())
+      Def.Alias = DRE->getDecl();
+  } else if (const CXXNewExpr *NE = dyn_cast<CXXNewExpr>(Stripped)) {
+    if (Context->hasSameUnqualifiedType(NE->getAllocatedType(), ElementType)) {
+      Def.IsAllocation = true;
+      if (NE->isArray()) {
+        auto Size = NE->getArraySize();
+        Def.Count = Size ? *Size : nullptr;
+        Def.IsAllocation = Def.Count != nullptr;
+      }
+    }
+  } else if (const CallExpr *CE = dyn_cast<CallExpr>(Stripped)) {
+    const FunctionDecl *Callee = CE->getDirectCallee();
+    std::string Name = Callee ? Callee->getNameAsString() : "";
+    if (Name == "malloc" && CE->getNumArgs() == 1) {
+      Def.IsAllocation =
+          getElementCount(*Context, CE->getArg(0), ElementType, Def.Count);
+    } else if (Name == "realloc" && CE->getNumArgs() == 2) {
+      Def.IsAllocation =
+          getElementCount(*Context, CE->getArg(1), ElementType, Def.Count);
+    } else if (Name == "calloc" && CE->getNumArgs() == 2 &&
+               isSizeOf(*Context, CE->getArg(1), ElementType)) {
+      Def.IsAllocation = true;
+      Def.Count = CE->getArg(0);
+    }
+  }
+
+  PointerDefinitions[VD].push_back(Def);
+  return 1;
+}
+
+/* Returns the only value stored to the local pointer VD, if it is stored before
+ * the offset Before. Returns nullptr otherwise.
+ */
+const PointerDefinition *
+DataTracker::getOnlyDefinition(const ValueDecl *VD, unsigned Before) const {
+  if (!Locals.contains(VD))
+    return nullptr;
+  auto It = PointerDefinitions.find(VD);
+  if (It == PointerDefinitions.end() || It->second.size() != 1)
+    return nullptr;
+  const PointerDefinition &Def = It->second.front();
+  return Def.Offset < Before ? &Def : nullptr;
+}
+
+/* Finds the number of elements of the buffer passed as argument ArgIndex of
+ * CE, in terms of the parameters of the callee. Returns false if it is not
+ * known or can not be expressed by the callee.
+ */
+bool DataTracker::getArgumentExtent(const CallExpr *CE, unsigned ArgIndex,
+                                    ParamExtent &Extent) const {
+  const FunctionDecl *Callee = CE->getDirectCallee();
+  Callee = Callee ? Callee->getDefinition() : nullptr;
+  if (!Callee || ArgIndex >= CE->getNumArgs())
+    return false;
+  const DeclRefExpr *DRE =
+      dyn_cast<DeclRefExpr>(CE->getArg(ArgIndex)->IgnoreParenImpCasts());
+  if (!DRE)
+    return false;
+
+  unsigned CallOffset =
+      getMainFileOffset(Context->getSourceManager(), CE->getBeginLoc());
+  const ValueDecl *Source = DRE->getDecl();
+  unsigned Before = CallOffset;
+  const VarDecl *CountVar = nullptr;
+  unsigned CountOffset = 0;
+  for (unsigned Depth = 0; !CountVar; ++Depth) {
+    if (Depth == 8)
+      return false;
+    auto Param = ParamExtents.find(Source);
+    if (Param != ParamExtents.end() && !PointerDefinitions.count(Source)) {
+      if (!Param->second.Param) {
+        Extent = Param->second;
+        return true;
+      }
+      CountVar = Param->second.Param;
+      CountOffset = BodyBeginOffset;
+      break;
+    }
+
+    const PointerDefinition *Def = getOnlyDefinition(Source, Before);
+    if (!Def)
+      return false;
+    if (Def->Alias) {
+      Source = Def->Alias;
+      Before = Def->Offset;
+      continue;
+    }
+    if (!Def->IsAllocation)
+      return false;
+    if (!Def->Count) {
+      Extent = {nullptr, 1};
+      return true;
+    }
+    const Expr *Count = Def->Count->IgnoreParenImpCasts();
+    if (const IntegerLiteral *IL = dyn_cast<IntegerLiteral>(Count)) {
+      uint64_t Value = IL->getValue().getLimitedValue(INT64_MAX);
+      Extent = {nullptr, static_cast<int64_t>(Value)};
+      return true;
+    }
+    const DeclRefExpr *CountDRE = dyn_cast<DeclRefExpr>(Count);
+    CountVar = CountDRE ? dyn_cast<VarDecl>(CountDRE->getDecl()) : nullptr;
+    if (!CountVar)
+      return false;
+    CountOffset = Def->Offset;
+  }
+  if (!isUnchanged(CountVar, CountOffset, CallOffset))
+    return false;
+
+  // The callee can only refer to the count through a parameter it is passed
+  // to.
+  for (unsigned I = 0; I < CE->getNumArgs() && I < Callee->getNumParams();
+       ++I) {
+    const DeclRefExpr *Arg =
+        dyn_cast<DeclRefExpr>(CE->getArg(I)->IgnoreParenImpCasts());
+    const ParmVarDecl *Param = Callee->getParamDecl(I);
+    if (Arg && Arg->getDecl() == CountVar &&
+        Param->getType()->isIntegerType()) {
+      Extent = {Param, 0};
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns true if the extent of Param changed.
+ */
+bool DataTracker::setParamExtent(const ParmVarDecl *Param,
+                                 const ParamExtent &Extent) {
+  auto Inserted = ParamExtents.try_emplace(Param, Extent);
+  if (Inserted.second)
+    return true;
+  if (Inserted.first->second == Extent)
+    return false;
+  Inserted.first->second = Extent;
+  return true;
+}
+
+const ParamExtent *DataTracker::getParamExtent(const ValueDecl *Param) const {
+  auto It = ParamExtents.find(Param);
+  if (It == ParamExtents.end())
+    return nullptr;
+  return &It->second;
+}
+
 int DataTracker::recordGlobal(const ValueDecl *VD) {
   Globals.insert(VD);
   return 1;
@@ -600,8 +1089,9 @@ const std::vector<const CallExpr *> &DataTracker::getCallExprs() const {
 
 const std::vector<const Stmt *> &DataTracker::getLoops() const { return Loops; }
 
-const TargetDataRegion *DataTracker::getTargetDataScope() const {
-  return TargetScope;
+const std::vector<TargetDataRegion *> &
+DataTracker::getTargetDataScopes() const {
+  return TargetScopes;
 }
 
 const boost::container::flat_set<const ValueDecl *> &
@@ -615,22 +1105,19 @@ DataTracker::getGlobals() const {
 }
 
 void DataTracker::classifyOffloadedOps() {
-  SourceManager &SM = Context->getSourceManager();
+  PhaseTimeRegion Timer(ClassifyPhase);
+  ++NumClassifyCalls;
+  sortAccessLog();
+
+  auto IsBefore = [](const AccessInfo &A, unsigned Offset) {
+    return A.Offset < Offset;
+  };
   // Find target region bounds.
   for (Kernel *K : Kernels) {
-    SourceLocation Lower = K->getBeginLoc();
-    SourceLocation Upper = K->getEndLoc();
-    auto It = AccessLog.begin();
-    for (;
-         SM.isBeforeInTranslationUnit(It->Loc, Lower) && It != AccessLog.end();
-         ++It) {
-    }
-    K->AccessLogBegin = It;
-    for (;
-         SM.isBeforeInTranslationUnit(It->Loc, Upper) && It != AccessLog.end();
-         ++It) {
-    }
-    K->AccessLogEnd = It;
+    K->AccessLogBegin = std::lower_bound(AccessLog.begin(), AccessLog.end(),
+                                         K->getBeginOffset(), IsBefore);
+    K->AccessLogEnd = std::lower_bound(K->AccessLogBegin, AccessLog.end(),
+                                       K->getEndOffset(), IsBefore);
 
     for (auto OffIt = K->AccessLogBegin; OffIt != K->AccessLogEnd; ++OffIt) {
       if (OffIt->Flags)
@@ -675,13 +1162,11 @@ const AccessInfo *DataTracker::findOutermostIndexingLoop(
     std::vector<AccessInfo>::iterator &A,
     std::vector<const AccessInfo *> &LoopStack,
     std::vector<AccessInfo>::iterator &insertionLocLim) const {
-  SourceManager &SM = Context->getSourceManager();
-  const Expr *Idx = A->ArraySubscript->getIdx();
-  // llvm::outs() << "Found var ArraySubscript ";
-  // Idx->printPretty(llvm::outs(), nullptr, Context->getLangOpts());
-  // llvm::outs() << "\n";
+  std::vector<const Expr *> Indices;
+  getSubscriptIndices(A->ArraySubscript, Indices);
   VariableFinder Finder;
-  Finder.TraverseStmt(const_cast<Expr *>(Idx));
+  for (const Expr *Idx : Indices)
+    Finder.TraverseStmt(const_cast<Expr *>(Idx));
   boost::container::flat_set<const VarDecl *> IndexingVars =
       Finder.getReferencedVariables();
   // llvm::outs() << "INDEXING VARS:";
@@ -694,7 +1179,7 @@ const AccessInfo *DataTracker::findOutermostIndexingLoop(
   const AccessInfo *OutermostIndexingLoop = nullptr;
   for (auto Rit = LoopStack.rbegin(); Rit != LoopStack.rend(); ++Rit) {
     if (insertionLocLim != AccessLog.end() &&
-        SM.isBeforeInTranslationUnit((*Rit)->Loc, insertionLocLim->Loc))
+        (*Rit)->Offset < insertionLocLim->Offset)
       break;
     if (!(*Rit)->LoopBounds)
       continue;
@@ -797,6 +1282,8 @@ struct DataFlowOf {
 };
 
 void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
+  PhaseTimeRegion Timer(AnalyzeValueDeclPhase);
+  ++NumValueDeclsAnalyzed;
   SourceManager &SM = Context->getSourceManager();
   bool MapTo = false;
   bool MapFrom = false;
@@ -842,45 +1329,70 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
   llvm::outs() << "Beginning Analysis of " << VD->getNameAsString() << "\n";
 #endif
 
+  unsigned ScopeBeginOffset = getMainFileOffset(SM, TargetScope->BeginLoc);
+  unsigned ScopeEndOffset = getMainFileEndOffset(SM, TargetScope->EndLoc);
+  // Declarations in any enclosing region end up within its block.
+  const TargetDataRegion *OutermostScope = TargetScope;
+  while (OutermostScope->Parent)
+    OutermostScope = OutermostScope->Parent;
+  unsigned OutermostBeginOffset =
+      getMainFileOffset(SM, OutermostScope->BeginLoc);
   auto PrevHostIt = AccessLog.end();
   auto PrevTgtIt = AccessLog.end();
+  // The last host write of VD and the end of the last kernel writing it, and
+  // whether host control flow was entered or left since. Updates are moved up
+  // to them when only straight-line code separates them from the access that
+  // needs the update, giving the transfer the most time to complete.
+  auto PrevHostWriteIt = AccessLog.end();
+  auto PrevTgtWriteIt = AccessLog.end();
+  bool HostFlowSinceHostWrite = false;
+  bool HostFlowSinceTgtWrite = false;
+  bool InKernel = false;
+  bool WrittenInKernel = false;
+  size_t KernelUpdateTo = 0;
+  auto HoistUpdateTo = [&]() -> const AccessInfo & {
+    if (PrevHostWriteIt != AccessLog.end() && PrevHostWriteIt != PrevHostIt &&
+        !HostFlowSinceHostWrite && !PrevHostWriteIt->ArraySubscript &&
+        PrevHostWriteIt->Offset >= ScopeBeginOffset) {
+      ++NumUpdatesHoisted;
+      return *PrevHostWriteIt;
+    }
+    return *PrevHostIt;
+  };
+  auto HoistUpdateFrom = [&](const AccessInfo &Access) {
+    if (PrevTgtWriteIt == AccessLog.end() || HostFlowSinceTgtWrite ||
+        PrevTgtWriteIt->Offset < ScopeBeginOffset || !Access.S)
+      return Access;
+    // Placed before the statement following the kernel. Barrier KernelEnd
+    // tells the rewriter.
+    const Stmt *Next = getNextStmt(
+        *Context, getSemiTerminatedStmt(*Context, PrevTgtWriteIt->S));
+    const Stmt *FullStmt = getSemiTerminatedStmt(*Context, Access.S);
+    if (!Next || !FullStmt || isa<DoStmt>(Next) ||
+        getMainFileOffset(SM, Next->getBeginLoc()) >=
+            getMainFileOffset(SM, FullStmt->getBeginLoc()))
+      return Access;
+    ++NumUpdatesHoisted;
+    AccessInfo Hoisted = *PrevTgtWriteIt; // copy
+    Hoisted.VD = VD;
+    return Hoisted;
+  };
   std::vector<AccessInfo>::iterator It;
   // Advance It to next access entry of VD or loop marker
   It = std::find_if(AccessLog.begin(), AccessLog.end(), DataFlowOf(VD));
   while (It != AccessLog.end()) {
     // Array Access Determination
-    if (It->ArraySubscript) {
-      ArrayAccess Bounds;
+    for (ArrayAccess Bounds : It->ArrayBounds) {
       Bounds.Flags = It->Flags;
-      Bounds.LitLower = SIZE_MAX;
-      Bounds.LitUpper = SIZE_MAX;
-      const Expr *Idx = It->ArraySubscript->getIdx();
-#if DEBUG_LEVEL >= 1
-      llvm::outs() << "Found var ArraySubscript ";
-      Idx->printPretty(llvm::outs(), nullptr, Context->getLangOpts());
-      llvm::outs() << "\n";
-#endif
-      const ImplicitCastExpr *IdxICE = dyn_cast<ImplicitCastExpr>(Idx);
-      const DeclRefExpr *IdxDRE =
-          IdxICE ? dyn_cast<DeclRefExpr>(*(IdxICE->child_begin())) : nullptr;
-
-      if (IdxDRE) {
-        Bounds.VarLower = IdxDRE->getDecl();
-        Bounds.VarUpper = Bounds.VarLower;
-#if DEBUG_LEVEL >= 1
-        llvm::outs() << "Found var: " << Bounds.VarLower->getNameAsString()
-                     << "\n";
-#endif
-      } else if (Idx->isEvaluatable(*Context)) {
-        Expr::EvalResult Result;
-        bool isConstant = Idx->EvaluateAsInt(Result, *Context);
-        if (isConstant) {
-          Bounds.LitLower = Result.Val.getInt().getExtValue();
-          Bounds.LitUpper = Bounds.LitLower;
-        }
-      }
       ArrayBoundsList.emplace_back(Bounds);
     }
+    if (It->Barrier != ScopeBarrier::None &&
+        It->Barrier != ScopeBarrier::KernelBegin &&
+        It->Barrier != ScopeBarrier::KernelEnd && !InKernel &&
+        !(It->Flags & A_OFFLD)) {
+      HostFlowSinceHostWrite = true;
+      HostFlowSinceTgtWrite = true;
+    }
 
     if (It->Barrier == ScopeBarrier::LoopBegin) {
       if (!(It->Flags & A_OFFLD)) {
@@ -924,17 +1436,24 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
       CondDependencyStack.pop();
 
     } else if (It->Barrier == ScopeBarrier::KernelBegin) {
+      InKernel = true;
+      WrittenInKernel = false;
+      KernelUpdateTo = TargetScope->UpdateTo.size();
       if (IsArithmeticType && !DataValidOnDevice) {
         DataFirstPrivate = true;
         UsedInLastKernel = false;
         PrevMapTo = MapTo;
       }
     } else if (It->Barrier == ScopeBarrier::KernelEnd) {
+      InKernel = false;
+      if (WrittenInKernel) {
+        PrevTgtWriteIt = It;
+        HostFlowSinceTgtWrite = false;
+      }
       if (IsArithmeticType && DataFirstPrivate) {
         // VD was a read-only scalar for this kernel and wasn't present already.
         // Undo data mappings and change to firsrprivate.
-        if (!TargetScope->UpdateTo.empty() &&
-            TargetScope->UpdateTo.back().Loc == PrevHostIt->Loc)
+        if (TargetScope->UpdateTo.size() > KernelUpdateTo)
           TargetScope->UpdateTo.pop_back();
         MapTo = PrevMapTo;
         if (UsedInLastKernel)
@@ -952,12 +1471,8 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
       if (!DataInitialized) {
         if (It->Flags & A_RDONLY) {
           // Read before write!
-          DiagnosticsEngine &DiagEngine = Context->getDiagnostics();
-          const unsigned int DiagID = DiagEngine.getCustomDiagID(
-              DiagnosticsEngine::Warning,
-              "variable '%0' is uninitialized when used here");
-          DiagnosticBuilder DiagBuilder = DiagEngine.Report(It->Loc, DiagID);
-          DiagBuilder.AddString(VD->getNameAsString());
+          Diagnostics.push_back(
+              {AnalysisDiag::UninitializedUse, It->Loc, SourceLocation(), VD});
         } else if ( // CondDependencyStack.empty()
                     //&&
             ((It->Flags == (A_WRONLY | A_OFFLD)) ||
@@ -975,8 +1490,7 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
            (It->Flags & (A_RDONLY | A_UNKNOWN)))) { // Read/ReadWrite/Unknown
         // Data is already initalized, but not on target device
         if (PrevHostIt == AccessLog.end() ||
-            SM.isBeforeInTranslationUnit(PrevHostIt->Loc,
-                                         TargetScope->BeginLoc)) {
+            PrevHostIt->Offset < ScopeBeginOffset) {
           // PrevHostIt == AccessLog.end() indicates the first access of a
           // global or parameter on the target device.
           MapTo = true;
@@ -994,15 +1508,20 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
             TargetScope->UpdateTo.emplace_back(OutermostIndexingLoopCopy);
           } else {
             // does not depend on loop index.
-            TargetScope->UpdateTo.emplace_back(*PrevHostIt);
+            TargetScope->UpdateTo.emplace_back(HoistUpdateTo());
           }
 
         } else {
-          TargetScope->UpdateTo.emplace_back(*PrevHostIt);
+          TargetScope->UpdateTo.emplace_back(HoistUpdateTo());
         }
         DataValidOnDevice = true;
       }
       if ((It->Flags & (A_WRONLY | A_UNKNOWN))) { // Write/ReadWrite/Unknown
+        // Writes by callees cannot be placed.
+        if (InKernel)
+          WrittenInKernel = true;
+        else
+          PrevTgtWriteIt = AccessLog.end();
         DataValidOnDevice = true;
         DataValidOnHost = false;
         // a single write on the target guarantees we need to at allocate space
@@ -1016,29 +1535,16 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
       // check access on host
       if (!DataInitialized) {
         if (It->Loc == It->VD->getLocation() &&
-            !SM.isBeforeInTranslationUnit(It->Loc, TargetScope->BeginLoc)) {
+            It->Offset >= OutermostBeginOffset) {
           // Data needs to be declared before the target scope in which it is
           // used.
-          DiagnosticsEngine &DiagEngine = Context->getDiagnostics();
-          const unsigned int DiagID = DiagEngine.getCustomDiagID(
-              DiagnosticsEngine::Warning,
-              "declaration of '%0' is captured within a target data region in "
-              "which it is being utilized");
-          const unsigned int NoteID = DiagEngine.getCustomDiagID(
-              DiagnosticsEngine::Note,
-              "declaration of '%0' was anticipated to precede the beginning of "
-              "the target data region at this location");
-          DiagEngine.Report(It->Loc, DiagID) << VD->getNameAsString();
-          DiagEngine.Report(TargetScope->BeginLoc, NoteID)
-              << VD->getNameAsString();
+          Diagnostics.push_back({AnalysisDiag::CapturedDeclaration, It->Loc,
+                                 OutermostScope->BeginLoc, VD});
         }
         if (It->Flags & A_RDONLY) {
           // Read before write!
-          DiagnosticsEngine &DiagEngine = Context->getDiagnostics();
-          const unsigned int DiagID = DiagEngine.getCustomDiagID(
-              DiagnosticsEngine::Warning,
-              "variable '%0' is uninitialized when used here");
-          DiagEngine.Report(It->Loc, DiagID) << VD->getNameAsString();
+          Diagnostics.push_back(
+              {AnalysisDiag::UninitializedUse, It->Loc, SourceLocation(), VD});
         } else if ((It->Flags == A_WRONLY) ||
                    (It->Flags == A_UNKNOWN)) { // Write/Unknown
           DataInitialized = true;
@@ -1046,7 +1552,7 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
       } else if (!DataValidOnHost &&
                  (It->Flags &
                   (A_RDONLY | A_UNKNOWN))) { // Read/ReadWrite/Unknown
-        if (SM.isBeforeInTranslationUnit(TargetScope->EndLoc, It->Loc)) {
+        if (ScopeEndOffset < It->Offset) {
           MapFrom = true;
         } else if (It->ArraySubscript) {
           const AccessInfo *OutermostIndexingLoop =
@@ -1062,7 +1568,7 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
               TargetScope->UpdateFrom.emplace_back(
                   CondDependencyStack.top().Conditional);
             } else {
-              TargetScope->UpdateFrom.emplace_back(*It);
+              TargetScope->UpdateFrom.emplace_back(HoistUpdateFrom(*It));
             }
           }
 
@@ -1070,13 +1576,15 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
           TargetScope->UpdateFrom.emplace_back(
               CondDependencyStack.top().Conditional);
         } else {
-          TargetScope->UpdateFrom.emplace_back(*It);
+          TargetScope->UpdateFrom.emplace_back(HoistUpdateFrom(*It));
         }
         DataValidOnHost = true;
       }
       if (It->Flags & (A_WRONLY | A_UNKNOWN)) { // Write/ReadWrite/Unknown
         DataValidOnDevice = false;
         DataValidOnHost = true;
+        PrevHostWriteIt = It;
+        HostFlowSinceHostWrite = false;
       }
       if (!LoopDependencyStack.empty() &&
           LoopDependencyStack.top().FirstHostAccess == nullptr) {
@@ -1112,121 +1620,2315 @@ void DataTracker::analyzeValueDecl(const ValueDecl *VD) {
   return;
 }
 
-void DataTracker::analyze() {
-  AccessInfo *firstOffload = nullptr;
-  AccessInfo *lastOffload = nullptr;
-  for (AccessInfo &Access : AccessLog) {
-    if (Access.Flags & A_OFFLD) {
-      if (!firstOffload) {
-        firstOffload = &Access;
-        lastOffload = &Access;
-      } else {
-        lastOffload = &Access;
-      }
-    }
-  }
-  if (!firstOffload) {
-    // There is nothing to analyze.
+// A candidate bound of an array section, the value of Text plus Value. Text is
+// empty for literal bounds.
+struct SectionBound {
+  std::string Text;
+  int64_t Value;
+};
+
+/* Adds Bound to the candidates for the lower (IsLower) or upper bound of a
+ * section. Candidates that only differ in their constant are combined.
+ */
+static void mergeSectionBound(std::vector<SectionBound> &Bounds,
+                              const SectionBound &Bound, bool IsLower) {
+  for (SectionBound &Existing : Bounds) {
+    if (Existing.Text != Bound.Text)
+      continue;
+    Existing.Value = IsLower ? std::min(Existing.Value, Bound.Value)
+                             : std::max(Existing.Value, Bound.Value);
     return;
   }
+  Bounds.push_back(Bound);
+}
 
-  classifyOffloadedOps();
+static std::string printSectionBound(const SectionBound &Bound) {
+  if (Bound.Text.empty())
+    return std::to_string(Bound.Value);
+  if (Bound.Value == 0)
+    return Bound.Text;
+  if (Bound.Value > 0)
+    return Bound.Text + " + " + std::to_string(Bound.Value);
+  return Bound.Text + " - " + std::to_string(-Bound.Value);
+}
 
-  const Stmt *FrontCapturingStmt =
-      findOutermostCapturingStmt(FD->getBody(), firstOffload->S);
-  const Stmt *BackCapturingStmt =
-      findOutermostCapturingStmt(FD->getBody(), lastOffload->S);
-  SourceLocation ScopeBegin;
-  SourceLocation ScopeEnd;
-  if (FrontCapturingStmt) {
-    ScopeBegin = FrontCapturingStmt->getBeginLoc();
-#if DEBUG_LEVEL >= 1
-    llvm::outs() << "FrontCapturingStmt is "
-                 << ScopeBegin.printToString(Context->getSourceManager())
-                 << " in " << FD->getNameAsString() << "\n";
-#endif
-  } else {
-#if DEBUG_LEVEL >= 1
-    llvm::outs() << "FrontCapturingStmt null in " << FD->getNameAsString()
-                 << "\n";
-#endif
-  }
-  if (BackCapturingStmt) {
-    ScopeEnd = BackCapturingStmt->getEndLoc();
-#if DEBUG_LEVEL >= 1
-    llvm::outs() << "BackCapturingStmt is "
-                 << ScopeEnd.printToString(Context->getSourceManager())
-                 << " in " << FD->getNameAsString() << "\n";
-#endif
-  } else {
-#if DEBUG_LEVEL >= 1
-    llvm::outs() << "BackCapturingStmt null in " << FD->getNameAsString()
-                 << "\n";
-#endif
+/* Prints the minimum (IsLower) or maximum of Bounds. Candidates that cannot be
+ * compared statically are compared by a conditional expression.
+ */
+static std::string printSectionExtreme(const std::vector<SectionBound> &Bounds,
+                                       bool IsLower) {
+  std::string Result = printSectionBound(Bounds[0]);
+  for (size_t I = 1; I < Bounds.size(); ++I) {
+    std::string Next = printSectionBound(Bounds[I]);
+    Result = "(" + Result + (IsLower ? " < " : " > ") + Next + " ? " + Result +
+             " : " + Next + ")";
   }
+  return Result;
+}
 
-  if (Kernels.size() > 0) {
-    // Identify the root(outermost) target scope in the function.
-    FrontCapturingStmt =
-        findOutermostCapturingStmt(FD->getBody(), Kernels[0]->getDirective());
-    SourceLocation KernelScopeBegin = FrontCapturingStmt->getBeginLoc();
-    BackCapturingStmt = findOutermostCapturingStmt(
-        FD->getBody(), Kernels.back()->getDirective());
-    SourceLocation KernelScopeEnd = BackCapturingStmt->getEndLoc();
-    if (auto OpenMPDirective =
-            dyn_cast<OMPExecutableDirective>(BackCapturingStmt)) {
-      // ugh. The getEndLoc() of OpenMP directives is different and doesn't
-      // consider the captured statement while seemingly every other statement
-      // does.
-      KernelScopeEnd = OpenMPDirective->getInnermostCapturedStmt()->getEndLoc();
-    }
-    SourceManager &SM = Context->getSourceManager();
-    if (ScopeBegin.isInvalid() ||
-        SM.isBeforeInTranslationUnit(KernelScopeBegin, ScopeBegin)) {
-      ScopeBegin = KernelScopeBegin;
-    }
-    if (ScopeEnd.isInvalid() ||
-        SM.isBeforeInTranslationUnit(ScopeEnd, KernelScopeEnd)) {
-      ScopeEnd = KernelScopeEnd;
-    }
+/* Returns true if S may leave the enclosing loop before its condition fails.
+ */
+static bool hasEarlyExit(const Stmt *S) {
+  if (!S)
+    return false;
+  if (isa<BreakStmt>(S) || isa<ReturnStmt>(S) || isa<GotoStmt>(S) ||
+      isa<IndirectGotoStmt>(S) || isa<CXXThrowExpr>(S))
+    return true;
+  for (const Stmt *Child : S->children()) {
+    if (hasEarlyExit(Child))
+      return true;
   }
+  return false;
+}
 
-  if (ScopeBegin.isInvalid() || ScopeEnd.isInvalid()) {
-    llvm::outs()
-        << "error: Data mapping scope could not be determined for function "
-        << FD->getNameAsString() << "\n";
-    return;
+static bool containsThis(const Stmt *S) {
+  if (!S)
+    return false;
+  if (isa<CXXThisExpr>(S))
+    return true;
+  for (const Stmt *Child : S->children()) {
+    if (containsThis(Child))
+      return true;
   }
+  return false;
+}
 
-  TargetScope = new TargetDataRegion(ScopeBegin, ScopeEnd, FD);
+/* Returns true if S assigns a new value to the pointer VD itself.
+ */
+static bool isAssignmentTo(const Stmt *S, const ValueDecl *VD) {
+  const BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(S);
+  if (!BO || !BO->isAssignmentOp())
+    return false;
+  const DeclRefExpr *DRE =
+      dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParenImpCasts());
+  return DRE && DRE->getDecl() == VD;
+}
 
-  for (Kernel *K : Kernels) {
-    TargetScope->Kernels.push_back(K->getDirective());
+/* Returns true if Var is not written between BeginOffset and EndOffset.
+ */
+bool DataTracker::isUnchanged(const VarDecl *Var, unsigned BeginOffset,
+                              unsigned EndOffset) const {
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.VD != Var || Entry.Barrier != ScopeBarrier::None)
+      continue;
+    if (Entry.Offset < BeginOffset || EndOffset < Entry.Offset)
+      continue;
+    if (Entry.Flags & (A_WRONLY | A_UNKNOWN))
+      return false;
   }
+  return true;
+}
 
-  // Map a list of all the data the TargetScope will be responsible for.
-  boost::container::flat_set<const ValueDecl *> TargetScopeDecls;
-  for (auto It = AccessLog.begin(); It != AccessLog.end(); ++It) {
-    if (It->Flags & A_OFFLD && It->Barrier == ScopeBarrier::None)
-      TargetScopeDecls.insert(It->VD);
-  }
+/* Returns true if the local Var is in scope throughout the top level of the
+ * function body, where target data regions begin.
+ */
+static bool isDeclaredAtTopLevel(ASTContext &Context, const FunctionDecl *FD,
+                                 const VarDecl *Var) {
+  if (isa<ParmVarDecl>(Var) || !Var->isLocalVarDecl())
+    return true;
+  const auto &Parents = Context.getParents(*Var);
+  if (Parents.size() == 0 || !Parents[0].get<DeclStmt>())
+    return false;
+  const auto &StmtParents = Context.getParents(*Parents[0].get<DeclStmt>());
+  return StmtParents.size() != 0 && StmtParents[0].get<Stmt>() == FD->getBody();
+}
 
-  for (Kernel *K : Kernels) {
-    auto Privates = K->getPrivateDecls();
-    for (const ValueDecl *VD : Privates) {
-      Disabled.insert(VD->getID());
-    }
-  }
+/* Returns the source text of E if E has the same value from BeginOffset to
+ * EndOffset and can be evaluated by a directive at the top level of the
+ * function. Returns an empty string otherwise.
+ */
+std::string DataTracker::getInvariantBoundText(const Expr *E,
+                                               unsigned BeginOffset,
+                                               unsigned EndOffset) {
+  if (E->HasSideEffects(*Context) || containsThis(E))
+    return "";
 
-  for (const ValueDecl *VD : TargetScopeDecls) {
-    if (!Disabled.contains(VD->getID()))
-      analyzeValueDecl(VD);
+  SourceManager &SM = Context->getSourceManager();
+  VariableFinder Finder;
+  Finder.TraverseStmt(const_cast<Expr *>(E));
+  for (const VarDecl *Var : Finder.getReferencedVariables()) {
+    if (Locals.contains(Var) &&
+        (getMainFileOffset(SM, Var->getLocation()) >= BeginOffset ||
+         !isDeclaredAtTopLevel(*Context, FD, Var)))
+      return "";
+    if (!isUnchanged(Var, BeginOffset, EndOffset))
+      return "";
   }
 
-  return;
+  std::string Text =
+      getSourceText(SM, Context->getLangOpts(), E->getSourceRange());
+  // The text is pasted into a single line pragma.
+  if (Text.empty() || Text.find('\n') != std::string::npos ||
+      Text.find("//") != std::string::npos ||
+      Text.find("/*") != std::string::npos)
+    return "";
+  const Expr *Stripped = E->IgnoreParenImpCasts();
+  if (!isa<DeclRefExpr>(Stripped) && !isa<IntegerLiteral>(Stripped) &&
+      !isa<ParenExpr>(E->IgnoreImpCasts()))
+    Text = "(" + Text + ")";
+  return Text;
 }
 
-std::vector<uint8_t> DataTracker::getParamAccessModes(bool crossFnOffloading) {
+/* Appends the operands of the product E to Factors.
+ */
+static void collectFactors(const Expr *E, std::vector<const Expr *> &Factors) {
+  const BinaryOperator *BO = dyn_cast<BinaryOperator>(E->IgnoreParenImpCasts());
+  if (BO && BO->getOpcode() == BO_Mul) {
+    collectFactors(BO->getLHS(), Factors);
+    collectFactors(BO->getRHS(), Factors);
+    return;
+  }
+  Factors.push_back(E);
+}
+
+/* Returns the product of Factors, or 0 if one of them is not a constant.
+ */
+static uint64_t getConstantProduct(ASTContext &Context,
+                                   const std::vector<const Expr *> &Factors) {
+  uint64_t Product = 1;
+  for (const Expr *Factor : Factors) {
+    Expr::EvalResult Result;
+    if (!Factor->EvaluateAsInt(Result, Context) || Result.Val.getInt() < 1)
+      return 0;
+    bool Overflow = false;
+    Product = llvm::SaturatingMultiply(
+        Product, Result.Val.getInt().getLimitedValue(), &Overflow);
+    if (Overflow)
+      return 0;
+  }
+  return Product;
+}
+
+/* Returns true if A and B are the same constant, or are spelled the same and
+ * only refer to locals that are not written from BeginOffset to EndOffset.
+ */
+bool DataTracker::isSameValue(const Expr *A, const Expr *B,
+                              unsigned BeginOffset, unsigned EndOffset) const {
+  Expr::EvalResult ResultA, ResultB;
+  if (A->EvaluateAsInt(ResultA, *Context) &&
+      B->EvaluateAsInt(ResultB, *Context))
+    return llvm::APSInt::isSameValue(ResultA.Val.getInt(),
+                                     ResultB.Val.getInt());
+  if (A->HasSideEffects(*Context) || containsThis(A))
+    return false;
+
+  SourceManager &SM = Context->getSourceManager();
+  std::string Text =
+      getSourceText(SM, Context->getLangOpts(), A->getSourceRange());
+  if (Text.empty() ||
+      Text != getSourceText(SM, Context->getLangOpts(), B->getSourceRange()))
+    return false;
+  VariableFinder Finder;
+  Finder.TraverseStmt(const_cast<Expr *>(A));
+  for (const VarDecl *Var : Finder.getReferencedVariables()) {
+    if (!Locals.contains(Var) || !isUnchanged(Var, BeginOffset, EndOffset))
+      return false;
+  }
+  return true;
+}
+
+/* Returns true if the extent of Write is known to cover all of its variable:
+ * the whole of an array or object passed by address, or the whole buffer of
+ * the only allocation of a local pointer.
+ */
+bool DataTracker::coversVariable(const LibraryWrite &Write) const {
+  const CallExpr *CE = Write.CE;
+  const LibraryExtent &Extent = Write.Extent;
+  if (Write.ArgIndex >= CE->getNumArgs())
+    return false;
+  for (unsigned Index : Extent.Args) {
+    if (Index >= CE->getNumArgs())
+      return false;
+  }
+
+  // The extent is the product of Factors, in bytes or in elements.
+  std::vector<const Expr *> Factors;
+  if (Extent.Kind == LibraryExtent::Range) {
+    // Only ranges written as `p, p + n` are understood.
+    const DeclRefExpr *Begin = dyn_cast<DeclRefExpr>(
+        CE->getArg(Extent.Args[0])->IgnoreParenImpCasts());
+    const BinaryOperator *End = dyn_cast<BinaryOperator>(
+        CE->getArg(Extent.Args[1])->IgnoreParenImpCasts());
+    if (!Begin || !End || End->getOpcode() != BO_Add)
+      return false;
+    const DeclRefExpr *Base =
+        dyn_cast<DeclRefExpr>(End->getLHS()->IgnoreParenImpCasts());
+    if (!Base || Base->getDecl() != Begin->getDecl())
+      return false;
+    collectFactors(End->getRHS(), Factors);
+  } else {
+    for (unsigned Index : Extent.Args)
+      collectFactors(CE->getArg(Index), Factors);
+  }
+  QualType ElementType;
+  if (Extent.Kind != LibraryExtent::Bytes) {
+    ElementType = CE->getArg(Write.ArgIndex)->getType()->getPointeeType();
+    if (ElementType.isNull() || ElementType->isIncompleteType() ||
+        !ElementType->isConstantSizeType())
+      return false;
+  }
+
+  const Expr *Arg = CE->getArg(Write.ArgIndex)->IgnoreParenCasts();
+  QualType Type = Write.VD->getType();
+  if (Type->isReferenceType())
+    return false;
+  if (!isa<DeclRefExpr>(Arg) || !Type->isPointerType()) {
+    // The variable itself is written.
+    if (Type->isIncompleteType() || !Type->isConstantSizeType())
+      return false;
+    uint64_t Size = Context->getTypeSizeInChars(Type).getQuantity();
+    uint64_t Written = getConstantProduct(*Context, Factors);
+    if (!ElementType.isNull())
+      Written = llvm::SaturatingMultiply<uint64_t>(
+          Written, Context->getTypeSizeInChars(ElementType).getQuantity());
+    return Written >= Size;
+  }
+
+  // The buffer the pointer points to is written.
+  unsigned CallOffset =
+      getMainFileOffset(Context->getSourceManager(), CE->getBeginLoc());
+  const PointerDefinition *Def = getOnlyDefinition(Write.VD, CallOffset);
+  if (!Def || !Def->IsAllocation)
+    return false;
+  QualType AllocatedType = Type->getPointeeType();
+  if (ElementType.isNull()) {
+    auto SizeOf = std::find_if(Factors.begin(), Factors.end(),
+                               [&](const Expr *Factor) {
+                                 return isSizeOf(*Context, Factor,
+                                                 AllocatedType);
+                               });
+    if (SizeOf == Factors.end())
+      return false;
+    Factors.erase(SizeOf);
+  } else if (!Context->hasSameUnqualifiedType(ElementType, AllocatedType)) {
+    return false;
+  }
+
+  std::vector<const Expr *> CountFactors;
+  if (Def->Count)
+    collectFactors(Def->Count, CountFactors);
+  uint64_t Written = getConstantProduct(*Context, Factors);
+  uint64_t Count = getConstantProduct(*Context, CountFactors);
+  if (Written && Count)
+    return Written >= Count;
+  // Otherwise every factor of the count has to be written out again.
+  for (const Expr *Factor : CountFactors) {
+    auto Same = std::find_if(Factors.begin(), Factors.end(),
+                             [&](const Expr *Other) {
+                               return isSameValue(Factor, Other, Def->Offset,
+                                                  CallOffset);
+                             });
+    if (Same == Factors.end())
+      return false;
+    Factors.erase(Same);
+  }
+  return Factors.empty();
+}
+
+/* Gets the extent of each dimension of the array, or pointer to the elements of
+ * an array, of type Type. The extent of the first dimension is 0 if it is not
+ * known. Returns false unless the elements have a complete type and every
+ * dimension after the first has a constant extent.
+ */
+static bool getArrayShape(QualType Type, std::vector<uint64_t> &Extents) {
+  Extents.clear();
+  QualType ElementType;
+  if (Type->isPointerType()) {
+    Extents.push_back(0);
+    ElementType = Type->getPointeeType();
+  } else if (const ArrayType *AT = Type->getAsArrayTypeUnsafe()) {
+    const auto *CAT = dyn_cast<ConstantArrayType>(AT);
+    Extents.push_back(CAT ? CAT->getSize().getZExtValue() : 0);
+    ElementType = AT->getElementType();
+  } else {
+    return false;
+  }
+  while (const ArrayType *AT = ElementType->getAsArrayTypeUnsafe()) {
+    const auto *CAT = dyn_cast<ConstantArrayType>(AT);
+    if (!CAT)
+      return false;
+    Extents.push_back(CAT->getSize().getZExtValue());
+    ElementType = CAT->getElementType();
+  }
+  return !ElementType->isIncompleteType() && !ElementType->isAnyPointerType();
+}
+
+/* Adds Coeff * Bound to the affine bound Acc, times Stride unless it is empty.
+ * Returns false on overflow.
+ */
+static bool addAffineTerm(SectionBound &Acc, const SectionBound &Bound,
+                          int64_t Coeff, const std::string &Stride) {
+  int64_t Scale = Coeff;
+  std::string Term;
+  if (Stride.empty()) {
+    int64_t Product;
+    if (llvm::MulOverflow(Coeff, Bound.Value, Product) ||
+        llvm::AddOverflow(Acc.Value, Product, Acc.Value))
+      return false;
+    if (Bound.Text.empty())
+      return true;
+    Term = Bound.Text;
+  } else if (Bound.Text.empty()) {
+    if (llvm::MulOverflow(Coeff, Bound.Value, Scale))
+      return false;
+    if (Scale == 0)
+      return true;
+    Term = Stride;
+  } else if (Bound.Value != 0) {
+    Term = "(" + printSectionBound(Bound) + ") * " + Stride;
+  } else {
+    Term = Bound.Text + " * " + Stride;
+  }
+  if (Scale != 1 && Scale != -1)
+    Term = std::to_string(Scale < 0 ? -Scale : Scale) + " * " + Term;
+  if (Acc.Text.empty())
+    Acc.Text = Scale < 0 ? "-" + Term : Term;
+  else
+    Acc.Text += (Scale < 0 ? " - " : " + ") + Term;
+  return true;
+}
+
+/* Prints the dimension of a section from the candidates for its bounds.
+ * Returns false if it is empty.
+ */
+static bool printSectionDim(const std::vector<SectionBound> &Lowers,
+                            const std::vector<SectionBound> &Uppers,
+                            SectionDim &Dim) {
+  if (Lowers.size() == 1 && Uppers.size() == 1 &&
+      Lowers[0].Text == Uppers[0].Text) {
+    int64_t Length = Uppers[0].Value - Lowers[0].Value;
+    if (Length <= 0)
+      return false;
+    Dim.Lower = printSectionBound(Lowers[0]);
+    Dim.Length = std::to_string(Length);
+    return true;
+  }
+  Dim.Lower = printSectionExtreme(Lowers, true);
+  Dim.Length = printSectionExtreme(Uppers, false);
+  if (Dim.Lower != "0") {
+    if (Lowers.size() == 1 && (Lowers[0].Text.empty() || Lowers[0].Value == 0))
+      Dim.Length += " - " + Dim.Lower;
+    else
+      Dim.Length += " - (" + Dim.Lower + ")";
+  }
+  return true;
+}
+
+/* Computes the elements of VD accessed in the function as an array section.
+ * The section covers every subscript of VD between FromOffset and ToOffset of
+ * the kinds in Modes. Each index is an affine combination of the indices of
+ * enclosing loops, bounded by the bounds of these loops, and of invariant
+ * values. Accesses on the target device are only included if Modes has
+ * A_OFFLD. Returns false if any of these accesses can not be bounded this way.
+ *
+ * The dimensions of a multidimensional array are bounded separately. A
+ * Contiguous section, as required by map clauses, covers whole rows once it
+ * spans more than one; otherwise the section is the rectangular block.
+ */
+bool DataTracker::getAccessSection(const ValueDecl *VD,
+                                   unsigned ScopeBeginOffset,
+                                   unsigned ScopeEndOffset,
+                                   ArraySection &Section, unsigned FromOffset,
+                                   unsigned ToOffset, uint8_t Modes,
+                                   bool Contiguous) {
+  std::vector<uint64_t> Extents;
+  if (!getArrayShape(VD->getType(), Extents))
+    return false;
+  const size_t Rank = Extents.size();
+
+  // Values the bounds depend on must not change between an access and the
+  // beginning of the region, where the clause is evaluated.
+  unsigned BoundBeginOffset = ScopeBeginOffset;
+  unsigned BoundEndOffset = ScopeEndOffset;
+  auto GetInvariantBound = [&](const Expr *E) {
+    return getInvariantBoundText(E, BoundBeginOffset, BoundEndOffset);
+  };
+  auto GetBound = [&](size_t Lit, const Expr *E, SectionBound &Bound) {
+    if (E) {
+      Bound = {GetInvariantBound(E), 0};
+      return !Bound.Text.empty();
+    }
+    Bound = {"", static_cast<int64_t>(Lit)};
+    return Lit <= static_cast<size_t>(INT64_MAX);
+  };
+
+  std::vector<const AccessInfo *> LoopStack;
+  std::vector<unsigned> CondStack;
+  llvm::DenseMap<const Stmt *, bool> IrregularLoops;
+  // Bounds the values of the index of a loop enclosing the current access.
+  auto GetLoopRange = [&](const AccessInfo *Loop, SectionBound &Lower,
+                          SectionBound &Upper) {
+    // The loop must run through all of its iterations and access VD on each
+    // of them.
+    if (!CondStack.empty() && CondStack.back() > Loop->Offset)
+      return false;
+    const LoopAccess *LA = Loop->LoopBounds;
+    auto Irregular = IrregularLoops.try_emplace(Loop->S, false);
+    if (Irregular.second) {
+      // Nor may the body move the index.
+      const Stmt *Body = cast<ForStmt>(Loop->S)->getBody();
+      const VarDecl *Index = dyn_cast<VarDecl>(LA->IndexDecl);
+      SourceManager &SM = Context->getSourceManager();
+      Irregular.first->second =
+          hasEarlyExit(Body) || !Index ||
+          !isUnchanged(Index, getMainFileOffset(SM, Body->getBeginLoc()),
+                       getMainFileEndOffset(SM, Body->getEndLoc()));
+    }
+    if (Irregular.first->second)
+      return false;
+
+    if (!GetBound(LA->LitLower, LA->ExprLower, Lower) ||
+        !GetBound(LA->LitUpper, LA->ExprUpper, Upper))
+      return false;
+    Lower.Value += LA->LowerOffByOne;
+    Upper.Value += LA->UpperOffByOne;
+    return true;
+  };
+  // Bounds an affine index by the extremes of each of its terms.
+  auto GetIndexRange = [&](const ArrayAccess &Bounds, SectionBound &Lower,
+                           SectionBound &Upper) {
+    if (!Bounds.Affine)
+      return false;
+    Lower = {"", Bounds.Offset};
+    Upper = {"", Bounds.Offset};
+    for (const AffineTerm &Term : Bounds.Terms) {
+      const AccessInfo *Loop = nullptr;
+      for (auto Rit = LoopStack.rbegin(); Term.Var && Rit != LoopStack.rend();
+           ++Rit) {
+        if ((*Rit)->LoopBounds && (*Rit)->LoopBounds->IndexDecl == Term.Var) {
+          Loop = *Rit;
+          break;
+        }
+      }
+      if (!Loop) {
+        std::string Text = GetInvariantBound(Term.E);
+        if (Text.empty() || !addAffineTerm(Lower, {Text, 0}, Term.Coeff, "") ||
+            !addAffineTerm(Upper, {Text, 0}, Term.Coeff, ""))
+          return false;
+        continue;
+      }
+
+      SectionBound First;
+      SectionBound Last;
+      std::string Stride;
+      if (!GetLoopRange(Loop, First, Last))
+        return false;
+      if (Term.Stride) {
+        // Assumed not to be negative, like the length of a row.
+        Stride = GetInvariantBound(Term.Stride);
+        if (Stride.empty())
+          return false;
+      }
+      Last.Value -= 1;
+      bool Increasing = Term.Coeff > 0;
+      if (!addAffineTerm(Lower, Increasing ? First : Last, Term.Coeff,
+                         Stride) ||
+          !addAffineTerm(Upper, Increasing ? Last : First, Term.Coeff, Stride))
+        return false;
+    }
+    return !llvm::AddOverflow(Upper.Value, int64_t(1), Upper.Value);
+  };
+
+  std::vector<std::vector<SectionBound>> Lowers(Rank);
+  std::vector<std::vector<SectionBound>> Uppers(Rank);
+  std::vector<const Expr *> Indices;
+  auto It = std::find_if(AccessLog.begin(), AccessLog.end(), DataFlowOf(VD));
+  for (; It != AccessLog.end();
+       It = std::find_if(It + 1, AccessLog.end(), DataFlowOf(VD))) {
+    if (It->Barrier == ScopeBarrier::LoopBegin) {
+      LoopStack.push_back(&(*It));
+      continue;
+    } else if (It->Barrier == ScopeBarrier::LoopEnd) {
+      LoopStack.pop_back();
+      continue;
+    } else if (It->Barrier == ScopeBarrier::CondBegin) {
+      CondStack.push_back(It->Offset);
+      continue;
+    } else if (It->Barrier == ScopeBarrier::CondEnd) {
+      CondStack.pop_back();
+      continue;
+    } else if (It->Barrier != ScopeBarrier::None) {
+      continue;
+    }
+    if (It->Offset < FromOffset || ToOffset < It->Offset ||
+        ((It->Flags & A_OFFLD) && !(Modes & A_OFFLD)))
+      continue;
+
+    if (!It->ArraySubscript) {
+      // Allocating, freeing or assigning the pointer does not touch its
+      // elements. The pointer must not change within the region though.
+      if (It->Loc == VD->getLocation() || (It->Flags & ~A_OFFLD) == A_NOP)
+        continue;
+      if (isAssignmentTo(It->S, VD) &&
+          (It->Offset < ScopeBeginOffset || ScopeEndOffset < It->Offset))
+        continue;
+      return false;
+    }
+    if (!(It->Flags & Modes & ~A_OFFLD))
+      continue;
+
+    // Every dimension must be subscripted to access an element.
+    const DeclRefExpr *Base = dyn_cast<DeclRefExpr>(
+        getSubscriptIndices(It->ArraySubscript, Indices));
+    if (!Base || Base->getDecl() != VD || It->ArrayBounds.size() != Rank)
+      return false;
+
+    BoundBeginOffset = std::min(
+        ScopeBeginOffset,
+        LoopStack.empty() ? It->Offset : LoopStack.front()->Offset);
+    BoundEndOffset = std::max(ScopeEndOffset, It->Offset);
+    for (size_t D = 0; D < Rank; ++D) {
+      SectionBound Lower;
+      SectionBound Upper;
+      if (!GetIndexRange(It->ArrayBounds[D], Lower, Upper))
+        return false;
+      if (Lower.Text.empty() && Lower.Value < 0)
+        return false;
+
+      mergeSectionBound(Lowers[D], Lower, true);
+      mergeSectionBound(Uppers[D], Upper, false);
+      // Give up rather than emit an unreadable clause.
+      if (Lowers[D].size() > 3 || Uppers[D].size() > 3)
+        return false;
+    }
+  }
+
+  if (Lowers[0].empty())
+    return false;
+
+  Section.Dims.clear();
+  bool Spans = false;
+  for (size_t D = 0; D < Rank; ++D) {
+    SectionDim Dim;
+    if (Spans && Contiguous)
+      Dim = {"0", std::to_string(Extents[D])};
+    else if (!printSectionDim(Lowers[D], Uppers[D], Dim))
+      return false;
+    Section.Dims.push_back(Dim);
+    Spans |= Dim.Length != "1";
+  }
+  // Leave out whole trailing dimensions.
+  while (Section.Dims.size() > 1) {
+    const SectionDim &Last = Section.Dims.back();
+    if (Last.Lower != "0" ||
+        Last.Length != std::to_string(Extents[Section.Dims.size() - 1]))
+      break;
+    Section.Dims.pop_back();
+  }
+  return true;
+}
+
+/* Computes the section of the whole buffer the pointer VD points to within the
+ * target data region, from the allocation it was assigned before the region or
+ * the extent every caller passes for it. Returns false if it is not known.
+ */
+bool DataTracker::getAllocationSection(const ValueDecl *VD,
+                                       unsigned ScopeBeginOffset,
+                                       unsigned ScopeEndOffset,
+                                       ArraySection &Section) {
+  if (!VD->getType()->isPointerType())
+    return false;
+
+  const ValueDecl *Source = VD;
+  unsigned Before = ScopeBeginOffset;
+  // Follow copies of the pointer back to the allocation.
+  for (unsigned Depth = 0; Depth < 8; ++Depth) {
+    auto Param = ParamExtents.find(Source);
+    if (Param != ParamExtents.end() && !PointerDefinitions.count(Source)) {
+      const ParamExtent &Extent = Param->second;
+      if (Extent.Param) {
+        if (Extent.Param->getName().empty() ||
+            !isUnchanged(Extent.Param, BodyBeginOffset, ScopeEndOffset))
+          return false;
+        Section.Dims = {{"0", Extent.Param->getNameAsString()}};
+      } else {
+        if (Extent.Lit <= 0)
+          return false;
+        Section.Dims = {{"0", std::to_string(Extent.Lit)}};
+      }
+      return true;
+    }
+
+    const PointerDefinition *Def = getOnlyDefinition(Source, Before);
+    if (!Def)
+      return false;
+    if (Def->Alias) {
+      Source = Def->Alias;
+      Before = Def->Offset;
+      continue;
+    }
+    if (!Def->IsAllocation)
+      return false;
+    if (!Def->Count) {
+      Section.Dims = {{"0", "1"}};
+      return true;
+    }
+    std::string Length =
+        getInvariantBoundText(Def->Count, Def->Offset, ScopeEndOffset);
+    Section.Dims = {{"0", Length}};
+    return !Length.empty();
+  }
+  return false;
+}
+
+/* Returns the statement the rewriter places Update at: the full statement of
+ * its access or, for an update from the device moved up to the kernel last
+ * writing the data (Barrier KernelEnd), the statement following the kernel.
+ */
+static const Stmt *getUpdateStmt(ASTContext &Context,
+                                 const AccessInfo &Update) {
+  if (!Update.S)
+    return nullptr;
+  const Stmt *FullStmt = getSemiTerminatedStmt(Context, Update.S);
+  if (FullStmt && Update.Barrier == ScopeBarrier::KernelEnd)
+    return getNextStmt(Context, FullStmt);
+  return FullStmt;
+}
+
+/* Computes the elements of VD a target update has to transfer: for an update
+ * to the device, those written on the host since the device last accessed VD,
+ * and for an update from the device, those accessed on the host until the
+ * device accesses VD again. Within a host loop that also offloads VD the order
+ * of the accesses wraps around, so the whole loop is included.
+ */
+bool DataTracker::getUpdateSection(const ValueDecl *VD,
+                                   const AccessInfo &Update, bool IsUpdateTo,
+                                   unsigned ScopeBeginOffset,
+                                   unsigned ScopeEndOffset,
+                                   ArraySection &Section) {
+  // The directive goes after (to) or before (from) the statement of the access,
+  // as placed by the rewriter. Updates moved into a loop body are not bounded.
+  const Stmt *FullStmt = getUpdateStmt(*Context, Update);
+  if (!FullStmt || isa<DoStmt>(FullStmt) ||
+      (IsUpdateTo && Update.Barrier != ScopeBarrier::LoopEnd &&
+       (isa<ForStmt>(FullStmt) || isa<WhileStmt>(FullStmt))))
+    return false;
+  SourceManager &SM = Context->getSourceManager();
+  unsigned Placement =
+      IsUpdateTo ? getMainFileEndOffset(SM, FullStmt->getEndLoc())
+                 : getMainFileOffset(SM, FullStmt->getBeginLoc());
+  unsigned FromOffset = IsUpdateTo ? ScopeBeginOffset : Placement;
+  unsigned ToOffset = IsUpdateTo ? Placement : ScopeEndOffset;
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.VD != VD || !(Entry.Flags & A_OFFLD))
+      continue;
+    if (IsUpdateTo && Entry.Offset < Placement)
+      FromOffset = std::max(FromOffset, Entry.Offset + 1);
+    else if (!IsUpdateTo && Entry.Offset > Placement)
+      ToOffset = std::min(ToOffset, Entry.Offset - 1);
+  }
+
+  llvm::DenseMap<const Stmt *, unsigned> LoopEnds;
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.Barrier == ScopeBarrier::LoopEnd)
+      LoopEnds[Entry.S] = Entry.Offset;
+  }
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.Barrier != ScopeBarrier::LoopBegin || (Entry.Flags & A_OFFLD))
+      continue;
+    unsigned LoopEnd = LoopEnds.lookup(Entry.S);
+    if (Placement < Entry.Offset || LoopEnd < Placement)
+      continue;
+    bool OffloadedInLoop =
+        std::any_of(AccessLog.begin(), AccessLog.end(),
+                    [&](const AccessInfo &Other) {
+                      return Other.VD == VD && (Other.Flags & A_OFFLD) &&
+                             Entry.Offset <= Other.Offset &&
+                             Other.Offset <= LoopEnd;
+                    });
+    if (OffloadedInLoop) {
+      FromOffset = std::min(FromOffset, Entry.Offset);
+      ToOffset = std::max(ToOffset, LoopEnd);
+    }
+  }
+
+  uint8_t Modes = IsUpdateTo ? (A_WRONLY | A_UNKNOWN) : (A_RDWR | A_UNKNOWN);
+  // Target updates may transfer a rectangular block.
+  return getAccessSection(VD, ScopeBeginOffset, ScopeEndOffset, Section,
+                          FromOffset, ToOffset, Modes, false);
+}
+
+/* Computes the elements of VD transferred by the clauses of the target data
+ * region, preferring the elements accessed over the whole allocation. VD is
+ * mapped as a whole if neither is known.
+ */
+void DataTracker::analyzeValueDeclArrayBounds(const ValueDecl *VD) {
+  std::vector<uint64_t> Extents;
+  if (!getArrayShape(VD->getType(), Extents))
+    return;
+
+  SourceManager &SM = Context->getSourceManager();
+  unsigned ScopeBeginOffset = getMainFileOffset(SM, TargetScope->BeginLoc);
+  unsigned ScopeEndOffset = getMainFileEndOffset(SM, TargetScope->EndLoc);
+  ArraySection Section;
+  if (!getAccessSection(VD, ScopeBeginOffset, ScopeEndOffset, Section) &&
+      !getAllocationSection(VD, ScopeBeginOffset, ScopeEndOffset, Section))
+    return;
+#if DEBUG_LEVEL >= 1
+  llvm::outs() << "Section of " << VD->getNameAsString() << ":";
+  for (const SectionDim &Dim : Section.Dims)
+    llvm::outs() << " [" << Dim.Lower << ":" << Dim.Length << "]";
+  llvm::outs() << "\n";
+#endif
+  TargetScope->Sections[VD] = Section;
+
+  // Updates are bounded by accesses that are included in the mapped section,
+  // so they never reach outside of it.
+  std::vector<AccessInfo> &UpdateTo = TargetScope->UpdateTo;
+  std::vector<AccessInfo> &UpdateFrom = TargetScope->UpdateFrom;
+  TargetScope->UpdateToSections.resize(UpdateTo.size());
+  TargetScope->UpdateFromSections.resize(UpdateFrom.size());
+  bool UpdateToBounded = true;
+  for (size_t I = 0; I < UpdateTo.size(); ++I) {
+    if (UpdateTo[I].VD == VD &&
+        !getUpdateSection(VD, UpdateTo[I], true, ScopeBeginOffset,
+                          ScopeEndOffset, TargetScope->UpdateToSections[I]))
+      UpdateToBounded = false;
+  }
+  // Elements left out of an update from the device are stale on the host, and
+  // a whole update to the device would overwrite them there.
+  if (!UpdateToBounded)
+    return;
+  for (size_t I = 0; I < UpdateFrom.size(); ++I) {
+    // These are placed at the end of a loop body for the next iteration.
+    if (UpdateFrom[I].VD != VD ||
+        UpdateFrom[I].Barrier == ScopeBarrier::LoopEnd)
+      continue;
+    getUpdateSection(VD, UpdateFrom[I], false, ScopeBeginOffset,
+                     ScopeEndOffset, TargetScope->UpdateFromSections[I]);
+  }
+}
+
+/* Builds the control flow graph used by pruneRedundantUpdates(). Building it
+ * may evaluate conditions, which caches results in the AST, so this has to be
+ * called before functions are analyzed concurrently.
+ */
+void DataTracker::buildCFG() {
+  if (Kernels.empty())
+    return;
+  PhaseTimeRegion Timer(BuildCFGPhase);
+  SourceCFG = CFG::buildCFG(FD, FD->getBody(), Context, CFG::BuildOptions());
+  if (!SourceCFG)
+    return;
+  for (const CFGBlock *Block : *SourceCFG) {
+    unsigned Index = 0;
+    for (const CFGElement &Element : *Block) {
+      if (auto S = Element.getAs<CFGStmt>())
+        CFGPositions.try_emplace(S->getStmt(), CFGPosition{Block, Index});
+      ++Index;
+    }
+  }
+}
+
+/* Appends the positions of the elements of S and everything below it. With
+ * Outermost set, statements below one that has an element are skipped.
+ */
+static void
+collectCFGPositions(const llvm::DenseMap<const Stmt *, CFGPosition> &Positions,
+                    const Stmt *S, bool Outermost,
+                    llvm::SmallVectorImpl<CFGPosition> &Found) {
+  auto It = Positions.find(S);
+  if (It != Positions.end()) {
+    Found.push_back(It->second);
+    if (Outermost)
+      return;
+  }
+  for (const Stmt *Child : S->children()) {
+    if (Child)
+      collectCFGPositions(Positions, Child, Outermost, Found);
+  }
+}
+
+/* Finds the element of S in SourceCFG. Statements the CFG has no element for,
+ * such as DeclStmts it splits up, are placed at their last subexpression if
+ * those are all in one block, or else at the closest enclosing statement.
+ */
+bool DataTracker::locateStmt(const Stmt *S, CFGPosition &Pos) const {
+  while (S) {
+    llvm::SmallVector<CFGPosition, 4> Found;
+    collectCFGPositions(CFGPositions, S, true, Found);
+    if (!Found.empty() &&
+        std::all_of(Found.begin(), Found.end(), [&](const CFGPosition &P) {
+          return P.Block == Found[0].Block;
+        })) {
+      Pos = *std::max_element(Found.begin(), Found.end(),
+                              [](const CFGPosition &A, const CFGPosition &B) {
+                                return A.Index < B.Index;
+                              });
+      return true;
+    }
+    const auto &Parents = Context->getParents(*S);
+    S = Parents.empty() ? nullptr : Parents[0].get<Stmt>();
+  }
+  return false;
+}
+
+/* Finds the point directly before S, where the rewriter inserts an update from
+ * the device. Fails if that point is not passed exactly when S is entered.
+ */
+bool DataTracker::getStmtEntry(const Stmt *S, CFGPosition &Pos) const {
+  // The condition of a loop is evaluated on every iteration, the init of a for
+  // loop only once before it. Jumps to a label bypass text placed before it.
+  if (const ForStmt *For = dyn_cast<ForStmt>(S))
+    return For->getInit() && getStmtEntry(For->getInit(), Pos);
+  if (isa<WhileStmt, DoStmt, SwitchCase, LabelStmt>(S))
+    return false;
+  if (const CompoundStmt *Compound = dyn_cast<CompoundStmt>(S))
+    return !Compound->body_empty() && getStmtEntry(Compound->body_front(), Pos);
+
+  llvm::SmallVector<CFGPosition, 8> Found;
+  collectCFGPositions(CFGPositions, S, false, Found);
+  llvm::SmallPtrSet<const CFGBlock *, 8> Blocks;
+  for (const CFGPosition &P : Found)
+    Blocks.insert(P.Block);
+  // S is entered through the only one of its blocks that is not reached from
+  // another one.
+  const CFGBlock *Entry = nullptr;
+  for (const CFGBlock *Block : Blocks) {
+    bool Inner = std::any_of(
+        Block->pred_begin(), Block->pred_end(),
+        [&](const CFGBlock::AdjacentBlock &Pred) {
+          return Pred.getReachableBlock() &&
+                 Blocks.contains(Pred.getReachableBlock());
+        });
+    if (Inner)
+      continue;
+    if (Entry)
+      return false;
+    Entry = Block;
+  }
+  if (!Entry)
+    return false;
+  Pos = {Entry, UINT_MAX};
+  for (const CFGPosition &P : Found) {
+    if (P.Block == Entry)
+      Pos.Index = std::min(Pos.Index, P.Index);
+  }
+  return true;
+}
+
+/* Returns the block whose terminator is the loop or branch S. */
+static const CFGBlock *findTerminatorBlock(const CFG &Graph, const Stmt *S) {
+  for (const CFGBlock *Block : Graph) {
+    if (Block->getTerminatorStmt() == S)
+      return Block;
+  }
+  return nullptr;
+}
+
+/* Returns true if every statement of Block lies within S. */
+static bool isBlockWithin(const SourceManager &SM, const CFGBlock *Block,
+                          const Stmt *S) {
+  unsigned BeginOffset = getMainFileOffset(SM, S->getBeginLoc());
+  unsigned EndOffset = getMainFileEndOffset(SM, S->getEndLoc());
+  auto IsWithin = [&](const Stmt *Inner) {
+    unsigned InnerBegin = getMainFileOffset(SM, Inner->getBeginLoc());
+    unsigned InnerEnd = getMainFileEndOffset(SM, Inner->getEndLoc());
+    return BeginOffset <= InnerBegin && InnerEnd <= EndOffset;
+  };
+  bool Empty = true;
+  if (const Stmt *Terminator = Block->getTerminatorStmt()) {
+    if (!IsWithin(Terminator))
+      return false;
+    Empty = false;
+  }
+  for (const CFGElement &Element : *Block) {
+    auto ElementStmt = Element.getAs<CFGStmt>();
+    if (!ElementStmt || !IsWithin(ElementStmt->getStmt()))
+      return false;
+    Empty = false;
+  }
+  return !Empty;
+}
+
+/* Finds the point directly after S, where the rewriter inserts an update to
+ * the device. Fails if that point is not passed exactly when S is left.
+ */
+bool DataTracker::getStmtExit(const Stmt *S, CFGPosition &Pos) const {
+  if (isa<ForStmt, WhileStmt, DoStmt>(S)) {
+    const CFGBlock *Header = findTerminatorBlock(*SourceCFG, S);
+    if (!Header || Header->succ_size() != 2)
+      return false;
+    const CFGBlock *Exit = (Header->succ_begin() + 1)->getReachableBlock();
+    if (!Exit)
+      return false;
+    // Other paths joining at the exit would pass the update as well.
+    SourceManager &SM = Context->getSourceManager();
+    for (const CFGBlock::AdjacentBlock &Pred : Exit->preds()) {
+      if (Pred.getReachableBlock() &&
+          !isBlockWithin(SM, Pred.getReachableBlock(), S))
+        return false;
+    }
+    Pos = {Exit, 0};
+    return true;
+  }
+  if (isa<SwitchCase, LabelStmt>(S))
+    return false;
+
+  llvm::SmallVector<CFGPosition, 8> Found;
+  collectCFGPositions(CFGPositions, S, false, Found);
+  if (Found.empty())
+    return false;
+  Pos = {Found[0].Block, 0};
+  for (const CFGPosition &P : Found) {
+    if (P.Block != Pos.Block)
+      return false;
+    Pos.Index = std::max(Pos.Index, P.Index + 1);
+  }
+  return true;
+}
+
+/* Finds the point at the top of the body of the loop S, which is passed on
+ * every iteration.
+ */
+bool DataTracker::getLoopBodyEntry(const Stmt *S, CFGPosition &Pos) const {
+  // The body of a do loop is also entered from before the loop.
+  if (!isa<ForStmt, WhileStmt>(S))
+    return false;
+  const CFGBlock *Header = findTerminatorBlock(*SourceCFG, S);
+  if (!Header || Header->succ_size() != 2)
+    return false;
+  const CFGBlock *Body = Header->succ_begin()->getReachableBlock();
+  if (!Body || Body->pred_size() != 1)
+    return false;
+  Pos = {Body, 0};
+  return true;
+}
+
+/* Finds the point at which the rewriter places Update. Updates at the end of a
+ * loop body are skipped by continue statements and are not placed.
+ */
+bool DataTracker::getUpdatePosition(const AccessInfo &Update, bool IsUpdateTo,
+                                    CFGPosition &Pos) const {
+  const Stmt *FullStmt = getUpdateStmt(*Context, Update);
+  if (!FullStmt)
+    return false;
+  bool IsLoop = isa<ForStmt, WhileStmt, DoStmt>(FullStmt);
+  if (IsUpdateTo) {
+    if (IsLoop && Update.Barrier != ScopeBarrier::LoopEnd)
+      return getLoopBodyEntry(FullStmt, Pos);
+    return getStmtExit(FullStmt, Pos);
+  }
+  if (isa<DoStmt>(FullStmt) ||
+      (IsLoop && Update.Barrier == ScopeBarrier::LoopEnd))
+    return false;
+  return getStmtEntry(FullStmt, Pos);
+}
+
+constexpr uint8_t V_HOST = 0b01;   // Host copy is up to date
+constexpr uint8_t V_DEVICE = 0b10; // Device copy is up to date
+
+// A change to where a variable is valid. Order is twice the index of the
+// element it happens before, plus one if it happens at that element.
+struct ValidityEvent {
+  enum EventKind { HostWrite, DeviceWrite, UpdateTo, UpdateFrom, MapTo };
+
+  EventKind Kind;
+  unsigned Order;
+  size_t Update; // index of the update for UpdateTo and UpdateFrom
+};
+
+static uint8_t applyValidityEvent(uint8_t Valid, const ValidityEvent &Event) {
+  switch (Event.Kind) {
+  case ValidityEvent::HostWrite:
+    return V_HOST;
+  case ValidityEvent::DeviceWrite:
+    return V_DEVICE;
+  case ValidityEvent::UpdateTo:
+  case ValidityEvent::MapTo:
+    return Valid | V_DEVICE;
+  case ValidityEvent::UpdateFrom:
+    return Valid | V_HOST;
+  }
+  return Valid;
+}
+
+/* Removes the updates of VD, from FirstUpdateTo and FirstUpdateFrom on, that
+ * transfer data which is already valid at their destination on every path to
+ * them. analyzeValueDecl() follows the access log in source order and keeps
+ * one state for all paths, so branches, early exits and repeated entries in a
+ * loop leave it with updates that never transfer anything.
+ *
+ * Where VD is valid is a forward must dataflow over SourceCFG: writes on one
+ * side invalidate the other, updates and the map at the start of the region
+ * validate their destination. Only whole updates validate anything, and
+ * updates the CFG position of which is unknown are assumed not to, so the
+ * result errs towards keeping updates.
+ */
+void DataTracker::pruneRedundantUpdates(const ValueDecl *VD,
+                                        size_t FirstUpdateTo,
+                                        size_t FirstUpdateFrom) {
+  std::vector<AccessInfo> &UpdateTo = TargetScope->UpdateTo;
+  std::vector<AccessInfo> &UpdateFrom = TargetScope->UpdateFrom;
+  if (!SourceCFG || (UpdateTo.size() == FirstUpdateTo &&
+                     UpdateFrom.size() == FirstUpdateFrom))
+    return;
+
+  std::vector<std::vector<ValidityEvent>> Events(SourceCFG->getNumBlockIDs());
+  CFGPosition Pos;
+  const Stmt *Directive = nullptr;
+  for (const AccessInfo &Access : AccessLog) {
+    if (Access.Barrier == ScopeBarrier::KernelBegin)
+      Directive = Access.S;
+    else if (Access.Barrier == ScopeBarrier::KernelEnd)
+      Directive = nullptr;
+    if (Access.VD != VD || Access.Barrier != ScopeBarrier::None ||
+        !(Access.Flags & (A_WRONLY | A_UNKNOWN)))
+      continue;
+    bool OnDevice = Access.Flags & A_OFFLD;
+    // Accesses in a kernel take effect where its directive is executed.
+    const Stmt *S = OnDevice && Directive ? Directive : Access.S;
+    if (!S) {
+      // Accesses by a callee carry the location of the call.
+      auto Call = std::find_if(
+          CallExprs.begin(), CallExprs.end(),
+          [&](const CallExpr *CE) { return CE->getBeginLoc() == Access.Loc; });
+      if (Call != CallExprs.end())
+        S = *Call;
+    }
+    // A write that cannot be placed may invalidate either copy anywhere.
+    if (!S || !locateStmt(S, Pos))
+      return;
+    Events[Pos.Block->getBlockID()].push_back(
+        {OnDevice ? ValidityEvent::DeviceWrite : ValidityEvent::HostWrite,
+         2 * Pos.Index + 1, 0});
+  }
+
+  auto IsMapped = [VD](const std::vector<AccessInfo> &Map) {
+    return !Map.empty() && Map.back().VD == VD;
+  };
+  if (IsMapped(TargetScope->MapTo) || IsMapped(TargetScope->MapToFrom)) {
+    const Stmt *Body = FD->getBody();
+    auto First = std::find_if(
+        Body->child_begin(), Body->child_end(), [&](const Stmt *Child) {
+          return Child && Child->getBeginLoc() == TargetScope->BeginLoc;
+        });
+    if (First != Body->child_end() && getStmtEntry(*First, Pos))
+      Events[Pos.Block->getBlockID()].push_back(
+          {ValidityEvent::MapTo, 2 * Pos.Index, 0});
+  }
+
+  for (size_t I = FirstUpdateTo; I < UpdateTo.size(); ++I) {
+    if (getUpdatePosition(UpdateTo[I], true, Pos))
+      Events[Pos.Block->getBlockID()].push_back(
+          {ValidityEvent::UpdateTo, 2 * Pos.Index, I});
+  }
+  for (size_t I = FirstUpdateFrom; I < UpdateFrom.size(); ++I) {
+    if (getUpdatePosition(UpdateFrom[I], false, Pos))
+      Events[Pos.Block->getBlockID()].push_back(
+          {ValidityEvent::UpdateFrom, 2 * Pos.Index, I});
+  }
+  for (std::vector<ValidityEvent> &BlockEvents : Events) {
+    std::stable_sort(BlockEvents.begin(), BlockEvents.end(),
+                     [](const ValidityEvent &A, const ValidityEvent &B) {
+                       return A.Order < B.Order;
+                     });
+  }
+
+  // Blocks that are never reached, such as catch handlers, are left out of
+  // the meet and assume nothing is valid.
+  const CFGBlock *EntryBlock = &SourceCFG->getEntry();
+  std::vector<bool> Reachable(SourceCFG->getNumBlockIDs(), false);
+  std::vector<const CFGBlock *> Worklist{EntryBlock};
+  Reachable[EntryBlock->getBlockID()] = true;
+  while (!Worklist.empty()) {
+    const CFGBlock *Block = Worklist.back();
+    Worklist.pop_back();
+    for (const CFGBlock::AdjacentBlock &Succ : Block->succs()) {
+      const CFGBlock *Next = Succ.getReachableBlock();
+      if (Next && !Reachable[Next->getBlockID()]) {
+        Reachable[Next->getBlockID()] = true;
+        Worklist.push_back(Next);
+      }
+    }
+  }
+
+  // Updates of a section only validate part of the variable.
+  auto Transfer = [&](uint8_t Valid, const ValidityEvent &Event) -> uint8_t {
+    if (Event.Kind == ValidityEvent::UpdateTo &&
+        TargetScope->getUpdateToSection(Event.Update))
+      return Valid;
+    if (Event.Kind == ValidityEvent::UpdateFrom &&
+        TargetScope->getUpdateFromSection(Event.Update))
+      return Valid;
+    return applyValidityEvent(Valid, Event);
+  };
+  std::vector<uint8_t> Out(SourceCFG->getNumBlockIDs(), V_HOST | V_DEVICE);
+  auto GetIn = [&](const CFGBlock *Block) -> uint8_t {
+    if (Block == EntryBlock)
+      return V_HOST;
+    if (!Reachable[Block->getBlockID()])
+      return 0;
+    uint8_t Valid = V_HOST | V_DEVICE;
+    for (const CFGBlock::AdjacentBlock &Pred : Block->preds()) {
+      const CFGBlock *Prev = Pred.getReachableBlock();
+      if (Prev && Reachable[Prev->getBlockID()])
+        Valid &= Out[Prev->getBlockID()];
+    }
+    return Valid;
+  };
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (const CFGBlock *Block : *SourceCFG) {
+      uint8_t Valid = GetIn(Block);
+      for (const ValidityEvent &Event : Events[Block->getBlockID()])
+        Valid = Transfer(Valid, Event);
+      if (Valid != Out[Block->getBlockID()]) {
+        Out[Block->getBlockID()] = Valid;
+        Changed = true;
+      }
+    }
+  }
+
+  // Dropping an update whose destination is valid changes no state after it,
+  // so all of them are found in one pass.
+  std::vector<bool> RedundantTo(UpdateTo.size(), false);
+  std::vector<bool> RedundantFrom(UpdateFrom.size(), false);
+  for (const CFGBlock *Block : *SourceCFG) {
+    uint8_t Valid = GetIn(Block);
+    for (const ValidityEvent &Event : Events[Block->getBlockID()]) {
+      if (Event.Kind == ValidityEvent::UpdateTo)
+        RedundantTo[Event.Update] = Valid & V_DEVICE;
+      else if (Event.Kind == ValidityEvent::UpdateFrom)
+        RedundantFrom[Event.Update] = Valid & V_HOST;
+      Valid = Transfer(Valid, Event);
+    }
+  }
+
+  auto Prune = [](std::vector<AccessInfo> &Updates,
+                  std::vector<ArraySection> &Sections,
+                  const std::vector<bool> &Redundant, size_t First) {
+    Sections.resize(Updates.size());
+    size_t Kept = First;
+    for (size_t I = First; I < Updates.size(); ++I) {
+      if (Redundant[I])
+        continue;
+      Updates[Kept] = Updates[I];
+      Sections[Kept] = Sections[I];
+      ++Kept;
+    }
+    NumUpdatesPruned += Updates.size() - Kept;
+    Updates.erase(Updates.begin() + Kept, Updates.end());
+    Sections.erase(Sections.begin() + Kept, Sections.end());
+  };
+  Prune(UpdateTo, TargetScope->UpdateToSections, RedundantTo, FirstUpdateTo);
+  Prune(UpdateFrom, TargetScope->UpdateFromSections, RedundantFrom,
+        FirstUpdateFrom);
+}
+
+// The statements of the function body from the first to the last of which a
+// declaration is used on the device.
+struct DeviceLifetime {
+  const ValueDecl *VD;
+  unsigned First;
+  unsigned Last;
+};
+
+// A target data region spanning statements First to Last of the function
+// body, nested in the region at index Parent or -1 if none.
+struct RegionPlan {
+  unsigned First;
+  unsigned Last;
+  int Parent;
+  std::vector<const ValueDecl *> Decls;
+};
+
+/* Groups Lifetimes into regions nested in Parent. Overlapping lifetimes share
+ * a region. Within a region, the lifetimes crossing the boundary between two
+ * statements that the fewest of them cross are mapped by the region, and the
+ * rest are grouped into regions nested in it.
+ */
+static void planRegions(std::vector<DeviceLifetime> Lifetimes, int Parent,
+                        std::vector<RegionPlan> &Plans) {
+  std::sort(Lifetimes.begin(), Lifetimes.end(),
+            [](const DeviceLifetime &A, const DeviceLifetime &B) {
+              return A.First < B.First;
+            });
+  auto GroupBegin = Lifetimes.begin();
+  while (GroupBegin != Lifetimes.end()) {
+    unsigned First = GroupBegin->First;
+    unsigned Last = GroupBegin->Last;
+    auto GroupEnd = GroupBegin + 1;
+    while (GroupEnd != Lifetimes.end() && GroupEnd->First <= Last) {
+      Last = std::max(Last, GroupEnd->Last);
+      ++GroupEnd;
+    }
+
+    int Index = Plans.size();
+    Plans.push_back({First, Last, Parent, {}});
+    size_t FewestCrossing = GroupEnd - GroupBegin;
+    unsigned Cut = First;
+    for (unsigned Boundary = First; Boundary < Last; ++Boundary) {
+      size_t Crossing =
+          std::count_if(GroupBegin, GroupEnd, [&](const DeviceLifetime &L) {
+            return L.First <= Boundary && Boundary < L.Last;
+          });
+      if (Crossing < FewestCrossing) {
+        FewestCrossing = Crossing;
+        Cut = Boundary;
+      }
+    }
+
+    std::vector<DeviceLifetime> Nested;
+    for (auto It = GroupBegin; It != GroupEnd; ++It) {
+      // Every lifetime crosses each boundary if none was found.
+      if (It->First <= Cut && Cut < It->Last)
+        Plans[Index].Decls.push_back(It->VD);
+      else
+        Nested.push_back(*It);
+    }
+    if (Plans[Index].Decls.size() == size_t(GroupEnd - GroupBegin) ||
+        First == Last) {
+      for (const DeviceLifetime &Lifetime : Nested)
+        Plans[Index].Decls.push_back(Lifetime.VD);
+    } else {
+      planRegions(Nested, Index, Plans);
+    }
+    GroupBegin = GroupEnd;
+  }
+}
+
+/* Adds the kernels within Region to it.
+ */
+void DataTracker::collectRegionKernels(TargetDataRegion *Region) const {
+  SourceManager &SM = Context->getSourceManager();
+  unsigned BeginOffset = getMainFileOffset(SM, Region->BeginLoc);
+  unsigned EndOffset = getMainFileEndOffset(SM, Region->EndLoc);
+  for (Kernel *K : Kernels) {
+    if (BeginOffset <= K->getBeginOffset() && K->getBeginOffset() <= EndOffset)
+      Region->Kernels.push_back(K->getDirective());
+  }
+}
+
+/* Creates the target data regions of the function and assigns each of Decls
+ * to the one it is mapped in. A region spans whole statements of the function
+ * body. Declarations used on the device in disjoint runs of statements get
+ * regions of their own, and those used in part of a region only are mapped in
+ * a region nested in it, so device memory is released once no kernel needs it
+ * anymore. A single region spans ScopeBegin to ScopeEnd.
+ */
+void DataTracker::createTargetScopes(
+    SourceLocation ScopeBegin, SourceLocation ScopeEnd,
+    const boost::container::flat_set<const ValueDecl *> &Decls,
+    std::vector<std::vector<const ValueDecl *>> &RegionDecls) {
+  std::vector<RegionPlan> Plans;
+  std::vector<const Stmt *> BodyStmts;
+  if (const CompoundStmt *Body = dyn_cast<CompoundStmt>(FD->getBody())) {
+    BodyStmts.assign(Body->body_begin(), Body->body_end());
+    llvm::DenseMap<const Stmt *, unsigned> StmtIndex;
+    for (unsigned I = 0; I < BodyStmts.size(); ++I)
+      StmtIndex[BodyStmts[I]] = I;
+
+    std::vector<DeviceLifetime> Lifetimes;
+    llvm::DenseMap<const ValueDecl *, size_t> LifetimeIndex;
+    bool Located = true;
+    for (const AccessInfo &Access : AccessLog) {
+      if (!(Access.Flags & A_OFFLD) || Access.Barrier != ScopeBarrier::None ||
+          !Decls.contains(Access.VD))
+        continue;
+      const Stmt *BodyStmt =
+          Access.S ? findOutermostCapturingStmt(Body, Access.S) : nullptr;
+      auto Found = StmtIndex.find(BodyStmt);
+      if (Found == StmtIndex.end()) {
+        Located = false;
+        break;
+      }
+      auto Inserted = LifetimeIndex.try_emplace(Access.VD, Lifetimes.size());
+      if (Inserted.second) {
+        Lifetimes.push_back({Access.VD, Found->second, Found->second});
+        continue;
+      }
+      DeviceLifetime &Lifetime = Lifetimes[Inserted.first->second];
+      Lifetime.First = std::min(Lifetime.First, Found->second);
+      Lifetime.Last = std::max(Lifetime.Last, Found->second);
+    }
+    if (Located)
+      planRegions(Lifetimes, -1, Plans);
+  }
+
+  if (Plans.size() <= 1) {
+    TargetScopes.push_back(new TargetDataRegion(ScopeBegin, ScopeEnd, FD));
+    collectRegionKernels(TargetScopes.back());
+    RegionDecls.emplace_back(Decls.begin(), Decls.end());
+    return;
+  }
+
+  bool SingleOutermost =
+      std::count_if(Plans.begin(), Plans.end(),
+                    [](const RegionPlan &Plan) { return Plan.Parent < 0; }) ==
+      1;
+  for (RegionPlan &Plan : Plans) {
+    SourceLocation BeginLoc = BodyStmts[Plan.First]->getBeginLoc();
+    SourceLocation EndLoc = BodyStmts[Plan.Last]->getEndLoc();
+    if (const auto *Directive =
+            dyn_cast<OMPExecutableDirective>(BodyStmts[Plan.Last])) {
+      // The end of a directive does not include its captured statement.
+      if (Directive->hasAssociatedStmt())
+        EndLoc = Directive->getInnermostCapturedStmt()->getEndLoc();
+    }
+    // The only outermost region also keeps the kernels that use no data.
+    if (Plan.Parent < 0 && SingleOutermost) {
+      BeginLoc = ScopeBegin;
+      EndLoc = ScopeEnd;
+    }
+    TargetDataRegion *Region = new TargetDataRegion(BeginLoc, EndLoc, FD);
+    if (Plan.Parent >= 0)
+      Region->Parent = TargetScopes[Plan.Parent];
+    collectRegionKernels(Region);
+    TargetScopes.push_back(Region);
+    // Same order as a single region.
+    std::sort(Plan.Decls.begin(), Plan.Decls.end());
+    RegionDecls.push_back(std::move(Plan.Decls));
+  }
+}
+
+void DataTracker::analyze() {
+  // The CFG is only needed while analyzing.
+  auto ReleaseCFG = llvm::make_scope_exit([this] {
+    SourceCFG.reset();
+    CFGPositions.clear();
+  });
+  sortAccessLog();
+
+  AccessInfo *firstOffload = nullptr;
+  AccessInfo *lastOffload = nullptr;
+  for (AccessInfo &Access : AccessLog) {
+    if (Access.Flags & A_OFFLD) {
+      if (!firstOffload) {
+        firstOffload = &Access;
+        lastOffload = &Access;
+      } else {
+        lastOffload = &Access;
+      }
+    }
+  }
+  if (!firstOffload) {
+    // There is nothing to analyze.
+    return;
+  }
+
+  classifyOffloadedOps();
+
+  const Stmt *FrontCapturingStmt =
+      findOutermostCapturingStmt(FD->getBody(), firstOffload->S);
+  const Stmt *BackCapturingStmt =
+      findOutermostCapturingStmt(FD->getBody(), lastOffload->S);
+  SourceLocation ScopeBegin;
+  SourceLocation ScopeEnd;
+  if (FrontCapturingStmt) {
+    ScopeBegin = FrontCapturingStmt->getBeginLoc();
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "FrontCapturingStmt is "
+                 << ScopeBegin.printToString(Context->getSourceManager())
+                 << " in " << FD->getNameAsString() << "\n";
+#endif
+  } else {
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "FrontCapturingStmt null in " << FD->getNameAsString()
+                 << "\n";
+#endif
+  }
+  if (BackCapturingStmt) {
+    ScopeEnd = BackCapturingStmt->getEndLoc();
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "BackCapturingStmt is "
+                 << ScopeEnd.printToString(Context->getSourceManager())
+                 << " in " << FD->getNameAsString() << "\n";
+#endif
+  } else {
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "BackCapturingStmt null in " << FD->getNameAsString()
+                 << "\n";
+#endif
+  }
+
+  if (Kernels.size() > 0) {
+    // Identify the root(outermost) target scope in the function.
+    FrontCapturingStmt =
+        findOutermostCapturingStmt(FD->getBody(), Kernels[0]->getDirective());
+    SourceLocation KernelScopeBegin = FrontCapturingStmt->getBeginLoc();
+    BackCapturingStmt = findOutermostCapturingStmt(
+        FD->getBody(), Kernels.back()->getDirective());
+    SourceLocation KernelScopeEnd = BackCapturingStmt->getEndLoc();
+    if (auto OpenMPDirective =
+            dyn_cast<OMPExecutableDirective>(BackCapturingStmt)) {
+      // ugh. The getEndLoc() of OpenMP directives is different and doesn't
+      // consider the captured statement while seemingly every other statement
+      // does.
+      KernelScopeEnd = OpenMPDirective->getInnermostCapturedStmt()->getEndLoc();
+    }
+    SourceManager &SM = Context->getSourceManager();
+    if (ScopeBegin.isInvalid() || getMainFileOffset(SM, KernelScopeBegin) <
+                                      getMainFileOffset(SM, ScopeBegin)) {
+      ScopeBegin = KernelScopeBegin;
+    }
+    if (ScopeEnd.isInvalid() || getMainFileEndOffset(SM, ScopeEnd) <
+                                    getMainFileEndOffset(SM, KernelScopeEnd)) {
+      ScopeEnd = KernelScopeEnd;
+    }
+  }
+
+  if (ScopeBegin.isInvalid() || ScopeEnd.isInvalid()) {
+    Diagnostics.push_back({AnalysisDiag::UndeterminedScope, FD->getLocation(),
+                           SourceLocation(), FD});
+    return;
+  }
+
+  for (Kernel *K : Kernels) {
+    auto Privates = K->getPrivateDecls();
+    for (const ValueDecl *VD : Privates) {
+      Disabled.insert(VD->getID());
+    }
+  }
+
+  // Map a list of all the data the target data regions will be responsible
+  // for.
+  boost::container::flat_set<const ValueDecl *> TargetScopeDecls;
+  for (auto It = AccessLog.begin(); It != AccessLog.end(); ++It) {
+    if (It->Flags & A_OFFLD && It->Barrier == ScopeBarrier::None &&
+        !Disabled.contains(It->VD->getID()))
+      TargetScopeDecls.insert(It->VD);
+  }
+
+  std::vector<std::vector<const ValueDecl *>> RegionDecls;
+  createTargetScopes(ScopeBegin, ScopeEnd, TargetScopeDecls, RegionDecls);
+  for (size_t I = 0; I < TargetScopes.size(); ++I) {
+    TargetScope = TargetScopes[I];
+    for (const ValueDecl *VD : RegionDecls[I]) {
+      size_t FirstUpdateTo = TargetScope->UpdateTo.size();
+      size_t FirstUpdateFrom = TargetScope->UpdateFrom.size();
+      analyzeValueDecl(VD);
+      analyzeValueDeclArrayBounds(VD);
+      pruneRedundantUpdates(VD, FirstUpdateTo, FirstUpdateFrom);
+    }
+  }
+  TargetScope = nullptr;
+
+  return;
+}
+
+/* Index of the access log entry a region entry was copied from, -1 if there is
+ * none. The copy may name another decl or barrier than the original.
+ */
+static int64_t findSourceEntry(const std::vector<AccessInfo> &AccessLog,
+                               const AccessInfo &Access) {
+  int64_t Found = -1;
+  for (size_t I = 0; I < AccessLog.size(); ++I) {
+    if (AccessLog[I].Loc != Access.Loc || AccessLog[I].S != Access.S)
+      continue;
+    if (AccessLog[I].VD == Access.VD)
+      return I;
+    if (Found < 0)
+      Found = I;
+  }
+  return Found;
+}
+
+/* Returns the body of S if it is a loop, NULL otherwise.
+ */
+static const Stmt *getLoopBody(const Stmt *S) {
+  if (const ForStmt *FS = dyn_cast<ForStmt>(S))
+    return FS->getBody();
+  if (const WhileStmt *WS = dyn_cast<WhileStmt>(S))
+    return WS->getBody();
+  if (const DoStmt *DS = dyn_cast<DoStmt>(S))
+    return DS->getBody();
+  return nullptr;
+}
+
+/* Decides which updates of the target data regions may run asynchronously.
+ * An update is asynchronous if the next access to its data within its region
+ * is either in a kernel, which then waits for it through a depend clause, or
+ * a host access a taskwait can be inserted before. Host reads do not need to
+ * wait for updates of the device. Updates followed by host control flow
+ * before either remain synchronous.
+ */
+void DataTracker::planAsyncUpdates() {
+  sortAccessLog();
+  SourceManager &SM = Context->getSourceManager();
+  auto IsBefore = [](const AccessInfo &Access, unsigned Offset) {
+    return Access.Offset < Offset;
+  };
+
+  for (TargetDataRegion *Region : TargetScopes) {
+    unsigned RegionEndOffset = getMainFileEndOffset(SM, Region->EndLoc);
+    // Places the update where the rewriter will and looks for the first
+    // access after it that has to wait.
+    auto IsAsync = [&](const AccessInfo &Update, bool ToDevice) {
+      const Stmt *FullStmt = getUpdateStmt(*Context, Update);
+      if (!FullStmt)
+        return false;
+      const Stmt *Body = getLoopBody(FullStmt);
+      unsigned Offset;
+      if (ToDevice) {
+        if (Body && Update.Barrier != ScopeBarrier::LoopEnd)
+          Offset = getMainFileOffset(SM, Body->getBeginLoc()) + 1;
+        else
+          Offset = getMainFileEndOffset(SM, FullStmt->getEndLoc()) + 1;
+      } else {
+        // Updates at the end of a loop body are followed by its back edge.
+        if (isa_and_nonnull<DoStmt>(FullStmt) ||
+            (Body && Update.Barrier == ScopeBarrier::LoopEnd))
+          return false;
+        Offset = getMainFileOffset(SM, FullStmt->getBeginLoc());
+      }
+
+      const OMPExecutableDirective *Directive = nullptr;
+      for (auto It = std::lower_bound(AccessLog.begin(), AccessLog.end(),
+                                      Offset, IsBefore);
+           It != AccessLog.end() && It->Offset <= RegionEndOffset; ++It) {
+        if (It->Barrier == ScopeBarrier::KernelBegin) {
+          Directive = dyn_cast_or_null<OMPExecutableDirective>(It->S);
+          continue;
+        }
+        if (It->Barrier == ScopeBarrier::KernelEnd) {
+          Directive = nullptr;
+          continue;
+        }
+        if (It->Barrier != ScopeBarrier::None) {
+          // Only control flow within kernels is ordered with the update.
+          if (Directive)
+            continue;
+          return false;
+        }
+        if (It->VD != Update.VD)
+          continue;
+        if (Directive) {
+          Region->DependIn.emplace_back(Directive, Update.VD);
+          return true;
+        }
+        if (ToDevice && !(It->Flags & (A_WRONLY | A_UNKNOWN | A_OFFLD)))
+          continue;
+
+        const Stmt *S = It->S;
+        if (!S) {
+          // Accesses by a callee carry the location of the call.
+          auto Call = std::find_if(CallExprs.begin(), CallExprs.end(),
+                                   [&](const CallExpr *CE) {
+                                     return CE->getBeginLoc() == It->Loc;
+                                   });
+          if (Call == CallExprs.end())
+            return false;
+          S = *Call;
+        }
+        S = getSemiTerminatedStmt(*Context, S);
+        if (std::find(Region->TaskWaits.begin(), Region->TaskWaits.end(), S) ==
+            Region->TaskWaits.end())
+          Region->TaskWaits.push_back(S);
+        return true;
+      }
+      return false;
+    };
+
+    Region->UpdateToAsync.clear();
+    for (const AccessInfo &Update : Region->UpdateTo)
+      Region->UpdateToAsync.push_back(IsAsync(Update, true));
+    Region->UpdateFromAsync.clear();
+    for (const AccessInfo &Update : Region->UpdateFrom)
+      Region->UpdateFromAsync.push_back(IsAsync(Update, false));
+  }
+}
+
+/* Returns true if S may jump out of the statement it is in. Breaks and
+ * continues of the loops and switches within S stay inside it.
+ */
+static bool mayJumpOut(const Stmt *S, bool InLoop = false,
+                       bool InSwitch = false) {
+  if (!S)
+    return false;
+  if (isa<ReturnStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) ||
+      isa<CXXThrowExpr>(S))
+    return true;
+  if ((isa<BreakStmt>(S) && !InLoop && !InSwitch) ||
+      (isa<ContinueStmt>(S) && !InLoop))
+    return true;
+  InLoop |= isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) ||
+            isa<CXXForRangeStmt>(S);
+  InSwitch |= isa<SwitchStmt>(S);
+  for (const Stmt *Child : S->children()) {
+    if (mayJumpOut(Child, InLoop, InSwitch))
+      return true;
+  }
+  return false;
+}
+
+/* Plans to keep the buffer allocated for the local pointer VD on the device
+ * until it is freed. The allocation has to be the only value stored to VD,
+ * and be freed exactly once later in the same block, with no statement in
+ * between that may leave the block. Returns false otherwise.
+ */
+bool DataTracker::planDeviceAllocation(const ValueDecl *VD) {
+  if (!VD->getType()->isPointerType())
+    return false;
+  const PointerDefinition *Def = getOnlyDefinition(VD, BodyEndOffset + 1);
+  if (!Def || !Def->IsAllocation || !Def->Value)
+    return false;
+
+  const Stmt *Release = nullptr;
+  for (const CallExpr *CE : CallExprs) {
+    const FunctionDecl *Callee = CE->getDirectCallee();
+    bool Frees = isMemDealloc(Callee);
+    if (!Frees && !isMemAlloc(Callee))
+      continue;
+    for (const Expr *Arg : CE->arguments()) {
+      const DeclRefExpr *DRE =
+          dyn_cast<DeclRefExpr>(Arg->IgnoreParenCasts());
+      if (!DRE || DRE->getDecl() != VD)
+        continue;
+      // A realloc moves the buffer, and it must not be freed twice.
+      if (!Frees || Release)
+        return false;
+      Release = CE;
+    }
+  }
+  if (!Release)
+    return false;
+
+  const Stmt *Alloc = getSemiTerminatedStmt(*Context, Def->Value);
+  Release = getSemiTerminatedStmt(*Context, Release);
+  if (!Alloc || !Release)
+    return false;
+  const auto &AllocParents = Context->getParents(*Alloc);
+  const auto &ReleaseParents = Context->getParents(*Release);
+  if (AllocParents.size() == 0 || ReleaseParents.size() == 0)
+    return false;
+  const CompoundStmt *Block = AllocParents[0].get<CompoundStmt>();
+  if (!Block || Block != ReleaseParents[0].get<CompoundStmt>())
+    return false;
+  auto AllocIt = std::find(Block->body_begin(), Block->body_end(), Alloc);
+  auto ReleaseIt = std::find(AllocIt, Block->body_end(), Release);
+  if (AllocIt == Block->body_end() || ReleaseIt == Block->body_end())
+    return false;
+  for (auto It = std::next(AllocIt); It != ReleaseIt; ++It) {
+    if (mayJumpOut(*It))
+      return false;
+  }
+
+  SourceManager &SM = Context->getSourceManager();
+  DeviceAllocation Allocation{VD, Alloc, Release, {}};
+  if (!getAllocationSection(VD, getMainFileEndOffset(SM, Alloc->getEndLoc()),
+                            getMainFileOffset(SM, Release->getBeginLoc()),
+                            Allocation.Section))
+    return false;
+
+  unsigned Offset = getMainFileOffset(SM, VD->getLocation());
+  auto It = std::find_if(
+      DeviceAllocations.begin(), DeviceAllocations.end(),
+      [&](const DeviceAllocation &Other) {
+        return getMainFileOffset(SM, Other.VD->getLocation()) > Offset;
+      });
+  DeviceAllocations.insert(It, std::move(Allocation));
+  return true;
+}
+
+/* Marks the variables of Decls mapped by the target data regions, as their
+ * buffers may already be on the device when a region begins.
+ */
+void DataTracker::markPresentOnEntry(
+    const boost::container::flat_set<const ValueDecl *> &Decls) {
+  for (TargetDataRegion *Region : TargetScopes) {
+    Region->PresentOnEntry.clear();
+    for (const std::vector<AccessInfo> *Maps :
+         {&Region->MapTo, &Region->MapFrom, &Region->MapToFrom,
+          &Region->MapAlloc}) {
+      for (const AccessInfo &Access : *Maps) {
+        if (Decls.contains(Access.VD))
+          Region->PresentOnEntry.push_back(Access.VD);
+      }
+    }
+  }
+}
+
+const std::vector<DeviceAllocation> &
+DataTracker::getDeviceAllocations() const {
+  return DeviceAllocations;
+}
+
+/* Returns true if Region maps VD.
+ */
+static bool isMappedBy(const TargetDataRegion *Region, const ValueDecl *VD) {
+  for (const std::vector<AccessInfo> *Maps :
+       {&Region->getMapTo(), &Region->getMapFrom(), &Region->getMapToFrom(),
+        &Region->getMapAlloc()}) {
+    if (std::any_of(Maps->begin(), Maps->end(),
+                    [VD](const AccessInfo &Access) { return Access.VD == VD; }))
+      return true;
+  }
+  return false;
+}
+
+/* Returns true if VD is accessed, and only accessed, within kernels.
+ */
+bool DataTracker::isOnlyOffloaded(const ValueDecl *VD) {
+  sortAccessLog();
+  bool Accessed = false;
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.VD != VD || Entry.Barrier != ScopeBarrier::None ||
+        Entry.Flags == A_NOP)
+      continue;
+    if (!(Entry.Flags & A_OFFLD))
+      return false;
+    Accessed = true;
+  }
+  return Accessed;
+}
+
+/* Finds the outermost host loop around CE that a target data region mapping VD
+ * can be wrapped around: VD is declared before it, only accessed in it by the
+ * calls of Calls, not mapped by a region overlapping it, and the extent of its
+ * buffer is known throughout it. Section is set to the section to map.
+ * Returns NULL if there is no such loop.
+ */
+const Stmt *DataTracker::findHoistLoop(
+    const ValueDecl *VD, const CallExpr *CE,
+    const boost::container::flat_set<const Stmt *> &Calls,
+    ArraySection &Section) {
+  SourceManager &SM = Context->getSourceManager();
+  auto InKernel = [this](SourceLocation Loc) {
+    return std::any_of(Kernels.begin(), Kernels.end(),
+                       [Loc](const Kernel *K) { return K->contains(Loc); });
+  };
+  if (InKernel(CE->getBeginLoc()))
+    return nullptr;
+
+  // Host loops around the call, innermost first.
+  unsigned CallOffset = getMainFileOffset(SM, CE->getBeginLoc());
+  std::vector<std::pair<unsigned, const Stmt *>> Enclosing;
+  for (const Stmt *Loop : Loops) {
+    unsigned Begin = getMainFileOffset(SM, Loop->getBeginLoc());
+    unsigned End = getMainFileEndOffset(SM, Loop->getEndLoc());
+    if (Begin <= CallOffset && CallOffset <= End &&
+        !InKernel(Loop->getBeginLoc()))
+      Enclosing.emplace_back(Begin, Loop);
+  }
+  std::sort(Enclosing.rbegin(), Enclosing.rend());
+
+  bool IsLocal = Locals.contains(VD) && !isa<ParmVarDecl>(VD);
+  unsigned DeclOffset = getMainFileOffset(SM, VD->getLocation());
+  const Stmt *Found = nullptr;
+  for (const auto &Loop : Enclosing) {
+    unsigned Begin = Loop.first;
+    unsigned End = getMainFileEndOffset(SM, Loop.second->getEndLoc());
+    if (IsLocal && DeclOffset >= Begin)
+      break;
+    if (std::any_of(AccessLog.begin(), AccessLog.end(),
+                    [&](const AccessInfo &Entry) {
+                      return Entry.VD == VD &&
+                             Entry.Barrier == ScopeBarrier::None &&
+                             Begin <= Entry.Offset && Entry.Offset <= End &&
+                             !Calls.contains(Entry.S);
+                    }))
+      break;
+    auto Overlaps = [&](const TargetDataRegion *Region) {
+      return getMainFileOffset(SM, Region->BeginLoc) <= End &&
+             Begin <= getMainFileEndOffset(SM, Region->EndLoc);
+    };
+    if (std::any_of(TargetScopes.begin(), TargetScopes.end(),
+                    [&](const TargetDataRegion *Region) {
+                      return Overlaps(Region) && isMappedBy(Region, VD);
+                    }))
+      break;
+    ArraySection LoopSection;
+    if (VD->getType()->isPointerType()) {
+      if (!getAllocationSection(VD, Begin, End, LoopSection))
+        break;
+    } else if (!Context->getAsConstantArrayType(VD->getType())) {
+      break;
+    }
+    // The directive has to start a line of its own.
+    const auto &Parents = Context->getParents(*Loop.second);
+    if (Parents.size() == 0 || !Parents[0].get<CompoundStmt>())
+      continue;
+    Found = Loop.second;
+    Section = LoopSection;
+  }
+  return Found;
+}
+
+/* Returns the region wrapped around Loop for the mappings of callees, creating
+ * it if there is none yet. A new region is nested in the innermost region
+ * around Loop, and the regions within Loop in it.
+ */
+TargetDataRegion *DataTracker::getHoistRegion(const Stmt *Loop) {
+  for (const auto &Hoist : HoistRegions) {
+    if (Hoist.first == Loop)
+      return Hoist.second;
+  }
+
+  SourceManager &SM = Context->getSourceManager();
+  TargetDataRegion *Region =
+      new TargetDataRegion(Loop->getBeginLoc(), Loop->getEndLoc(), FD);
+  unsigned Begin = getMainFileOffset(SM, Loop->getBeginLoc());
+  unsigned End = getMainFileEndOffset(SM, Loop->getEndLoc());
+  // Regions are in preorder, which is the order of their beginnings with
+  // outer regions first. A region of the same extent ends up inside.
+  size_t Pos = 0;
+  for (size_t I = 0; I < TargetScopes.size(); ++I) {
+    unsigned RegionBegin = getMainFileOffset(SM, TargetScopes[I]->BeginLoc);
+    unsigned RegionEnd = getMainFileEndOffset(SM, TargetScopes[I]->EndLoc);
+    if (RegionBegin > Begin || (RegionBegin == Begin && RegionEnd <= End))
+      break;
+    Pos = I + 1;
+    if (End <= RegionEnd)
+      Region->Parent = TargetScopes[I];
+  }
+  for (size_t I = Pos; I < TargetScopes.size(); ++I) {
+    if (TargetScopes[I]->Parent == Region->Parent &&
+        getMainFileEndOffset(SM, TargetScopes[I]->EndLoc) <= End)
+      TargetScopes[I]->Parent = Region;
+  }
+  TargetScopes.insert(TargetScopes.begin() + Pos, Region);
+  HoistRegions.emplace_back(Loop, Region);
+  return Region;
+}
+
+/* Moves the mappings of VD by the callees of Calls into target data regions
+ * wrapped around the outermost loops the calls can be hoisted out of. Each
+ * call comes with the data its callee transfers, to the device if A_RDONLY is
+ * set and from it if A_WRONLY is. The calls moved are added to Hoisted.
+ * Returns the number of regions created.
+ */
+unsigned DataTracker::hoistCalleeMappings(
+    const ValueDecl *VD,
+    const std::vector<std::pair<const CallExpr *, uint8_t>> &Calls,
+    std::vector<const CallExpr *> &Hoisted) {
+  sortAccessLog();
+  boost::container::flat_set<const Stmt *> CallSet;
+  for (const auto &Call : Calls)
+    CallSet.insert(Call.first);
+
+  size_t NumRegions = HoistRegions.size();
+  for (const auto &Call : Calls) {
+    ArraySection Section;
+    const Stmt *Loop = findHoistLoop(VD, Call.first, CallSet, Section);
+    if (!Loop)
+      continue;
+    TargetDataRegion *Region = getHoistRegion(Loop);
+
+    // Merged with the mapping of VD for other calls in the loop.
+    uint8_t Flags = Call.second & A_RDWR;
+    for (std::vector<AccessInfo> *Maps :
+         {&Region->MapTo, &Region->MapFrom, &Region->MapToFrom,
+          &Region->MapAlloc}) {
+      auto It = std::find_if(
+          Maps->begin(), Maps->end(),
+          [VD](const AccessInfo &Access) { return Access.VD == VD; });
+      if (It == Maps->end())
+        continue;
+      Flags |= It->Flags;
+      Maps->erase(It);
+    }
+    AccessInfo Access = {};
+    Access.VD = VD;
+    Access.S = Call.first;
+    Access.Loc = Call.first->getBeginLoc();
+    Access.Offset =
+        getMainFileOffset(Context->getSourceManager(), Access.Loc);
+    Access.Flags = Flags;
+    if (Flags == A_RDWR)
+      Region->MapToFrom.push_back(Access);
+    else if (Flags == A_RDONLY)
+      Region->MapTo.push_back(Access);
+    else if (Flags == A_WRONLY)
+      Region->MapFrom.push_back(Access);
+    else
+      Region->MapAlloc.push_back(Access);
+    if (!Section.Dims.empty())
+      Region->Sections[VD] = Section;
+    Hoisted.push_back(Call.first);
+  }
+  return HoistRegions.size() - NumRegions;
+}
+
+/* Lets Regions look up the device data of VD rather than map it.
+ */
+void DataTracker::assumePresentIn(std::vector<TargetDataRegion *> &Regions,
+                                  const ValueDecl *VD) {
+  auto IsVD = [VD](const AccessInfo &Access) { return Access.VD == VD; };
+  for (TargetDataRegion *Region : Regions) {
+    if (!isMappedBy(Region, VD))
+      continue;
+    for (std::vector<AccessInfo> *Maps :
+         {&Region->MapTo, &Region->MapFrom, &Region->MapToFrom}) {
+      auto It = std::find_if(Maps->begin(), Maps->end(), IsVD);
+      if (It == Maps->end())
+        continue;
+      if (std::none_of(Region->MapAlloc.begin(), Region->MapAlloc.end(), IsVD))
+        Region->MapAlloc.push_back(*It);
+      Maps->erase(It);
+    }
+    Region->AssumedPresent.push_back(VD);
+  }
+}
+
+/* Lets the target data regions look up the device data of VD rather than map
+ * it, as every caller maps it around its calls already.
+ */
+void DataTracker::assumePresent(const ValueDecl *VD) {
+  assumePresentIn(TargetScopes, VD);
+}
+
+/* Returns copies of the target data regions for a clone of the function whose
+ * callers map the data of Present around its calls already.
+ */
+std::vector<TargetDataRegion *> DataTracker::cloneTargetDataScopes(
+    const std::vector<const ValueDecl *> &Present) const {
+  std::vector<TargetDataRegion *> Regions;
+  llvm::DenseMap<const TargetDataRegion *, TargetDataRegion *> Copies;
+  for (const TargetDataRegion *Region : TargetScopes) {
+    TargetDataRegion *Copy = new TargetDataRegion(*Region);
+    if (Region->Parent)
+      Copy->Parent = Copies.lookup(Region->Parent);
+    Copies[Region] = Copy;
+    Regions.push_back(Copy);
+  }
+  for (const ValueDecl *VD : Present)
+    assumePresentIn(Regions, VD);
+  return Regions;
+}
+
+/* Removes the transfers the properties asserted for the data make unnecessary.
+ * Data resident on the device is only looked up there by the regions mapping
+ * it and is never updated, and data dead on the host is never copied back.
+ */
+void DataTracker::dropAssertedTransfers() {
+  if (AssertedProperties.empty())
+    return;
+  auto Has = [this](const ValueDecl *VD, uint8_t Properties) {
+    auto It = AssertedProperties.find(VD);
+    return It != AssertedProperties.end() && (It->second & Properties);
+  };
+  // Removes the updates of data with one of Properties and their sections.
+  auto DropUpdates = [&Has](std::vector<AccessInfo> &Updates,
+                            std::vector<ArraySection> &Sections,
+                            uint8_t Properties) {
+    for (size_t I = Updates.size(); I-- > 0;) {
+      if (!Has(Updates[I].VD, Properties))
+        continue;
+      Updates.erase(Updates.begin() + I);
+      if (I < Sections.size())
+        Sections.erase(Sections.begin() + I);
+    }
+  };
+
+  for (const auto &Asserted : AssertedProperties) {
+    if (Asserted.second & P_DEVICE_RESIDENT)
+      assumePresent(Asserted.first);
+  }
+  for (TargetDataRegion *Region : TargetScopes) {
+    for (auto It = Region->MapToFrom.begin(); It != Region->MapToFrom.end();) {
+      if (!Has(It->VD, P_HOST_DEAD)) {
+        ++It;
+        continue;
+      }
+      Region->MapTo.push_back(*It);
+      It = Region->MapToFrom.erase(It);
+    }
+    for (auto It = Region->MapFrom.begin(); It != Region->MapFrom.end();) {
+      if (!Has(It->VD, P_HOST_DEAD)) {
+        ++It;
+        continue;
+      }
+      Region->MapAlloc.push_back(*It);
+      It = Region->MapFrom.erase(It);
+    }
+    DropUpdates(Region->UpdateTo, Region->UpdateToSections, P_DEVICE_RESIDENT);
+    DropUpdates(Region->UpdateFrom, Region->UpdateFromSections,
+                P_DEVICE_RESIDENT | P_HOST_DEAD);
+  }
+}
+
+static int64_t findDeclEntry(const std::vector<AccessInfo> &AccessLog,
+                             const ValueDecl *VD) {
+  for (size_t I = 0; I < AccessLog.size(); ++I) {
+    if (AccessLog[I].VD == VD)
+      return I;
+  }
+  return -1;
+}
+
+/* Records the results of analyze() in a form that does not depend on AST
+ * pointers or absolute source locations.
+ */
+CachedAnalysis DataTracker::saveAnalysis() {
+  sortAccessLog();
+  CachedAnalysis Cached;
+  SourceManager &SM = Context->getSourceManager();
+
+  auto SaveAccesses = [&](const std::vector<AccessInfo> &Accesses,
+                          std::vector<CachedAccess> &Out) {
+    for (const AccessInfo &Access : Accesses) {
+      int64_t Entry = Access.Loc.isValid() ? findSourceEntry(AccessLog, Access)
+                                           : -1;
+      Out.push_back({Entry, findDeclEntry(AccessLog, Access.VD),
+                     static_cast<uint8_t>(Access.Barrier)});
+    }
+  };
+  auto SaveClauses = [&](const std::vector<ClauseInfo> &Clauses,
+                         std::vector<CachedClause> &Out) {
+    for (const ClauseInfo &Clause : Clauses) {
+      int64_t Directive = -1;
+      for (size_t I = 0; I < AccessLog.size(); ++I) {
+        if (AccessLog[I].S == Clause.Directive) {
+          Directive = I;
+          break;
+        }
+      }
+      Out.push_back({Directive, findDeclEntry(AccessLog, Clause.VD)});
+    }
+  };
+
+  auto SaveSection = [](int64_t Index, const ArraySection &Section) {
+    CachedSection Saved{Index, {}};
+    for (const SectionDim &Dim : Section.Dims) {
+      Saved.Bounds.push_back(Dim.Lower);
+      Saved.Bounds.push_back(Dim.Length);
+    }
+    return Saved;
+  };
+  auto SaveUpdateSections = [&](const std::vector<ArraySection> &Sections,
+                                std::vector<CachedSection> &Out) {
+    for (size_t I = 0; I < Sections.size(); ++I) {
+      if (!Sections[I].Dims.empty())
+        Out.push_back(SaveSection(I, Sections[I]));
+    }
+  };
+
+  for (const TargetDataRegion *Region : TargetScopes) {
+    Cached.Regions.emplace_back();
+    CachedRegion &Saved = Cached.Regions.back();
+    Saved.BeginOffset =
+        getMainFileOffset(SM, Region->BeginLoc) - BodyBeginOffset;
+    Saved.EndOffset = getMainFileOffset(SM, Region->EndLoc) - BodyBeginOffset;
+    if (Region->Parent) {
+      Saved.Parent = std::find(TargetScopes.begin(), TargetScopes.end(),
+                               Region->Parent) -
+                     TargetScopes.begin();
+    }
+    SaveAccesses(Region->MapTo, Saved.MapTo);
+    SaveAccesses(Region->MapFrom, Saved.MapFrom);
+    SaveAccesses(Region->MapToFrom, Saved.MapToFrom);
+    SaveAccesses(Region->MapAlloc, Saved.MapAlloc);
+    SaveAccesses(Region->UpdateTo, Saved.UpdateTo);
+    SaveAccesses(Region->UpdateFrom, Saved.UpdateFrom);
+    SaveClauses(Region->Private, Saved.Private);
+    SaveClauses(Region->FirstPrivate, Saved.FirstPrivate);
+    for (const auto &Section : Region->Sections) {
+      Saved.Sections.push_back(SaveSection(
+          findDeclEntry(AccessLog, Section.first), Section.second));
+    }
+    // DenseMap order depends on addresses.
+    std::sort(Saved.Sections.begin(), Saved.Sections.end(),
+              [](const CachedSection &A, const CachedSection &B) {
+                return A.Index < B.Index;
+              });
+    SaveUpdateSections(Region->UpdateToSections, Saved.UpdateToSections);
+    SaveUpdateSections(Region->UpdateFromSections, Saved.UpdateFromSections);
+  }
+
+  for (const PendingDiagnostic &Diag : Diagnostics) {
+    if (Diag.Kind == AnalysisDiag::UndeterminedScope) {
+      Cached.Diagnostics.push_back({static_cast<uint8_t>(Diag.Kind), -1, -1});
+      continue;
+    }
+    const ValueDecl *VD = cast<ValueDecl>(Diag.D);
+    int64_t Entry = -1;
+    if (AccessInfo *Found = findAccessLogEntry(VD, Diag.Loc))
+      Entry = Found - AccessLog.data();
+    Cached.Diagnostics.push_back({static_cast<uint8_t>(Diag.Kind), Entry,
+                                  findDeclEntry(AccessLog, VD)});
+  }
+  return Cached;
+}
+
+/* Rebuilds the results of analyze() from an earlier run. Only valid if the
+ * function and its access log are unchanged since Cached was saved. Returns
+ * false if Cached does not fit the access log.
+ */
+bool DataTracker::restoreAnalysis(const CachedAnalysis &Cached) {
+  sortAccessLog();
+  classifyOffloadedOps();
+  SourceManager &SM = Context->getSourceManager();
+  const int64_t LogSize = AccessLog.size();
+  auto ValidIndex = [LogSize](int64_t I) { return 0 <= I && I < LogSize; };
+
+  std::vector<PendingDiagnostic> RestoredDiagnostics;
+  for (const CachedDiagnostic &Diag : Cached.Diagnostics) {
+    AnalysisDiag Kind = static_cast<AnalysisDiag>(Diag.Kind);
+    if (Kind == AnalysisDiag::UndeterminedScope) {
+      RestoredDiagnostics.push_back(
+          {Kind, FD->getLocation(), SourceLocation(), FD});
+      continue;
+    }
+    if (!ValidIndex(Diag.Entry) || !ValidIndex(Diag.Decl) ||
+        (Kind == AnalysisDiag::CapturedDeclaration && Cached.Regions.empty()))
+      return false;
+    RestoredDiagnostics.push_back({Kind, AccessLog[Diag.Entry].Loc,
+                                   SourceLocation(),
+                                   AccessLog[Diag.Decl].VD});
+  }
+
+  auto RestoreAccesses = [&](const std::vector<CachedAccess> &Accesses,
+                             std::vector<AccessInfo> &Out) {
+    for (const CachedAccess &Saved : Accesses) {
+      if (!ValidIndex(Saved.Decl) ||
+          (Saved.Entry != -1 && !ValidIndex(Saved.Entry)))
+        return false;
+      AccessInfo Access = {};
+      if (Saved.Entry != -1)
+        Access = AccessLog[Saved.Entry];
+      Access.VD = AccessLog[Saved.Decl].VD;
+      Access.Barrier = static_cast<ScopeBarrier>(Saved.Barrier);
+      Out.push_back(Access);
+    }
+    return true;
+  };
+  auto RestoreClauses = [&](const std::vector<CachedClause> &Clauses,
+                            std::vector<ClauseInfo> &Out) {
+    for (const CachedClause &Saved : Clauses) {
+      if (!ValidIndex(Saved.Directive) || !ValidIndex(Saved.Decl))
+        return false;
+      const auto *Directive = dyn_cast_or_null<OMPExecutableDirective>(
+          AccessLog[Saved.Directive].S);
+      if (!Directive)
+        return false;
+      Out.emplace_back(Directive, AccessLog[Saved.Decl].VD);
+    }
+    return true;
+  };
+  auto RestoreSection = [](const CachedSection &Saved) {
+    ArraySection Section;
+    for (size_t I = 0; I + 1 < Saved.Bounds.size(); I += 2)
+      Section.Dims.push_back({Saved.Bounds[I], Saved.Bounds[I + 1]});
+    return Section;
+  };
+  auto RestoreUpdateSections = [&](const std::vector<CachedSection> &Sections,
+                                   size_t NumUpdates,
+                                   std::vector<ArraySection> &Out) {
+    Out.resize(NumUpdates);
+    for (const CachedSection &Saved : Sections) {
+      if (Saved.Index < 0 || static_cast<size_t>(Saved.Index) >= NumUpdates)
+        return false;
+      Out[Saved.Index] = RestoreSection(Saved);
+    }
+    return true;
+  };
+
+  FileID MainFile = SM.getMainFileID();
+  std::vector<std::unique_ptr<TargetDataRegion>> Regions;
+  for (const CachedRegion &Saved : Cached.Regions) {
+    // A region is saved after the one it is nested in.
+    if (Saved.Parent >= static_cast<int64_t>(Regions.size()))
+      return false;
+    SourceLocation BeginLoc =
+        SM.getComposedLoc(MainFile, BodyBeginOffset + Saved.BeginOffset);
+    SourceLocation EndLoc =
+        SM.getComposedLoc(MainFile, BodyBeginOffset + Saved.EndOffset);
+    Regions.emplace_back(new TargetDataRegion(BeginLoc, EndLoc, FD));
+    TargetDataRegion *Region = Regions.back().get();
+    if (Saved.Parent >= 0)
+      Region->Parent = Regions[Saved.Parent].get();
+    collectRegionKernels(Region);
+
+    if (!RestoreAccesses(Saved.MapTo, Region->MapTo) ||
+        !RestoreAccesses(Saved.MapFrom, Region->MapFrom) ||
+        !RestoreAccesses(Saved.MapToFrom, Region->MapToFrom) ||
+        !RestoreAccesses(Saved.MapAlloc, Region->MapAlloc) ||
+        !RestoreAccesses(Saved.UpdateTo, Region->UpdateTo) ||
+        !RestoreAccesses(Saved.UpdateFrom, Region->UpdateFrom) ||
+        !RestoreClauses(Saved.Private, Region->Private) ||
+        !RestoreClauses(Saved.FirstPrivate, Region->FirstPrivate))
+      return false;
+    for (const CachedSection &Section : Saved.Sections) {
+      if (!ValidIndex(Section.Index))
+        return false;
+      Region->Sections[AccessLog[Section.Index].VD] = RestoreSection(Section);
+    }
+    if (!RestoreUpdateSections(Saved.UpdateToSections, Region->UpdateTo.size(),
+                               Region->UpdateToSections) ||
+        !RestoreUpdateSections(Saved.UpdateFromSections,
+                               Region->UpdateFrom.size(),
+                               Region->UpdateFromSections))
+      return false;
+  }
+
+  for (PendingDiagnostic &Diag : RestoredDiagnostics) {
+    if (Diag.Kind != AnalysisDiag::CapturedDeclaration)
+      continue;
+    // Noted at the outermost region the declaration is captured in.
+    unsigned Offset = getMainFileOffset(SM, Diag.Loc);
+    Diag.NoteLoc = Regions.front()->BeginLoc;
+    for (const std::unique_ptr<TargetDataRegion> &Region : Regions) {
+      if (!Region->Parent &&
+          getMainFileOffset(SM, Region->BeginLoc) <= Offset &&
+          Offset <= getMainFileOffset(SM, Region->EndLoc)) {
+        Diag.NoteLoc = Region->BeginLoc;
+        break;
+      }
+    }
+  }
+  Diagnostics.insert(Diagnostics.end(), RestoredDiagnostics.begin(),
+                     RestoredDiagnostics.end());
+  for (std::unique_ptr<TargetDataRegion> &Region : Regions)
+    TargetScopes.push_back(Region.release());
+  return true;
+}
+
+void DataTracker::emitDiagnostics() {
+  DiagnosticsEngine &DiagEngine = Context->getDiagnostics();
+  for (const PendingDiagnostic &Diag : Diagnostics) {
+    switch (Diag.Kind) {
+    case AnalysisDiag::UninitializedUse: {
+      const unsigned int DiagID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Warning,
+          "variable '%0' is uninitialized when used here");
+      DiagEngine.Report(Diag.Loc, DiagID) << Diag.D->getNameAsString();
+      break;
+    }
+    case AnalysisDiag::CapturedDeclaration: {
+      const unsigned int DiagID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Warning,
+          "declaration of '%0' is captured within a target data region in "
+          "which it is being utilized");
+      const unsigned int NoteID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Note,
+          "declaration of '%0' was anticipated to precede the beginning of "
+          "the target data region at this location");
+      DiagEngine.Report(Diag.Loc, DiagID) << Diag.D->getNameAsString();
+      DiagEngine.Report(Diag.NoteLoc, NoteID) << Diag.D->getNameAsString();
+      break;
+    }
+    case AnalysisDiag::UndeterminedScope:
+      llvm::outs()
+          << "error: Data mapping scope could not be determined for function "
+          << Diag.D->getNameAsString() << "\n";
+      break;
+    }
+  }
+  Diagnostics.clear();
+}
+
+/* Returns the combined flags of every access to VD. A_OFFLD is only kept if
+ * the data is used exclusively on the target device, which is decided by the
+ * first access.
+ */
+uint8_t DataTracker::getAccessMode(const ValueDecl *VD) {
+  sortAccessLog();
+  int Flags = A_NOP;
+  int OffldOnly = A_OFFLD;
+  for (const AccessInfo &Entry : AccessLog) {
+    if (Entry.VD && Entry.VD->getID() == VD->getID()) {
+      Flags |= Entry.Flags;
+      OffldOnly &= Flags;
+    }
+  }
+  if (!OffldOnly)
+    Flags &= ~A_OFFLD;
+  return Flags;
+}
+
+std::vector<uint8_t> DataTracker::getParamAccessModes(bool crossFnOffloading) {
   std::vector<uint8_t> results;
   std::vector<ParmVarDecl *> Params = FD->parameters();
   if (Params.size() == 0)
@@ -1240,15 +3942,8 @@ std::vector<uint8_t> DataTracker::getParamAccessModes(bool crossFnOffloading) {
       continue;
     }
 
-    int Flags = A_NOP;
-    int OffldOnly = A_OFFLD;
-    for (AccessInfo Entry : AccessLog) {
-      if (Entry.VD && Entry.VD->getID() == Params[I]->getID()) {
-        Flags |= Entry.Flags;
-        OffldOnly &= Flags;
-      }
-    }
-    if (!crossFnOffloading || !OffldOnly) {
+    uint8_t Flags = getAccessMode(Params[I]);
+    if (!crossFnOffloading || !(Flags & A_OFFLD)) {
       // clear offloaded flag
       Flags &= ~A_OFFLD;
     } else {
@@ -1269,15 +3964,8 @@ std::vector<uint8_t> DataTracker::getGlobalAccessModes(bool crossFnOffloading) {
     return results;
 
   for (const ValueDecl *Global : Globals) {
-    int Flags = A_NOP;
-    int OffldOnly = A_OFFLD;
-    for (AccessInfo Entry : AccessLog) {
-      if (Entry.VD && Entry.VD->getID() == Global->getID()) {
-        Flags |= Entry.Flags;
-        OffldOnly &= Flags;
-      }
-    }
-    if (!crossFnOffloading || !OffldOnly) {
+    uint8_t Flags = getAccessMode(Global);
+    if (!crossFnOffloading || !(Flags & A_OFFLD)) {
       // clear offloaded flag
       Flags &= ~A_OFFLD;
     } else {
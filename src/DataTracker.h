@@ -1,23 +1,96 @@
 #ifndef DATATRACKER_H
 #define DATATRACKER_H
 
+#include <climits>
+#include <memory>
 #include <stack>
 
 #include <boost/container/flat_set.hpp>
 
+#include "clang/Analysis/CFG.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "AnalysisCache.h"
+#include "LibrarySummaries.h"
 #include "TargetDataRegion.h"
 #include "Kernel.h"
 
 using namespace clang;
 
+enum class AnalysisDiag : uint8_t {
+  UninitializedUse,
+  CapturedDeclaration,
+  UndeterminedScope
+};
+
+// A diagnostic found during analysis. Analysis may run on a worker thread, so
+// these are held until emitDiagnostics() is called from the main thread.
+struct PendingDiagnostic {
+  AnalysisDiag Kind;
+  SourceLocation Loc;
+  SourceLocation NoteLoc;
+  const NamedDecl *D;
+};
+
+// A value stored to a pointer. Count and IsAllocation describe allocations,
+// Alias a copy of another pointer. Any other value leaves both unset.
+struct PointerDefinition {
+  unsigned Offset;
+  const Expr *Value; // nullptr if the pointer was changed some other way
+  bool IsAllocation;
+  const Expr *Count; // number of elements allocated, nullptr for one
+  const ValueDecl *Alias;
+};
+
+// A write of Extent through argument ArgIndex of a call to a library function.
+// It is recorded as a read and write of VD until the extent is found to cover
+// all of VD.
+struct LibraryWrite {
+  const ValueDecl *VD;
+  SourceLocation Loc;
+  const CallExpr *CE;
+  unsigned ArgIndex;
+  LibraryExtent Extent;
+};
+
+// Number of elements of the buffer a pointer parameter points to, as passed by
+// every caller. This is either the value of Param or the literal Lit.
+struct ParamExtent {
+  const ParmVarDecl *Param;
+  int64_t Lit;
+
+  bool operator==(const ParamExtent &Other) const {
+    return Param == Other.Param && Lit == Other.Lit;
+  }
+};
+
+// A point in the control flow graph of a function, before the element at Index
+// of Block.
+struct CFGPosition {
+  const CFGBlock *Block;
+  unsigned Index;
+};
+
 class DataTracker {
 private:
   const FunctionDecl *FD;
   ASTContext *Context; 
+  unsigned BodyBeginOffset;
+  unsigned BodyEndOffset;
   Kernel *LastKernel;
+  // Target data regions of the function, each before the regions nested in
+  // it, and the one the declaration under analysis is mapped in.
+  std::vector<TargetDataRegion *> TargetScopes;
   TargetDataRegion *TargetScope;
 
+  // Entries are appended as they are recorded and put into SourceLocation
+  // order lazily. Only the first SortedAccessLogSize entries are ordered.
   std::vector<AccessInfo> AccessLog;
+  size_t SortedAccessLogSize;
+  // Position in AccessLog of the entry for each (ValueDecl, SourceLocation)
+  // pair. Rebuilt whenever sorting moves entries.
+  llvm::DenseMap<std::pair<const ValueDecl *, SourceLocation::UIntTy>, size_t>
+      AccessIndex;
   std::vector<Kernel *> Kernels;
   std::vector<const Stmt *> Loops;
   std::vector<const Stmt *> Conds;
@@ -25,6 +98,23 @@ private:
   boost::container::flat_set<const ValueDecl *> Locals;
   boost::container::flat_set<const ValueDecl *> Globals;
   boost::container::flat_set<int64_t> Disabled;
+  std::vector<PendingDiagnostic> Diagnostics;
+  // Buffers of local pointers kept on the device from allocation to release,
+  // in the order of their declarations.
+  std::vector<DeviceAllocation> DeviceAllocations;
+  // Regions wrapped around loops for the mappings of the callees called in
+  // them, by loop.
+  std::vector<std::pair<const Stmt *, TargetDataRegion *>> HoistRegions;
+  llvm::DenseMap<const ValueDecl *, std::vector<PointerDefinition>>
+      PointerDefinitions;
+  llvm::DenseMap<const ValueDecl *, ParamExtent> ParamExtents;
+  std::vector<LibraryWrite> LibraryWrites;
+  // Properties of the data of variables asserted with `#pragma ompdart`.
+  llvm::DenseMap<const ValueDecl *, uint8_t> AssertedProperties;
+  // Control flow graph of the function and the position of the element of
+  // each statement in it. Only held from buildCFG() until analyze() is done.
+  std::unique_ptr<CFG> SourceCFG;
+  llvm::DenseMap<const Stmt *, CFGPosition> CFGPositions;
 
   const ValueDecl *LastArrayBasePointer;
   const ArraySubscriptExpr *LastArraySubscript;
@@ -43,8 +133,55 @@ private:
                                               std::vector<const AccessInfo *> &LoopStack,
                                               std::vector<AccessInfo>::iterator &insertionLocLim) const;
   int insertAccessLogEntry(const AccessInfo &NewEntry);
+  uint8_t getAssertedFlags(const ValueDecl *VD, const Stmt *S,
+                           uint8_t Flags) const;
+  void sortAccessLog();
+  AccessInfo *findAccessLogEntry(const ValueDecl *VD, SourceLocation Loc);
+  void attachArraySubscript(AccessInfo &Entry,
+                            const ArraySubscriptExpr *Subscript);
+  bool parseAffineIndex(const Expr *E, int64_t Factor,
+                        ArrayAccess &Bounds) const;
+  void createTargetScopes(
+      SourceLocation ScopeBegin, SourceLocation ScopeEnd,
+      const boost::container::flat_set<const ValueDecl *> &Decls,
+      std::vector<std::vector<const ValueDecl *>> &RegionDecls);
+  void collectRegionKernels(TargetDataRegion *Region) const;
   void analyzeValueDecl(const ValueDecl *VD);
   void analyzeValueDeclArrayBounds(const ValueDecl *VD);
+  bool getAccessSection(const ValueDecl *VD, unsigned ScopeBeginOffset,
+                        unsigned ScopeEndOffset, ArraySection &Section,
+                        unsigned FromOffset = 0, unsigned ToOffset = UINT_MAX,
+                        uint8_t Modes = A_RDWR | A_UNKNOWN | A_OFFLD,
+                        bool Contiguous = true);
+  bool getUpdateSection(const ValueDecl *VD, const AccessInfo &Update,
+                        bool IsUpdateTo, unsigned ScopeBeginOffset,
+                        unsigned ScopeEndOffset, ArraySection &Section);
+  bool getAllocationSection(const ValueDecl *VD, unsigned ScopeBeginOffset,
+                            unsigned ScopeEndOffset, ArraySection &Section);
+  const Stmt *
+  findHoistLoop(const ValueDecl *VD, const CallExpr *CE,
+                const boost::container::flat_set<const Stmt *> &Calls,
+                ArraySection &Section);
+  TargetDataRegion *getHoistRegion(const Stmt *Loop);
+  static void assumePresentIn(std::vector<TargetDataRegion *> &Regions,
+                              const ValueDecl *VD);
+  const PointerDefinition *getOnlyDefinition(const ValueDecl *VD,
+                                             unsigned Before) const;
+  bool isUnchanged(const VarDecl *Var, unsigned BeginOffset,
+                   unsigned EndOffset) const;
+  std::string getInvariantBoundText(const Expr *E, unsigned BeginOffset,
+                                    unsigned EndOffset);
+  bool isSameValue(const Expr *A, const Expr *B, unsigned BeginOffset,
+                   unsigned EndOffset) const;
+  bool coversVariable(const LibraryWrite &Write) const;
+  bool locateStmt(const Stmt *S, CFGPosition &Pos) const;
+  bool getStmtEntry(const Stmt *S, CFGPosition &Pos) const;
+  bool getStmtExit(const Stmt *S, CFGPosition &Pos) const;
+  bool getLoopBodyEntry(const Stmt *S, CFGPosition &Pos) const;
+  bool getUpdatePosition(const AccessInfo &Update, bool IsUpdateTo,
+                         CFGPosition &Pos) const;
+  void pruneRedundantUpdates(const ValueDecl *VD, size_t FirstUpdateTo,
+                             size_t FirstUpdateFrom);
 
 public:
   DataTracker(FunctionDecl *FD, ASTContext *Context);
@@ -62,7 +199,7 @@ public:
                             const std::vector<uint8_t> &ParamFlags,
                             const boost::container::flat_set<const ValueDecl *> &GlobalsAccessed,
                             const std::vector<uint8_t> &GlobalFlags);
-  void printAccessLog() const;
+  void printAccessLog();
 
   int recordTargetRegion(Kernel *K);
   int recordCallExpr(const CallExpr *CE);
@@ -71,17 +208,48 @@ public:
   int recordLoop(const Stmt *S);
   int recordCond(const Stmt *S);
   int recordLocal(const ValueDecl *VD);
+  int recordPointerDefinition(const ValueDecl *VD, const Expr *Value,
+                              SourceLocation Loc);
+  void assertProperties(const ValueDecl *VD, uint8_t Properties);
+  int recordLibraryWrite(const ValueDecl *VD, SourceLocation Loc,
+                         const CallExpr *CE, unsigned ArgIndex,
+                         const LibraryExtent &Extent);
+  int confirmLibraryWrites();
+
+  bool getArgumentExtent(const CallExpr *CE, unsigned ArgIndex,
+                         ParamExtent &Extent) const;
+  bool setParamExtent(const ParmVarDecl *Param, const ParamExtent &Extent);
+  const ParamExtent *getParamExtent(const ValueDecl *Param) const;
 
   const std::vector<Kernel *> &getTargetRegions() const;
   const std::vector<const CallExpr *> &getCallExprs() const;
   const std::vector<const Stmt *> &getLoops() const;
-  const TargetDataRegion *getTargetDataScope() const;
+  const std::vector<TargetDataRegion *> &getTargetDataScopes() const;
   const boost::container::flat_set<const ValueDecl *> &getLocals() const;
   const boost::container::flat_set<const ValueDecl *> &getGlobals() const;
 
   void classifyOffloadedOps();
+  void buildCFG();
   void naiveAnalyze();
   void analyze();
+  void planAsyncUpdates();
+  void dropAssertedTransfers();
+  bool planDeviceAllocation(const ValueDecl *VD);
+  void markPresentOnEntry(
+      const boost::container::flat_set<const ValueDecl *> &Decls);
+  const std::vector<DeviceAllocation> &getDeviceAllocations() const;
+  bool isOnlyOffloaded(const ValueDecl *VD);
+  unsigned hoistCalleeMappings(
+      const ValueDecl *VD,
+      const std::vector<std::pair<const CallExpr *, uint8_t>> &Calls,
+      std::vector<const CallExpr *> &Hoisted);
+  void assumePresent(const ValueDecl *VD);
+  std::vector<TargetDataRegion *>
+  cloneTargetDataScopes(const std::vector<const ValueDecl *> &Present) const;
+  void emitDiagnostics();
+  CachedAnalysis saveAnalysis();
+  bool restoreAnalysis(const CachedAnalysis &Cached);
+  uint8_t getAccessMode(const ValueDecl *VD);
   std::vector<uint8_t> getParamAccessModes(bool crossFnOffloading);
   std::vector<uint8_t> getGlobalAccessModes(bool crossFnOffloading);
 };
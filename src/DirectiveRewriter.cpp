@@ -2,59 +2,37 @@
 
 #include "clang/AST/ParentMapContext.h"
 #include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseMap.h"
 
+#include <boost/container/flat_map.hpp>
 #include <boost/container/flat_set.hpp>
+#include <map>
+#include <optional>
+#include <tuple>
+
+#include "CommonUtils.h"
 
 using namespace clang;
 
 struct UpdateDirInfo {
   const Stmt *FullStmt;
-  boost::container::flat_set<const ValueDecl *> Decls;
+  // The list item of each variable updated at FullStmt.
+  boost::container::flat_map<const ValueDecl *, std::string> Items;
+  // Set while every update at FullStmt may run asynchronously.
+  bool Async;
 
-  UpdateDirInfo(const Stmt *FullStmt) : FullStmt(FullStmt) {}
+  UpdateDirInfo(const Stmt *FullStmt) : FullStmt(FullStmt), Async(true) {}
 };
 
 struct ClauseDirInfo {
   const OMPExecutableDirective *Directive;
   boost::container::flat_set<const ValueDecl *> FirstPrivateDecls;
+  boost::container::flat_set<const ValueDecl *> DependInDecls;
 
   ClauseDirInfo(const OMPExecutableDirective *Directive)
       : Directive(Directive) {}
 };
 
-/* Finds the outermost Stmt in ContainingStmt that captures S. Returns NULL on
- * error.
- */
-const Stmt *getSemiTerminatedStmt(ASTContext &Context, const Stmt *S) {
-  const Stmt *CurrentStmt = S;
-  while (true) {
-#if DEBUG_LEVEL >= 1
-    CurrentStmt->printPretty(llvm::outs(), NULL, PrintingPolicy(LangOptions()));
-    llvm::outs() << "end\n";
-#endif
-    const auto &ImmediateParents = Context.getParents(*CurrentStmt);
-    if (ImmediateParents.size() == 0)
-      return nullptr;
-
-    const Stmt *ParentStmt = ImmediateParents[0].get<Stmt>();
-    if (!ParentStmt) {
-      const VarDecl *VD = ImmediateParents[0].get<VarDecl>();
-      if (VD == nullptr) {
-        // we may need a more specific check here. This was added because a for
-        // loop didn't have a parent. So this works for now.
-        return CurrentStmt;
-      }
-      const auto &VDParents = Context.getParents(*VD);
-      return VDParents[0].get<Stmt>();
-    }
-
-    if (isa<CompoundStmt>(ParentStmt))
-      return CurrentStmt;
-
-    CurrentStmt = ParentStmt;
-  }
-}
-
 /* Returns the SourceLocation immediately after a Semi-Terminated Stmt (or
  * closing bracket).
  */
@@ -148,6 +126,63 @@ std::string getIndentationStep(SourceManager &SourceMgr,
   return BodyIndent.substr(ParentIndent.length());
 }
 
+/* Returns true if the directive of Data opens a block of its own rather than
+ * adding map clauses to the kernel it consists of.
+ */
+static bool opensBlock(const TargetDataRegion *Data) {
+  if (Data->getMapAlloc().empty() && Data->getMapTo().empty() &&
+      Data->getMapFrom().empty() && Data->getMapToFrom().empty())
+    return false;
+  return Data->getKernels().size() != 1 ||
+         Data->getKernels().front()->getBeginLoc() != Data->getBeginLoc();
+}
+
+/* Returns the indentation added to the line of Loc by the blocks of the
+ * regions other than Data.
+ */
+std::string
+getWrappingIndentation(SourceManager &SourceMgr, SourceLocation Loc,
+                       const TargetDataRegion *Data,
+                       const std::vector<TargetDataRegion *> &Regions,
+                       const std::string &IndentStep) {
+  std::string Indent;
+  unsigned int Line = SourceMgr.getSpellingLineNumber(Loc);
+  for (const TargetDataRegion *Region : Regions) {
+    if (Region == Data || !opensBlock(Region))
+      continue;
+    if (SourceMgr.getSpellingLineNumber(Region->getBeginLoc()) <= Line &&
+        Line <= SourceMgr.getSpellingLineNumber(Region->getEndLoc()))
+      Indent += IndentStep;
+  }
+  return Indent;
+}
+
+/* Returns the indentation of the first line of Data once the blocks of the
+ * regions it is nested in are opened.
+ */
+std::string getRegionIndentation(SourceManager &SourceMgr,
+                                 const TargetDataRegion *Data,
+                                 const std::string &IndentStep) {
+  std::string Indent = getIndentation(SourceMgr, Data->getBeginLoc());
+  for (const TargetDataRegion *Parent = Data->getParent(); Parent;
+       Parent = Parent->getParent()) {
+    if (opensBlock(Parent))
+      Indent += IndentStep;
+  }
+  return Indent;
+}
+
+/* Returns the SourceLocation immediately after the last statement of Data.
+ */
+SourceLocation getRegionClosingLoc(SourceManager &SourceMgr,
+                                   const TargetDataRegion *Data) {
+  SourceLocation ClosingLoc = Data->getEndLoc().getLocWithOffset(1);
+  // Accommodate for DoStmt not including it's semi.
+  if (SourceMgr.getCharacterData(ClosingLoc)[0] == ';')
+    ClosingLoc = ClosingLoc.getLocWithOffset(1);
+  return ClosingLoc;
+}
+
 void increaseIndentation(Rewriter &R, const TargetDataRegion *Data,
                          const std::string &IndentStep) {
   SourceManager &SM = R.getSourceMgr();
@@ -165,6 +200,37 @@ void increaseIndentation(Rewriter &R, const TargetDataRegion *Data,
   return;
 }
 
+/* Returns the list item for the elements of VD in Section.
+ */
+std::string getSectionItem(const ValueDecl *VD, const ArraySection &Section) {
+  std::string Item = VD->getNameAsString();
+  for (const SectionDim &Dim : Section.Dims)
+    Item += "[" + Dim.Lower + ":" + Dim.Length + "]";
+  return Item;
+}
+
+/* Returns the list item for VD in a clause of Data. This is an array section
+ * if the analysis bounded the elements of VD that are accessed.
+ */
+std::string getListItem(const TargetDataRegion *Data, const ValueDecl *VD) {
+  if (const ArraySection *Section = Data->getArraySection(VD))
+    return getSectionItem(VD, *Section);
+  return VD->getNameAsString();
+}
+
+/* Adds the list item of VD for an update at Update.FullStmt. Section bounds the
+ * elements transferred if it is not NULL. Updates of the same variable with
+ * different sections at one statement transfer the whole mapped item.
+ */
+void addUpdateItem(UpdateDirInfo &Update, const TargetDataRegion *Data,
+                   const ValueDecl *VD, const ArraySection *Section) {
+  std::string Item =
+      Section ? getSectionItem(VD, *Section) : getListItem(Data, VD);
+  auto Inserted = Update.Items.emplace(VD, Item);
+  if (!Inserted.second && Inserted.first->second != Item)
+    Inserted.first->second = getListItem(Data, VD);
+}
+
 void rewriteDataMap(Rewriter &R, ASTContext &Context,
                     const TargetDataRegion *Data,
                     const std::string &IndentStep) {
@@ -177,34 +243,29 @@ void rewriteDataMap(Rewriter &R, ASTContext &Context,
     MapDirective = "#pragma omp target data";
   }
 
-  if (!Data->getMapAlloc().empty()) {
-    MapDirective += " map(alloc:";
-    for (const AccessInfo &Access : Data->getMapAlloc()) {
-      MapDirective += Access.VD->getNameAsString() + ",";
-    }
-    MapDirective.back() = ')';
-  }
-  if (!Data->getMapTo().empty()) {
-    MapDirective += " map(to:";
-    for (const AccessInfo &Access : Data->getMapTo()) {
-      MapDirective += Access.VD->getNameAsString() + ",";
-    }
-    MapDirective.back() = ')';
-  }
-  if (!Data->getMapFrom().empty()) {
-    MapDirective += " map(from:";
-    for (const AccessInfo &Access : Data->getMapFrom()) {
-      MapDirective += Access.VD->getNameAsString() + ",";
+  // Data that may already be present on the device is only transferred when
+  // mapped with the always modifier. Data the callers have mapped is only
+  // looked up.
+  auto AddMap = [&](const std::string &Type,
+                    const std::vector<AccessInfo> &Accesses) {
+    std::map<std::string, std::string> Items;
+    for (const AccessInfo &Access : Accesses) {
+      std::string Modifier;
+      if (Type == "alloc" && Data->isAssumedPresent(Access.VD))
+        Modifier = "present,";
+      else if (Type != "alloc" && Data->isPresentOnEntry(Access.VD))
+        Modifier = "always,";
+      Items[Modifier] += getListItem(Data, Access.VD) + ",";
     }
-    MapDirective.back() = ')';
-  }
-  if (!Data->getMapToFrom().empty()) {
-    MapDirective += " map(tofrom:";
-    for (const AccessInfo &Access : Data->getMapToFrom()) {
-      MapDirective += Access.VD->getNameAsString() + ",";
+    for (auto &Item : Items) {
+      Item.second.back() = ')';
+      MapDirective += " map(" + Item.first + Type + ":" + Item.second;
     }
-    MapDirective.back() = ')';
-  }
+  };
+  AddMap("alloc", Data->getMapAlloc());
+  AddMap("to", Data->getMapTo());
+  AddMap("from", Data->getMapFrom());
+  AddMap("tofrom", Data->getMapToFrom());
 
   if (MapDirective[0] != '#') {
     // Append the map directives to the end of the first and only kernel
@@ -214,7 +275,7 @@ void rewriteDataMap(Rewriter &R, ASTContext &Context,
   }
 
   MapDirective += "\n";
-  std::string Indent = getIndentation(SM, Data->getBeginLoc());
+  std::string Indent = getRegionIndentation(SM, Data, IndentStep);
   MapDirective += Indent;
   MapDirective += "{\n";
   MapDirective += Indent + IndentStep;
@@ -223,18 +284,27 @@ void rewriteDataMap(Rewriter &R, ASTContext &Context,
   std::string MapDirectiveClosing = "\n";
   MapDirectiveClosing += Indent;
   MapDirectiveClosing += "}\n";
-  SourceLocation ClosingLoc = Data->getEndLoc().getLocWithOffset(1);
-  // Accommodate for DoStmt not including it's semi.
-  if (SM.getCharacterData(ClosingLoc)[0] == ';')
-    ClosingLoc = ClosingLoc.getLocWithOffset(1);
-
-  R.InsertTextAfter(ClosingLoc, MapDirectiveClosing);
+  R.InsertTextAfter(getRegionClosingLoc(SM, Data), MapDirectiveClosing);
   increaseIndentation(R, Data, IndentStep);
   return;
 }
 
+/* Returns the clauses letting the updates of Update run asynchronously, if
+ * they may.
+ */
+std::string getAsyncClauses(const UpdateDirInfo &Update) {
+  if (!Update.Async)
+    return "";
+  std::string Clauses = " nowait depend(out:";
+  for (const auto &Item : Update.Items)
+    Clauses += Item.first->getNameAsString() + ",";
+  Clauses.back() = ')';
+  return Clauses;
+}
+
 void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
                      const TargetDataRegion *Data,
+                     const std::vector<TargetDataRegion *> &Regions,
                      const std::string &IndentStep) {
   if (Data->getUpdateTo().empty())
     return;
@@ -242,7 +312,8 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
   SourceManager &SM = R.getSourceMgr();
 
   std::vector<UpdateDirInfo> UpdateToList;
-  for (const AccessInfo &Access : Data->getUpdateTo()) {
+  for (size_t I = 0; I < Data->getUpdateTo().size(); ++I) {
+    const AccessInfo &Access = Data->getUpdateTo()[I];
     const Stmt *FullStmt = getSemiTerminatedStmt(Context, Access.S);
 
     if (Access.Barrier != ScopeBarrier::LoopEnd) {
@@ -261,7 +332,8 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
       UpdateToList.emplace_back(UpdateDirInfo(FullStmt));
       It = --(UpdateToList.end());
     }
-    It->Decls.insert(Access.VD);
+    addUpdateItem(*It, Data, Access.VD, Data->getUpdateToSection(I));
+    It->Async &= Data->isUpdateToAsync(I);
   }
 
   for (const UpdateDirInfo &Update : UpdateToList) {
@@ -269,18 +341,23 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
     std::string UpdateToDirective;
     std::string ParentIndent =
         getIndentation(SM, Update.FullStmt->getBeginLoc());
+    // Lines within the blocks of other regions are indented further.
+    std::string RegionIndent =
+        IndentStep + getWrappingIndentation(SM, Update.FullStmt->getBeginLoc(),
+                                            Data, Regions, IndentStep);
     if (const CompoundStmt *Body = dyn_cast<CompoundStmt>(Update.FullStmt)) {
       // Inserting at the top of a loop body.
       InsertLoc = Body->getBeginLoc().getLocWithOffset(1);
 
       UpdateToDirective = "\n";
       std::string BodyIndent = getBodyIndentation(SM, Body);
-      UpdateToDirective += BodyIndent + IndentStep;
+      UpdateToDirective += BodyIndent + RegionIndent;
       UpdateToDirective += "#pragma omp target update to(";
-      for (const ValueDecl *VD : Update.Decls) {
-        UpdateToDirective += VD->getNameAsString() + ",";
+      for (const auto &Item : Update.Items) {
+        UpdateToDirective += Item.second + ",";
       }
       UpdateToDirective.back() = ')';
+      UpdateToDirective += getAsyncClauses(Update);
 
       // Insert a trailing newline if there is text following and on the same
       // line as the opening bracket.
@@ -291,7 +368,7 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
       while (Source != End && *Source != '\n') {
         if (!isspace(*Source)) {
           UpdateToDirective += "\n";
-          UpdateToDirective += BodyIndent + IndentStep;
+          UpdateToDirective += BodyIndent + RegionIndent;
           R.RemoveText(InsertLoc, TrailingWhitespace);
           break;
         }
@@ -312,12 +389,13 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
 #endif
 
       UpdateToDirective = "\n";
-      UpdateToDirective += ParentIndent + IndentStep;
+      UpdateToDirective += ParentIndent + RegionIndent;
       UpdateToDirective += "#pragma omp target update to(";
-      for (const ValueDecl *VD : Update.Decls) {
-        UpdateToDirective += VD->getNameAsString() + ",";
+      for (const auto &Item : Update.Items) {
+        UpdateToDirective += Item.second + ",";
       }
       UpdateToDirective.back() = ')';
+      UpdateToDirective += getAsyncClauses(Update);
       // Insert a trailing newline if there is text following and on the same
       // line as the stmt.
       const char *Source = SM.getCharacterData(InsertLoc);
@@ -328,7 +406,7 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
       while (Source != FileEnd + sizeof(char) && *Source != '\n') {
         if (!isspace(*Source)) {
           UpdateToDirective += "\n";
-          UpdateToDirective += ParentIndent + IndentStep;
+          UpdateToDirective += ParentIndent + RegionIndent;
           R.RemoveText(InsertLoc, TrailingWhitespace);
           break;
         }
@@ -345,6 +423,7 @@ void rewriteUpdateTo(Rewriter &R, ASTContext &Context,
 
 void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
                        const TargetDataRegion *Data,
+                       const std::vector<TargetDataRegion *> &Regions,
                        const std::string &IndentStep) {
   if (Data->getUpdateFrom().empty())
     return;
@@ -352,8 +431,12 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
   SourceManager &SM = R.getSourceMgr();
 
   std::vector<UpdateDirInfo> UpdateFromList;
-  for (const AccessInfo &Access : Data->getUpdateFrom()) {
+  for (size_t I = 0; I < Data->getUpdateFrom().size(); ++I) {
+    const AccessInfo &Access = Data->getUpdateFrom()[I];
     const Stmt *FullStmt = getSemiTerminatedStmt(Context, Access.S);
+    // Moved up to right after the kernel last writing the data.
+    if (Access.Barrier == ScopeBarrier::KernelEnd)
+      FullStmt = getNextStmt(Context, FullStmt);
 
     if (Access.Barrier == ScopeBarrier::LoopEnd) {
       if (const ForStmt *FS = dyn_cast<ForStmt>(FullStmt))
@@ -373,7 +456,8 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
       UpdateFromList.emplace_back(UpdateDirInfo(FullStmt));
       It = --(UpdateFromList.end());
     }
-    It->Decls.insert(Access.VD);
+    addUpdateItem(*It, Data, Access.VD, Data->getUpdateFromSection(I));
+    It->Async &= Data->isUpdateFromAsync(I);
   }
 
   for (const UpdateDirInfo &Update : UpdateFromList) {
@@ -381,6 +465,10 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
     std::string UpdateFromDirective;
     std::string ParentIndent =
         getIndentation(SM, Update.FullStmt->getBeginLoc());
+    // Lines within the blocks of other regions are indented further.
+    std::string RegionIndent =
+        IndentStep + getWrappingIndentation(SM, Update.FullStmt->getBeginLoc(),
+                                            Data, Regions, IndentStep);
     if (const CompoundStmt *Body = dyn_cast<CompoundStmt>(Update.FullStmt)) {
       // Inserting at the end of a loop body.
 
@@ -404,18 +492,19 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
         --Source;
       }
 
-      UpdateFromDirective += IndentStep;
+      UpdateFromDirective += RegionIndent;
       UpdateFromDirective += "#pragma omp target update from(";
-      for (const ValueDecl *VD : Update.Decls) {
-        UpdateFromDirective += VD->getNameAsString() + ",";
+      for (const auto &Item : Update.Items) {
+        UpdateFromDirective += Item.second + ",";
       }
       UpdateFromDirective.back() = ')';
+      UpdateFromDirective += getAsyncClauses(Update);
       UpdateFromDirective += "\n";
       if (Body)
         UpdateFromDirective += ParentIndent;
       else
         UpdateFromDirective += BodyIndent;
-      UpdateFromDirective += IndentStep;
+      UpdateFromDirective += RegionIndent;
 
       InsertLoc = Body->getEndLoc();
     } else {
@@ -433,7 +522,7 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
       while (Source != FileBegin - sizeof(char) && *Source != '\n') {
         if (!isspace(*Source)) {
           UpdateFromDirective += "\n";
-          UpdateFromDirective += ParentIndent + IndentStep;
+          UpdateFromDirective += ParentIndent + RegionIndent;
           R.RemoveText(EndLoc.getLocWithOffset(1 - LeadingWhitespace),
                        LeadingWhitespace);
           break;
@@ -443,12 +532,13 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
       }
 
       UpdateFromDirective += "#pragma omp target update from(";
-      for (const ValueDecl *VD : Update.Decls) {
-        UpdateFromDirective += VD->getNameAsString() + ",";
+      for (const auto &Item : Update.Items) {
+        UpdateFromDirective += Item.second + ",";
       }
       UpdateFromDirective.back() = ')';
+      UpdateFromDirective += getAsyncClauses(Update);
       UpdateFromDirective += "\n";
-      UpdateFromDirective += ParentIndent + IndentStep;
+      UpdateFromDirective += ParentIndent + RegionIndent;
 
       InsertLoc = Update.FullStmt->getBeginLoc();
     }
@@ -459,24 +549,41 @@ void rewriteUpdateFrom(Rewriter &R, ASTContext &Context,
   return;
 }
 
+/* Inserts a taskwait before each host statement that has to wait for
+ * asynchronous updates.
+ */
+void rewriteTaskWaits(Rewriter &R, const TargetDataRegion *Data,
+                      const std::vector<TargetDataRegion *> &Regions,
+                      const std::string &IndentStep) {
+  SourceManager &SM = R.getSourceMgr();
+  for (const Stmt *S : Data->getTaskWaits()) {
+    std::string Indent = getIndentation(SM, S->getBeginLoc()) + IndentStep +
+                         getWrappingIndentation(SM, S->getBeginLoc(), Data,
+                                                Regions, IndentStep);
+    R.InsertTextBefore(S->getBeginLoc(), "#pragma omp taskwait\n" + Indent);
+  }
+}
+
 void rewriteClauses(Rewriter &R, ASTContext &Context,
                     const TargetDataRegion *Data) {
-  if (Data->getFirstPrivate().empty())
+  if (Data->getFirstPrivate().empty() && Data->getDependIn().empty())
     return;
 
   // Consolidate new clauses so we have a list for each directive.
   std::vector<ClauseDirInfo> DirectiveList;
-  for (const ClauseInfo &Clause : Data->getFirstPrivate()) {
-    const OMPExecutableDirective *Directive = Clause.Directive;
-    auto It = std::find_if(
-        DirectiveList.begin(), DirectiveList.end(),
-        [Directive](ClauseDirInfo &C) { return C.Directive == Directive; });
+  auto GetDirective = [&DirectiveList](const OMPExecutableDirective *D) {
+    auto It = std::find_if(DirectiveList.begin(), DirectiveList.end(),
+                           [D](ClauseDirInfo &C) { return C.Directive == D; });
     if (It == DirectiveList.end()) {
-      DirectiveList.emplace_back(ClauseDirInfo(Directive));
+      DirectiveList.emplace_back(ClauseDirInfo(D));
       It = --(DirectiveList.end());
     }
-    It->FirstPrivateDecls.insert(Clause.VD);
-  }
+    return It;
+  };
+  for (const ClauseInfo &Clause : Data->getFirstPrivate())
+    GetDirective(Clause.Directive)->FirstPrivateDecls.insert(Clause.VD);
+  for (const ClauseInfo &Clause : Data->getDependIn())
+    GetDirective(Clause.Directive)->DependInDecls.insert(Clause.VD);
 
   for (ClauseDirInfo &Directive : DirectiveList) {
     std::string Clauses;
@@ -487,6 +594,14 @@ void rewriteClauses(Rewriter &R, ASTContext &Context,
       }
       Clauses.back() = ')';
     }
+    if (!Directive.DependInDecls.empty()) {
+      // Waits for the asynchronous updates of the data.
+      Clauses += " depend(in:";
+      for (const ValueDecl *VD : Directive.DependInDecls) {
+        Clauses += VD->getNameAsString() + ",";
+      }
+      Clauses.back() = ')';
+    }
     R.InsertTextBefore(Directive.Directive->getEndLoc(), Clauses);
   }
 
@@ -494,7 +609,8 @@ void rewriteClauses(Rewriter &R, ASTContext &Context,
 }
 
 void rewriteTargetDataRegion(Rewriter &R, ASTContext &Context,
-                             const TargetDataRegion *Data) {
+                             const TargetDataRegion *Data,
+                             const std::vector<TargetDataRegion *> &Regions) {
   rewriteClauses(R, Context, Data);
 
   if (Data->getMapAlloc().empty() && Data->getMapTo().empty() &&
@@ -507,8 +623,333 @@ void rewriteTargetDataRegion(Rewriter &R, ASTContext &Context,
 
   rewriteDataMap(R, Context, Data, IndentStep);
 
-  rewriteUpdateTo(R, Context, Data, IndentStep);
-  rewriteUpdateFrom(R, Context, Data, IndentStep);
+  rewriteUpdateTo(R, Context, Data, Regions, IndentStep);
+  // Updates before the same statement go before its taskwait.
+  rewriteTaskWaits(R, Data, Regions, IndentStep);
+  rewriteUpdateFrom(R, Context, Data, Regions, IndentStep);
 
   return;
 }
+
+void rewriteTargetDataRegions(Rewriter &R, ASTContext &Context,
+                              const std::vector<TargetDataRegion *> &Regions) {
+  // Text inserted at a location goes before the text inserted there earlier,
+  // so regions nested in others are rewritten first to end up inside them.
+  for (auto It = Regions.rbegin(); It != Regions.rend(); ++It)
+    rewriteTargetDataRegion(R, Context, *It, Regions);
+}
+
+// A device buffer shared by the map(alloc:) data of sibling regions.
+struct DeviceBuffer {
+  std::vector<std::pair<const TargetDataRegion *, const ValueDecl *>> Members;
+  std::vector<std::string> MemberSizes;
+  std::string Size;
+};
+
+/* Returns the size in bytes of the data of VD mapped by Data as an expression,
+ * also stored in Constant if it is known at compile time. Returns an empty
+ * string if the mapped data does not start at the beginning of VD or its size
+ * is unknown.
+ */
+static std::string getMappedSize(ASTContext &Context,
+                                 const TargetDataRegion *Data,
+                                 const ValueDecl *VD,
+                                 std::optional<uint64_t> &Constant) {
+  QualType Type = VD->getType();
+  const ArraySection *Section = Data->getArraySection(VD);
+  if (!Section) {
+    if (!Context.getAsConstantArrayType(Type))
+      return "";
+    Constant = Context.getTypeSizeInChars(Type).getQuantity();
+    return "sizeof(" + VD->getNameAsString() + ")";
+  }
+
+  std::string Size;
+  uint64_t Elements = 1;
+  bool IsConstant = true;
+  for (const SectionDim &Dim : Section->Dims) {
+    if (Dim.Lower != "0")
+      return "";
+    if (const PointerType *Pointer = Type->getAs<PointerType>())
+      Type = Pointer->getPointeeType();
+    else if (const ArrayType *Array = Context.getAsArrayType(Type))
+      Type = Array->getElementType();
+    else
+      return "";
+    uint64_t Length;
+    if (llvm::StringRef(Dim.Length).getAsInteger(10, Length))
+      IsConstant = false;
+    else
+      Elements *= Length;
+    Size += "(" + Dim.Length + ") * ";
+  }
+  if (Type->isIncompleteType() || Type->isDependentType())
+    return "";
+  uint64_t ElementSize = Context.getTypeSizeInChars(Type).getQuantity();
+  if (IsConstant)
+    Constant = Elements * ElementSize;
+  return Size + "sizeof(" + Type.getAsString(Context.getPrintingPolicy()) +
+         ")";
+}
+
+/* Returns true if VD is only allocated on the device by a single one of
+ * Regions, so its device data never needs to outlive that region.
+ */
+static bool isDeviceScratch(const ValueDecl *VD,
+                            const std::vector<TargetDataRegion *> &Regions) {
+  const VarDecl *Var = dyn_cast<VarDecl>(VD);
+  if (!Var || !Var->isLocalVarDecl())
+    return false;
+  auto Names = [VD](const std::vector<AccessInfo> &Accesses) {
+    return std::any_of(
+        Accesses.begin(), Accesses.end(),
+        [VD](const AccessInfo &Access) { return Access.VD == VD; });
+  };
+  unsigned Allocations = 0;
+  for (const TargetDataRegion *Data : Regions) {
+    // The buffer already has device memory from its allocation.
+    if (Data->isPresentOnEntry(VD))
+      return false;
+    if (Names(Data->getMapTo()) || Names(Data->getMapFrom()) ||
+        Names(Data->getMapToFrom()) || Names(Data->getUpdateTo()) ||
+        Names(Data->getUpdateFrom()))
+      return false;
+    if (Names(Data->getMapAlloc()))
+      ++Allocations;
+  }
+  return Allocations == 1;
+}
+
+/* Returns the block Data begins a statement of, or nullptr if it begins none,
+ * such as a loop that is the body of an if without braces.
+ */
+static const CompoundStmt *getEnclosingBlock(const TargetDataRegion *Data) {
+  std::vector<const Stmt *> Worklist{Data->getContainingFunction()->getBody()};
+  while (!Worklist.empty()) {
+    const Stmt *S = Worklist.back();
+    Worklist.pop_back();
+    for (const Stmt *Child : S->children()) {
+      if (!Child)
+        continue;
+      if (isa<CompoundStmt>(S) && Child->getBeginLoc() == Data->getBeginLoc())
+        return cast<CompoundStmt>(S);
+      Worklist.push_back(Child);
+    }
+  }
+  return nullptr;
+}
+
+/* Groups the device scratch data of sibling regions of the same size, or
+ * smaller if the sizes are known at compile time, into shared buffers. Sibling
+ * regions are in the same block, where the buffer is declared, and are never
+ * active at the same time.
+ */
+static std::vector<DeviceBuffer>
+planDeviceBuffers(ASTContext &Context,
+                  const std::vector<TargetDataRegion *> &Regions) {
+  // Scratch data by the index of the enclosing region, the offset of the
+  // enclosing block and size, each list in region order. Constant sizes share
+  // the empty key.
+  std::map<std::tuple<int, unsigned, std::string>,
+           std::vector<std::pair<const TargetDataRegion *, const ValueDecl *>>>
+      Candidates;
+  llvm::DenseMap<std::pair<const TargetDataRegion *, const ValueDecl *>,
+                 std::pair<std::string, std::optional<uint64_t>>>
+      Sizes;
+  for (const TargetDataRegion *Data : Regions) {
+    // Hoisted regions wrap loops at any depth, the buffer has to be declared
+    // in a block around them.
+    const CompoundStmt *Block = getEnclosingBlock(Data);
+    if (!Block)
+      continue;
+    unsigned BlockOffset =
+        getMainFileOffset(Context.getSourceManager(), Block->getBeginLoc());
+    for (const AccessInfo &Access : Data->getMapAlloc()) {
+      if (!isDeviceScratch(Access.VD, Regions))
+        continue;
+      std::optional<uint64_t> Constant;
+      std::string Size = getMappedSize(Context, Data, Access.VD, Constant);
+      if (Size.empty())
+        continue;
+      int Parent = -1;
+      if (Data->getParent())
+        Parent = std::find(Regions.begin(), Regions.end(), Data->getParent()) -
+                 Regions.begin();
+      Candidates[{Parent, BlockOffset, Constant ? "" : Size}].emplace_back(
+          Data, Access.VD);
+      Sizes[{Data, Access.VD}] = {Size, Constant};
+    }
+  }
+
+  std::vector<DeviceBuffer> Buffers;
+  for (const auto &Candidate : Candidates) {
+    // The n-th scratch data of each region shares the n-th buffer.
+    std::vector<DeviceBuffer> Group;
+    llvm::DenseMap<const TargetDataRegion *, unsigned> Used;
+    std::vector<uint64_t> Largest;
+    for (const auto &Member : Candidate.second) {
+      unsigned Index = Used[Member.first]++;
+      if (Index == Group.size()) {
+        Group.emplace_back();
+        Largest.push_back(0);
+      }
+      const auto &Size = Sizes[Member];
+      Group[Index].Members.push_back(Member);
+      Group[Index].MemberSizes.push_back(Size.first);
+      Group[Index].Size = Size.first;
+      if (Size.second)
+        Largest[Index] = std::max(Largest[Index], *Size.second);
+    }
+    for (size_t I = 0; I < Group.size(); ++I) {
+      if (Group[I].Members.size() < 2)
+        continue;
+      if (std::get<2>(Candidate.first).empty())
+        Group[I].Size = std::to_string(Largest[I]);
+      Buffers.push_back(std::move(Group[I]));
+    }
+  }
+  return Buffers;
+}
+
+unsigned rewriteDeviceBuffers(Rewriter &R, ASTContext &Context,
+                              const std::vector<TargetDataRegion *> &Regions) {
+  std::vector<DeviceBuffer> Buffers = planDeviceBuffers(Context, Regions);
+  if (Buffers.empty())
+    return 0;
+
+  SourceManager &SM = R.getSourceMgr();
+  std::string IndentStep =
+      getIndentationStep(SM, Regions.front()->getContainingFunction());
+  const std::string Device = "omp_get_default_device()";
+  for (size_t I = 0; I < Buffers.size(); ++I) {
+    const DeviceBuffer &Buffer = Buffers[I];
+    std::string Name = "ompdart_buffer" + std::to_string(I);
+
+    // The host data of each member is associated with the buffer around its
+    // region, so mapping it in the region allocates nothing.
+    for (size_t J = 0; J < Buffer.Members.size(); ++J) {
+      const TargetDataRegion *Data = Buffer.Members[J].first;
+      std::string HostPtr = Buffer.Members[J].second->getNameAsString();
+      std::string Indent = getRegionIndentation(SM, Data, IndentStep);
+      R.InsertTextBefore(Data->getBeginLoc(),
+                         "omp_target_associate_ptr(" + HostPtr + ", " + Name +
+                             ", " + Buffer.MemberSizes[J] + ", 0, " + Device +
+                             ");\n" + Indent);
+      std::string Disassociate =
+          "omp_target_disassociate_ptr(" + HostPtr + ", " + Device + ");";
+      if (opensBlock(Data))
+        Disassociate = Indent + Disassociate + "\n";
+      else
+        Disassociate = "\n" + Indent + Disassociate;
+      R.InsertTextAfter(getRegionClosingLoc(SM, Data), Disassociate);
+    }
+
+    // Members are siblings in one block, so the first and last one are in the
+    // same scope.
+    const TargetDataRegion *First = Buffer.Members.front().first;
+    const TargetDataRegion *Last = Buffer.Members.back().first;
+    std::string Indent = getRegionIndentation(SM, First, IndentStep);
+    R.InsertTextBefore(First->getBeginLoc(),
+                       "void *" + Name + " = omp_target_alloc(" + Buffer.Size +
+                           ", " + Device + ");\n" + Indent);
+    std::string Free = "omp_target_free(" + Name + ", " + Device + ");";
+    if (opensBlock(Last))
+      Free = Indent + Free + "\n";
+    else
+      Free = "\n" + Indent + Free;
+    R.InsertTextAfter(getRegionClosingLoc(SM, Last), Free);
+  }
+  return Buffers.size();
+}
+
+/* Returns the directive entering or exiting the buffers of Allocations that
+ * are allocated, or released, by S.
+ */
+static std::string
+getEnterExitDirective(const std::vector<DeviceAllocation> &Allocations,
+                      const Stmt *S, bool Enter) {
+  std::string Directive = Enter ? "#pragma omp target enter data map(alloc:"
+                                : "#pragma omp target exit data map(delete:";
+  for (const DeviceAllocation &Allocation : Allocations) {
+    if ((Enter ? Allocation.Alloc : Allocation.Release) == S)
+      Directive += getSectionItem(Allocation.VD, Allocation.Section) + ",";
+  }
+  Directive.back() = ')';
+  return Directive;
+}
+
+void rewriteDeviceAllocations(Rewriter &R,
+                              const std::vector<DeviceAllocation> &Allocations,
+                              const std::vector<TargetDataRegion *> &Regions) {
+  if (Allocations.empty())
+    return;
+
+  SourceManager &SM = R.getSourceMgr();
+  const FunctionDecl *FD =
+      cast<FunctionDecl>(Allocations.front().VD->getDeclContext());
+  std::string IndentStep = getIndentationStep(SM, FD);
+  std::vector<const Stmt *> Done;
+  for (const DeviceAllocation &Allocation : Allocations) {
+    for (bool Enter : {true, false}) {
+      const Stmt *S = Enter ? Allocation.Alloc : Allocation.Release;
+      if (std::find(Done.begin(), Done.end(), S) != Done.end())
+        continue;
+      Done.push_back(S);
+
+      std::string Directive = getEnterExitDirective(Allocations, S, Enter);
+      // Lines within the blocks of the regions are indented further.
+      std::string Indent =
+          getIndentation(SM, S->getBeginLoc()) +
+          getWrappingIndentation(SM, S->getBeginLoc(), nullptr, Regions,
+                                 IndentStep);
+      if (!Enter) {
+        R.InsertTextBefore(S->getBeginLoc(), Directive + "\n" + Indent);
+        continue;
+      }
+
+      // Inserting after the allocation, and before any text following it on
+      // the same line.
+      SourceLocation InsertLoc = getSemiTerminatedStmtEndLoc(SM, S);
+      Directive = "\n" + Indent + Directive;
+      const char *Source = SM.getCharacterData(InsertLoc);
+      unsigned int TrailingWhitespace = 0;
+      while (*Source != '\0' && *Source != '\n') {
+        if (!isspace(*Source)) {
+          Directive += "\n" + Indent;
+          R.RemoveText(InsertLoc, TrailingWhitespace);
+          break;
+        }
+        ++TrailingWhitespace;
+        ++Source;
+      }
+      R.InsertTextBefore(InsertLoc, Directive);
+    }
+  }
+}
+
+void rewriteFunctionClone(Rewriter &R, Rewriter &CloneRewriter,
+                          const FunctionDecl *FD, const std::string &Name,
+                          const std::vector<const CallExpr *> &Calls,
+                          SourceLocation DeclLoc) {
+  std::string OriginalName = FD->getNameAsString();
+  CloneRewriter.ReplaceText(FD->getLocation(), OriginalName.size(), Name);
+  std::string Clone = CloneRewriter.getRewrittenText(FD->getSourceRange());
+  R.InsertTextAfter(FD->getEndLoc().getLocWithOffset(1), "\n\n" + Clone);
+
+  if (DeclLoc.isValid()) {
+    // The text of the definition up to the opening bracket of the body.
+    std::string Declaration = CloneRewriter.getRewrittenText(
+        SourceRange(FD->getBeginLoc(), FD->getBody()->getBeginLoc()));
+    Declaration.pop_back();
+    while (!Declaration.empty() && isspace(Declaration.back()))
+      Declaration.pop_back();
+    R.InsertTextBefore(DeclLoc, Declaration + ";\n\n");
+  }
+
+  for (const CallExpr *CE : Calls) {
+    const DeclRefExpr *Callee =
+        dyn_cast<DeclRefExpr>(CE->getCallee()->IgnoreParenImpCasts());
+    if (Callee && !Callee->getLocation().isMacroID())
+      R.ReplaceText(Callee->getLocation(), OriginalName.size(), Name);
+  }
+}
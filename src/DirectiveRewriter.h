@@ -1,12 +1,34 @@
 #ifndef DIRECTIVEREWRITER_H
 #define DIRECTIVEREWRITER_H
 
+#include <string>
+#include <vector>
+
 #include "clang/Rewrite/Core/Rewriter.h"
 
 #include "TargetDataRegion.h"
 
 using namespace clang;
 
-void rewriteTargetDataRegion(Rewriter &R, ASTContext &Context, const TargetDataRegion *Data);
+// Regions must precede the regions nested in them.
+void rewriteTargetDataRegions(Rewriter &R, ASTContext &Context,
+                              const std::vector<TargetDataRegion *> &Regions);
+// Lets the device scratch data of regions that are never active at the same
+// time share buffers. Must be called after rewriteTargetDataRegions. Returns
+// the number of buffers created.
+unsigned rewriteDeviceBuffers(Rewriter &R, ASTContext &Context,
+                              const std::vector<TargetDataRegion *> &Regions);
+// Keeps the buffers of Allocations on the device from their allocation until
+// they are freed. Regions are the target data regions of the same function.
+void rewriteDeviceAllocations(Rewriter &R,
+                              const std::vector<DeviceAllocation> &Allocations,
+                              const std::vector<TargetDataRegion *> &Regions);
+// Adds the copy of FD rewritten by CloneRewriter after FD, under the name
+// Name, and makes Calls call it. A declaration of the copy goes before DeclLoc
+// if it is valid.
+void rewriteFunctionClone(Rewriter &R, Rewriter &CloneRewriter,
+                          const FunctionDecl *FD, const std::string &Name,
+                          const std::vector<const CallExpr *> &Calls,
+                          SourceLocation DeclLoc);
 
 #endif
\ No newline at end of file
@@ -2,43 +2,53 @@
 
 #include "clang/Basic/SourceManager.h"
 
+#include "CommonUtils.h"
+
 using namespace clang;
 
 Kernel::Kernel(const OMPExecutableDirective *TD, const FunctionDecl *FD,
                ASTContext *Context)
-    : Context(Context), TD(TD), FD(FD) {}
+    : Context(Context), TD(TD), FD(FD) {
+  SourceManager &SM = Context->getSourceManager();
+  EndLoc = TD->getInnermostCapturedStmt()->getEndLoc();
+  BeginOffset = getMainFileOffset(SM, getBeginLoc());
+  EndOffset = getMainFileEndOffset(SM, EndLoc);
+  DirectiveBeginOffset = getMainFileOffset(SM, TD->getBeginLoc());
+  DirectiveEndOffset = getMainFileEndOffset(SM, TD->getEndLoc());
+}
 
 const OMPExecutableDirective *Kernel::getDirective() const { return TD; }
 
 const FunctionDecl *Kernel::getFunction() const { return FD; }
 
 bool Kernel::contains(SourceLocation Loc) const {
-  SourceManager &SM = Context->getSourceManager();
-  SourceLocation CSBeginLoc = this->getBeginLoc();
-  SourceLocation CSEndLoc = this->getEndLoc();
-  return !SM.isBeforeInTranslationUnit(Loc, CSBeginLoc) &&
-         SM.isBeforeInTranslationUnit(Loc, CSEndLoc);
+  return contains(getMainFileOffset(Context->getSourceManager(), Loc));
+}
+
+bool Kernel::contains(unsigned Offset) const {
+  return BeginOffset <= Offset && Offset < EndOffset;
+}
+
+bool Kernel::directiveContains(unsigned Offset) const {
+  return DirectiveBeginOffset <= Offset && Offset < DirectiveEndOffset;
+}
+
+bool Kernel::lastNestedDirectiveContains(unsigned Offset) const {
+  if (NestedDirectiveOffsets.empty())
+    return false;
+  const std::pair<unsigned, unsigned> &Range = NestedDirectiveOffsets.back();
+  return Range.first <= Offset && Offset < Range.second;
 }
 
 SourceLocation Kernel::getBeginLoc() const {
   return TD->getInnermostCapturedStmt()->getBeginLoc();
 }
 
-SourceLocation Kernel::getEndLoc() const {
-  SourceManager &SM = Context->getSourceManager();
-  SourceLocation EndLoc = TD->getInnermostCapturedStmt()->getEndLoc();
-  for (const OMPExecutableDirective *Captured : NestedDirectives) {
-    if (isa<OMPAtomicDirective>(Captured))
-      continue;
-    if (!Captured->hasAssociatedStmt()) // this include OMPBarrierDirective
-      continue;
-    SourceLocation CapturedEndLoc =
-        Captured->getInnermostCapturedStmt()->getEndLoc();
-    if (SM.isBeforeInTranslationUnit(EndLoc, CapturedEndLoc))
-      EndLoc = CapturedEndLoc;
-  }
-  return EndLoc;
-}
+SourceLocation Kernel::getEndLoc() const { return EndLoc; }
+
+unsigned Kernel::getBeginOffset() const { return BeginOffset; }
+
+unsigned Kernel::getEndOffset() const { return EndOffset; }
 
 int Kernel::recordPrivate(const ValueDecl *VD) {
   PrivateDecls.insert(VD);
@@ -55,7 +65,24 @@ bool Kernel::isPrivate(const ValueDecl *VD) const {
 }
 
 int Kernel::recordNestedDirective(const OMPExecutableDirective *TD) {
+  SourceManager &SM = Context->getSourceManager();
   NestedDirectives.push_back(TD);
+  NestedDirectiveOffsets.emplace_back(
+      getMainFileOffset(SM, TD->getBeginLoc()),
+      getMainFileEndOffset(SM, TD->getEndLoc()));
+
+  // Extend the kernel to cover a nested directive whose captured statement
+  // reaches past it.
+  if (isa<OMPAtomicDirective>(TD))
+    return 1;
+  if (!TD->hasAssociatedStmt()) // this include OMPBarrierDirective
+    return 1;
+  SourceLocation CapturedEndLoc = TD->getInnermostCapturedStmt()->getEndLoc();
+  unsigned CapturedEndOffset = getMainFileEndOffset(SM, CapturedEndLoc);
+  if (EndOffset < CapturedEndOffset) {
+    EndLoc = CapturedEndLoc;
+    EndOffset = CapturedEndOffset;
+  }
   return 1;
 }
 
@@ -15,6 +15,14 @@ private:
   const OMPExecutableDirective *TD;
   const FunctionDecl *FD;
 
+  // Main file offsets of the captured statement (extended by any nested
+  // directive reaching past it) and of the directive itself.
+  SourceLocation EndLoc;
+  unsigned BeginOffset;
+  unsigned EndOffset;
+  unsigned DirectiveBeginOffset;
+  unsigned DirectiveEndOffset;
+
   boost::container::flat_set<const ValueDecl *> PrivateDecls;
   boost::container::flat_set<const ValueDecl *> MapTo;
   boost::container::flat_set<const ValueDecl *> MapFrom;
@@ -23,10 +31,14 @@ private:
   boost::container::flat_set<const ValueDecl *> ReadDecls;
   boost::container::flat_set<const ValueDecl *> WriteDecls;
 
+  // Range of the owning DataTracker's access log covered by this kernel. Set
+  // by DataTracker::classifyOffloadedOps() and valid until the log is next
+  // recorded into.
   std::vector<AccessInfo>::iterator AccessLogBegin;
   std::vector<AccessInfo>::iterator AccessLogEnd;
 
   std::vector<const OMPExecutableDirective *> NestedDirectives;
+  std::vector<std::pair<unsigned, unsigned>> NestedDirectiveOffsets;
 
   friend class DataTracker; // will update this class directly
 
@@ -38,8 +50,13 @@ public:
   const FunctionDecl *getFunction() const;
 
   bool contains(SourceLocation Loc) const;
+  bool contains(unsigned Offset) const;
+  bool directiveContains(unsigned Offset) const;
+  bool lastNestedDirectiveContains(unsigned Offset) const;
   SourceLocation getBeginLoc() const;
   SourceLocation getEndLoc() const;
+  unsigned getBeginOffset() const;
+  unsigned getEndOffset() const;
 
   int recordPrivate(const ValueDecl *VD);
   const boost::container::flat_set<const ValueDecl *> &getPrivateDecls() const;
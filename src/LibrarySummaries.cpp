@@ -0,0 +1,145 @@
+#include "LibrarySummaries.h"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/YAMLTraits.h"
+
+namespace {
+enum class SummaryMode : uint8_t {
+  None = A_NOP,
+  Read = A_RDONLY,
+  Write = A_WRONLY,
+  ReadWrite = A_RDWR,
+  Unknown = A_UNKNOWN
+};
+
+// Exactly one of Bytes, Elements and Range is set.
+struct SummaryExtent {
+  unsigned Param = 0;
+  std::vector<unsigned> Bytes;
+  std::vector<unsigned> Elements;
+  std::vector<unsigned> Range;
+};
+
+struct SummaryEntry {
+  std::string Name;
+  std::vector<SummaryMode> Params;
+  SummaryMode Variadic = SummaryMode::Unknown;
+  std::vector<SummaryExtent> Extents;
+};
+} // namespace
+
+LLVM_YAML_IS_FLOW_SEQUENCE_VECTOR(SummaryMode)
+LLVM_YAML_IS_SEQUENCE_VECTOR(SummaryExtent)
+LLVM_YAML_IS_SEQUENCE_VECTOR(SummaryEntry)
+
+namespace llvm {
+namespace yaml {
+template <> struct ScalarEnumerationTraits<SummaryMode> {
+  static void enumeration(IO &Io, SummaryMode &Mode) {
+    Io.enumCase(Mode, "none", SummaryMode::None);
+    Io.enumCase(Mode, "read", SummaryMode::Read);
+    Io.enumCase(Mode, "write", SummaryMode::Write);
+    Io.enumCase(Mode, "readwrite", SummaryMode::ReadWrite);
+    Io.enumCase(Mode, "unknown", SummaryMode::Unknown);
+  }
+};
+
+template <> struct MappingTraits<SummaryExtent> {
+  static void mapping(IO &Io, SummaryExtent &Extent) {
+    Io.mapRequired("param", Extent.Param);
+    Io.mapOptional("bytes", Extent.Bytes);
+    Io.mapOptional("elements", Extent.Elements);
+    Io.mapOptional("range", Extent.Range);
+  }
+
+  static std::string validate(IO &Io, SummaryExtent &Extent) {
+    unsigned Kinds = !Extent.Bytes.empty() + !Extent.Elements.empty() +
+                     !Extent.Range.empty();
+    if (Kinds != 1)
+      return "an extent needs exactly one of bytes, elements and range";
+    if (!Extent.Range.empty() && Extent.Range.size() != 2)
+      return "a range extent needs a beginning and an end";
+    return "";
+  }
+};
+
+template <> struct MappingTraits<SummaryEntry> {
+  static void mapping(IO &Io, SummaryEntry &Entry) {
+    Io.mapRequired("name", Entry.Name);
+    Io.mapOptional("params", Entry.Params);
+    Io.mapOptional("variadic", Entry.Variadic, SummaryMode::Unknown);
+    Io.mapOptional("extents", Entry.Extents);
+  }
+};
+} // namespace yaml
+} // namespace llvm
+
+LibrarySummaries::LibrarySummaries() {
+  constexpr uint8_t N = A_NOP;
+  constexpr uint8_t R = A_RDONLY;
+  constexpr uint8_t W = A_WRONLY;
+  constexpr uint8_t RW = A_RDWR;
+  constexpr uint8_t U = A_UNKNOWN;
+  constexpr auto Bytes = LibraryExtent::Bytes;
+  constexpr auto Elements = LibraryExtent::Elements;
+  constexpr auto Range = LibraryExtent::Range;
+
+  // Sizes and counts are passed by value, so they are plain reads. Streams are
+  // only used on the host.
+  Summaries["memcpy"] = {{W, R, R}, U, {{0, {Bytes, {2}}}}};
+  Summaries["memmove"] = {{W, R, R}, U, {{0, {Bytes, {2}}}}};
+  Summaries["memset"] = {{W, R, R}, U, {{0, {Bytes, {2}}}}};
+  Summaries["fread"] = {{W, R, R, RW}, U, {{0, {Bytes, {1, 2}}}}};
+  Summaries["fwrite"] = {{R, R, R, RW}};
+  Summaries["printf"] = {{R}, R};
+  Summaries["fprintf"] = {{RW, R}, R};
+  Summaries["puts"] = {{R}};
+  Summaries["qsort"] = {{RW, R, R, N}};
+  // Iterators are passed by value. The end of a range is only compared
+  // against, the data behind it is never accessed.
+  Summaries["std::fill"] = {{W, N, R}, U, {{0, {Range, {0, 1}}}}};
+  Summaries["std::fill_n"] = {{W, R, R}, U, {{0, {Elements, {1}}}}};
+  Summaries["std::copy"] = {{R, N, W}, U, {{2, {Range, {0, 1}}}}};
+  Summaries["std::copy_n"] = {{R, R, W}, U, {{2, {Elements, {1}}}}};
+}
+
+bool LibrarySummaries::loadYAML(llvm::StringRef Path, std::string &Error) {
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    Error = Buffer.getError().message();
+    return false;
+  }
+
+  std::vector<SummaryEntry> Entries;
+  llvm::yaml::Input YamlIn((*Buffer)->getBuffer());
+  YamlIn >> Entries;
+  if (YamlIn.error()) {
+    Error = YamlIn.error().message();
+    return false;
+  }
+
+  for (const SummaryEntry &Entry : Entries) {
+    LibrarySummary Summary;
+    for (SummaryMode Mode : Entry.Params)
+      Summary.ParamModes.push_back(static_cast<uint8_t>(Mode));
+    Summary.VariadicMode = static_cast<uint8_t>(Entry.Variadic);
+    for (const SummaryExtent &Extent : Entry.Extents) {
+      if (!Extent.Bytes.empty())
+        Summary.Extents[Extent.Param] = {LibraryExtent::Bytes, Extent.Bytes};
+      else if (!Extent.Elements.empty())
+        Summary.Extents[Extent.Param] = {LibraryExtent::Elements,
+                                         Extent.Elements};
+      else
+        Summary.Extents[Extent.Param] = {LibraryExtent::Range, Extent.Range};
+    }
+    Summaries[Entry.Name] = std::move(Summary);
+  }
+  return true;
+}
+
+const LibrarySummary *LibrarySummaries::lookup(const FunctionDecl *FD) const {
+  auto It = Summaries.find(FD->getQualifiedNameAsString());
+  if (It == Summaries.end())
+    return nullptr;
+  return &It->second;
+}
@@ -0,0 +1,76 @@
+#ifndef LIBRARYSUMMARIES_H
+#define LIBRARYSUMMARIES_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "clang/AST/Decl.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "AccessInfo.h"
+
+using namespace clang;
+
+// How much of the data behind a parameter a call writes. A Bytes or Elements
+// extent is the product of the arguments at Args, a Range extent the distance
+// from the pointer at Args[0] to the one at Args[1].
+struct LibraryExtent {
+  enum ExtentKind : uint8_t { Bytes, Elements, Range };
+  ExtentKind Kind;
+  std::vector<unsigned> Args;
+};
+
+// How a function without a definition in the analyzed file accesses the data
+// behind its arguments.
+struct LibrarySummary {
+  std::vector<uint8_t> ParamModes;
+  // Mode of the arguments following the listed parameters, such as those
+  // passed through an ellipsis.
+  uint8_t VariadicMode = A_UNKNOWN;
+  // Extents of the writes through parameters, by parameter index. A write only
+  // replaces a variable when its extent is known to cover all of it.
+  std::map<unsigned, LibraryExtent> Extents;
+
+  uint8_t getMode(unsigned Index) const {
+    return Index < ParamModes.size() ? ParamModes[Index] : VariadicMode;
+  }
+  const LibraryExtent *getExtent(unsigned Index) const {
+    auto It = Extents.find(Index);
+    return It != Extents.end() ? &It->second : nullptr;
+  }
+};
+
+/* Summaries of library functions, keyed by qualified name. Common functions of
+ * the C and C++ standard libraries are built in. More are loaded from YAML
+ * files of the form
+ *
+ *   - name: memcpy
+ *     params: [write, read, read]
+ *     extents:
+ *       - param: 0
+ *         bytes: [2]
+ *   - name: printf
+ *     params: [read]
+ *     variadic: read
+ *
+ * where a mode is one of none, read, write, readwrite or unknown. An extent
+ * gives the arguments whose product is the number of bytes or elements
+ * written, or with range the arguments at the beginning and end of the
+ * written range.
+ */
+class LibrarySummaries {
+private:
+  llvm::StringMap<LibrarySummary> Summaries;
+
+public:
+  LibrarySummaries();
+
+  // Entries of the file replace earlier ones of the same name. Returns false
+  // and sets Error if Path is not a valid summary file.
+  bool loadYAML(llvm::StringRef Path, std::string &Error);
+  const LibrarySummary *lookup(const FunctionDecl *FD) const;
+};
+
+#endif
@@ -2,16 +2,16 @@
 #include "clang/Frontend/FrontendPluginRegistry.h"
 
 #include "OmpDartASTConsumer.h"
+#include "Statistics.h"
 
 class OmpDartASTAction : public PluginASTAction {
 private:
-  std::string OutFilePath;
-  bool Aggressive = false;
+  OmpDartOptions Options;
 
 protected:
   std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
                                                  llvm::StringRef) override {
-    return std::make_unique<OmpDartASTConsumer>(&CI, &OutFilePath, Aggressive);
+    return std::make_unique<OmpDartASTConsumer>(&CI, Options);
   }
 
   bool ParseArgs(const CompilerInstance &CI,
@@ -30,14 +30,99 @@ protected:
         }
         ++i;
         // record output preference
-        OutFilePath = args[i];
+        Options.OutFilePath = args[i];
+      }
+      if (args[i] == "--output-dir") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        ++i;
+        Options.OutputDir = args[i];
       }
       if (args[i] == "-h" || args[i] == "--help") {
         PrintHelp(llvm::errs());
         return false;
       }
       if (args[i] == "-a" || args[i] == "--aggressive-cross-function") {
-        Aggressive = true;
+        Options.Aggressive = true;
+      }
+      if (args[i] == "--reuse-device-buffers") {
+        Options.ReuseDeviceBuffers = true;
+      }
+      if (args[i] == "--async") {
+        Options.Async = true;
+      }
+      if (args[i] == "--enter-exit-data") {
+        Options.EnterExitData = true;
+      }
+      if (args[i] == "--hoist-callee-regions") {
+        Options.HoistCalleeRegions = true;
+      }
+      if (args[i] == "--clone-functions") {
+        Options.CloneFunctions = true;
+      }
+      if (args[i] == "--time-report") {
+        Options.TimeReport = true;
+        enableTiming();
+      }
+      if (args[i] == "--stats") {
+        Options.Stats = true;
+      }
+      if (args[i] == "--stats-json") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        ++i;
+        Options.StatsJSON = args[i];
+        enableTiming();
+      }
+      if (args[i] == "--cache-dir") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        ++i;
+        Options.CacheDir = args[i];
+      }
+      if (args[i] == "--emit-summaries" || args[i] == "--load-summaries") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        if (args[i] == "--emit-summaries")
+          Options.EmitSummaries = args[i + 1];
+        else
+          Options.LoadSummaries.push_back(args[i + 1]);
+        ++i;
+      }
+      if (args[i] == "--library-summaries") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        ++i;
+        Options.LibrarySummaryFiles.push_back(args[i]);
+      }
+      if (args[i] == "-j" || args[i] == "--jobs") {
+        if (i + 1 >= e) {
+          D.Report(
+              D.getCustomDiagID(DiagnosticsEngine::Error, "missing argument"));
+          return false;
+        }
+        ++i;
+        if (llvm::StringRef(args[i]).getAsInteger(10, Options.Jobs)) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "invalid number of jobs '%0'"))
+              << args[i];
+          return false;
+        }
       }
     }
 
@@ -1,48 +1,108 @@
 #include "OmpDartASTConsumer.h"
 
+#include "AnalysisCache.h"
 #include "AnalysisUtils.h"
+#include "CommonUtils.h"
 #include "DirectiveRewriter.h"
+#include "Statistics.h"
+#include <algorithm>
+#include <mutex>
+#include <optional>
 #include <string>
 
+#include "clang/AST/Mangle.h"
+#include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
 using namespace clang;
 
+OMPDART_STATISTIC(NumFunctions, "Functions with a body in the main file");
+OMPDART_STATISTIC(NumKernels, "Target regions found");
+OMPDART_STATISTIC(NumCacheHits, "Functions restored from the analysis cache");
+OMPDART_STATISTIC(NumRegionsRewritten, "Target data regions written");
+OMPDART_STATISTIC(NumDeviceBuffers,
+                  "Device buffers shared by data with disjoint lifetimes");
+OMPDART_STATISTIC(NumRegionsHoisted,
+                  "Target data regions wrapped around loops calling kernels");
+OMPDART_STATISTIC(NumFunctionClones,
+                  "Functions copied for calls that mapped their data");
+OMPDART_STATISTIC(NumPragmaAssertions,
+                  "Variables with properties asserted by pragmas");
+OMPDART_STATISTIC(NumDeviceAllocations,
+                  "Buffers kept on the device from allocation to release");
+OMPDART_PHASE(TraversePhase, "traverse", "AST traversal and access logging");
+OMPDART_PHASE(InterproceduralPhase, "interprocedural",
+              "Interprocedural analysis");
+OMPDART_PHASE(AnalyzePhase, "analyze", "Per function analysis");
+OMPDART_PHASE(RewritePhase, "rewrite", "Rewriting and writing the output");
+
+// The driver runs several consumers at once. Keeps the lines they print from
+// interleaving.
+static std::mutex OutputMutex;
+// Files written so far, guarded by OutputMutex. Two inputs mapping to the same
+// output must not overwrite each other.
+static llvm::StringSet<> WrittenFiles;
+
 OmpDartASTConsumer::OmpDartASTConsumer(CompilerInstance *CI,
-                                       const std::string *OutFilePath,
-                                       bool Aggressive)
+                                       const OmpDartOptions &Options)
     : Context(&(CI->getASTContext())), SM(&(Context->getSourceManager())),
-      Visitor(new OmpDartASTVisitor(CI)),
+      Visitor(new OmpDartASTVisitor(CI, &Library)), Options(Options),
       FunctionTrackers(Visitor->getFunctionTrackers()),
       Kernels(Visitor->getTargetRegions()) {
   TheRewriter.setSourceMgr(*SM, Context->getLangOpts());
-  this->OutFilePath = *OutFilePath;
-  this->Aggressive = Aggressive;
+  // The preprocessor owns the handler. It only runs while parsing, before the
+  // translation unit is handed to this consumer.
+  CI->getPreprocessor().AddPragmaHandler(new OmpDartPragmaHandler(Pragmas));
+#if DEBUG_LEVEL >= 1
+  // Keep debug output from different functions from interleaving.
+  this->Options.Jobs = 1;
+#endif
 }
 
-void OmpDartASTConsumer::HandleTranslationUnit(ASTContext &Context) {
-  Visitor->TraverseDecl(Context.getTranslationUnitDecl());
-
-  performInterproceduralAnalysis(FunctionTrackers);
-
-  for (DataTracker *DT : FunctionTrackers) {
-    DT->classifyOffloadedOps();
+/* Runs the per-function analyses. Each tracker only reads the AST and writes
+ * its own access log, so trackers are analyzed concurrently. Diagnostics are
+ * queued by the trackers and emitted afterwards in function order. Functions
+ * with results in Cache are restored rather than analyzed.
+ */
+static void analyzeFunctions(std::vector<DataTracker *> &FunctionTrackers,
+                             unsigned Jobs, AnalysisCache *Cache,
+                             ASTContext &Context, bool Aggressive) {
+  std::vector<std::string> Names(FunctionTrackers.size());
+  std::vector<uint64_t> Keys(FunctionTrackers.size());
+  std::vector<bool> Restored(FunctionTrackers.size(), false);
+  if (Cache) {
+    ASTNameGenerator NameGen(Context);
+    for (size_t I = 0; I < FunctionTrackers.size(); ++I) {
+      DataTracker *DT = FunctionTrackers[I];
+      Names[I] = NameGen.getName(DT->getDecl());
+      Keys[I] = computeAnalysisKey(DT, Context, Aggressive);
+      if (const CachedAnalysis *Cached = Cache->lookup(Names[I], Keys[I]))
+        Restored[I] = DT->restoreAnalysis(*Cached);
+      if (Restored[I])
+        ++NumCacheHits;
+    }
   }
 
-  if (Aggressive)
-    performAggressiveCrossFunctionOffloading(FunctionTrackers);
+  // Building a CFG may evaluate expressions, which is not safe while other
+  // functions are analyzed.
+  for (size_t I = 0; I < FunctionTrackers.size(); ++I) {
+    if (!Restored[I])
+      FunctionTrackers[I]->buildCFG();
+  }
 
-#if DEBUG_LEVEL >= 1
-  llvm::outs() << "\n=========================================================="
-                  "======================\n";
-#endif
-  for (DataTracker *DT : FunctionTrackers) {
-    // DT->classifyOffloadedOps();
+  auto Analyze = [&Restored](DataTracker *DT, size_t I) {
 #if DEBUG_LEVEL >= 1
     DT->printAccessLog();
 #endif
     // computes data mappings for the scope of single target regions
     DT->naiveAnalyze();
     // computes data mappings
-    DT->analyze();
+    if (!Restored[I])
+      DT->analyze();
 #if DEBUG_LEVEL >= 1
     llvm::outs() << "globals\n";
     for (auto Global : DT->getGlobals()) {
@@ -55,7 +115,130 @@ void OmpDartASTConsumer::HandleTranslationUnit(ASTContext &Context) {
                    << "\n";
     }
 #endif
+  };
+
+  if (Jobs == 1 || FunctionTrackers.size() <= 1) {
+    for (size_t I = 0; I < FunctionTrackers.size(); ++I)
+      Analyze(FunctionTrackers[I], I);
+  } else {
+    SharedSourceManager Shared(Context.getSourceManager());
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+    for (size_t I = 0; I < FunctionTrackers.size(); ++I)
+      Pool.async(Analyze, FunctionTrackers[I], I);
+    Pool.wait();
+  }
+
+  if (Cache) {
+    for (size_t I = 0; I < FunctionTrackers.size(); ++I) {
+      if (!Restored[I])
+        Cache->store(Names[I], Keys[I], FunctionTrackers[I]->saveAnalysis());
+    }
+#if DEBUG_LEVEL >= 1
+    llvm::outs() << "Restored "
+                 << std::count(Restored.begin(), Restored.end(), true) << " of "
+                 << FunctionTrackers.size() << " functions from cache\n";
+#endif
+  }
+
+  for (DataTracker *DT : FunctionTrackers)
+    DT->emitDiagnostics();
+}
+
+void OmpDartASTConsumer::HandleTranslationUnit(ASTContext &Context) {
+  for (const std::string &Path : Options.LibrarySummaryFiles) {
+    std::string Error;
+    if (Library.loadYAML(Path, Error))
+      continue;
+    DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+    const unsigned int DiagID =
+        DiagEngine.getCustomDiagID(DiagnosticsEngine::Warning,
+                                   "unable to load library summaries '%0': %1");
+    DiagEngine.Report(DiagID) << Path << Error;
+  }
+  {
+    PhaseTimeRegion Timer(TraversePhase);
+    Visitor->TraverseDecl(Context.getTranslationUnitDecl());
+    for (DataTracker *DT : FunctionTrackers)
+      DT->confirmLibraryWrites();
+  }
+  NumFunctions += FunctionTrackers.size();
+  NumKernels += Kernels.size();
+  NumPragmaAssertions += applyPragmas(FunctionTrackers, Pragmas, Context);
+
+  std::vector<std::unique_ptr<SummaryDatabase>> Databases;
+  for (const std::string &Path : Options.LoadSummaries) {
+    std::string Error;
+    std::unique_ptr<SummaryDatabase> DB = SummaryDatabase::load(Path, Error);
+    if (DB) {
+      Databases.push_back(std::move(DB));
+      continue;
+    }
+    DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+    const unsigned int DiagID = DiagEngine.getCustomDiagID(
+        DiagnosticsEngine::Warning, "unable to load summary database '%0': %1");
+    DiagEngine.Report(DiagID) << Path << Error;
+  }
+  {
+    PhaseTimeRegion Timer(InterproceduralPhase);
+    applyExternalSummaries(FunctionTrackers, Databases, Context);
+    performInterproceduralAnalysis(FunctionTrackers);
+    propagateParamExtents(FunctionTrackers);
+  }
+
+  for (DataTracker *DT : FunctionTrackers) {
+    DT->classifyOffloadedOps();
+  }
+
+  if (Options.SummarySink) {
+    addFunctionSummaries(FunctionTrackers, *Options.SummarySink, Context);
+  } else if (!Options.EmitSummaries.empty()) {
+    SummaryDatabaseBuilder Builder;
+    Builder.setAggressive(Options.Aggressive);
+    addFunctionSummaries(FunctionTrackers, Builder, Context);
+    if (!Builder.writeToFile(Options.EmitSummaries)) {
+      DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+      const unsigned int DiagID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Error, "unable to write summary database '%0'");
+      DiagEngine.Report(DiagID) << Options.EmitSummaries;
+    }
+  }
+
+  if (Options.Aggressive)
+    performAggressiveCrossFunctionOffloading(FunctionTrackers);
+
+#if DEBUG_LEVEL >= 1
+  llvm::outs() << "\n=========================================================="
+                  "======================\n";
+#endif
+  // The parent map is built lazily on the first query. Build it here so the
+  // analysis threads only ever read it.
+  Context.getParents(*Context.getTranslationUnitDecl());
+  std::unique_ptr<AnalysisCache> Cache;
+  if (!Options.CacheDir.empty()) {
+    Cache = std::make_unique<AnalysisCache>();
+    Cache->load(AnalysisCache::getCachePath(Options.CacheDir, *SM));
+  }
+  {
+    PhaseTimeRegion Timer(AnalyzePhase);
+    analyzeFunctions(FunctionTrackers, Options.Jobs, Cache.get(), Context,
+                     Options.Aggressive);
   }
+  // Applied after the results are cached, so the cache does not depend on
+  // pragmas outside of the function.
+  for (DataTracker *DT : FunctionTrackers)
+    DT->dropAssertedTransfers();
+  if (Cache && !Cache->save()) {
+    DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+    const unsigned int DiagID = DiagEngine.getCustomDiagID(
+        DiagnosticsEngine::Warning, "unable to write analysis cache in '%0'");
+    DiagEngine.Report(DiagID) << Options.CacheDir;
+  }
+  std::vector<FunctionClone> Clones;
+  if (Options.HoistCalleeRegions || Options.CloneFunctions)
+    NumRegionsHoisted += hoistCalleeRegions(
+        FunctionTrackers, Options.CloneFunctions ? &Clones : nullptr);
+  if (Options.EnterExitData)
+    NumDeviceAllocations += planDeviceAllocations(FunctionTrackers);
 
 #if DEBUG_LEVEL >= 1
   llvm::outs() << "Number of Target Data Regions: " << Kernels.size() << "\n";
@@ -68,15 +251,48 @@ void OmpDartASTConsumer::HandleTranslationUnit(ASTContext &Context) {
 
   int I = 0;
 #endif
+  std::optional<PhaseTimeRegion> RewriteTimer;
+  RewriteTimer.emplace(RewritePhase);
+  unsigned Buffers = 0;
+  // Rewrites the regions of DT's function, or of a clone of it.
+  auto RewriteRegions = [&](Rewriter &R, DataTracker *DT,
+                            const std::vector<TargetDataRegion *> &Scopes) {
+    rewriteTargetDataRegions(R, Context, Scopes);
+    NumRegionsRewritten += Scopes.size();
+    if (Options.EnterExitData)
+      rewriteDeviceAllocations(R, DT->getDeviceAllocations(), Scopes);
+    if (Options.ReuseDeviceBuffers)
+      Buffers += rewriteDeviceBuffers(R, Context, Scopes);
+  };
   for (DataTracker *DT : FunctionTrackers) {
-    const TargetDataRegion *Scope = DT->getTargetDataScope();
-    if (!Scope)
-      continue;
+    const std::vector<TargetDataRegion *> &Scopes = DT->getTargetDataScopes();
 #if DEBUG_LEVEL >= 1
-    llvm::outs() << "\nTargetScope #" << I++;
-    Scope->print(llvm::outs(), *SM);
+    for (const TargetDataRegion *Scope : Scopes) {
+      llvm::outs() << "\nTargetScope #" << I++;
+      Scope->print(llvm::outs(), *SM);
+    }
 #endif
-    rewriteTargetDataRegion(TheRewriter, Context, Scope);
+    if (Options.Async)
+      DT->planAsyncUpdates();
+    RewriteRegions(TheRewriter, DT, Scopes);
+  }
+  for (const FunctionClone &Clone : Clones) {
+    // The clone starts out as the original source, so it is rewritten on its
+    // own and copied in.
+    Rewriter CloneRewriter(*SM, Context.getLangOpts());
+    RewriteRegions(CloneRewriter, Clone.Tracker,
+                   Clone.Tracker->cloneTargetDataScopes(Clone.Present));
+    rewriteFunctionClone(TheRewriter, CloneRewriter, Clone.Tracker->getDecl(),
+                         Clone.Name, Clone.Calls, Clone.DeclLoc);
+  }
+  NumFunctionClones += Clones.size();
+  NumDeviceBuffers += Buffers;
+  if (Buffers) {
+    // The device memory routines are declared in omp.h.
+    FileID MainFile = SM->getMainFileID();
+    if (SM->getBufferData(MainFile).find("<omp.h>") == llvm::StringRef::npos)
+      TheRewriter.InsertTextBefore(SM->getLocForStartOfFile(MainFile),
+                                   "#include <omp.h>\n");
   }
 
 #if DEBUG_LEVEL >= 1
@@ -91,25 +307,61 @@ void OmpDartASTConsumer::HandleTranslationUnit(ASTContext &Context) {
 #endif
 
   FileID FID = SM->getMainFileID();
+  std::string OutFilePath = Options.OutFilePath;
+  const FileEntry *MainFile = SM->getFileEntryForID(FID);
+  llvm::SmallString<256> InputPath;
+  if (MainFile)
+    InputPath = MainFile->tryGetRealPathName();
+  if (OutFilePath.empty() && !Options.InputRoot.empty() &&
+      !InputPath.empty() &&
+      llvm::sys::path::replace_path_prefix(InputPath, Options.InputRoot,
+                                           Options.OutputDir)) {
+    OutFilePath = std::string(InputPath);
+    llvm::sys::fs::create_directories(llvm::sys::path::parent_path(InputPath));
+  }
   if (OutFilePath.empty()) {
     std::string ParsedFilename =
         SM->getFilename(SM->getLocForStartOfFile(FID)).str();
     char *CParsedFilename = strdup(ParsedFilename.c_str());
     char *Basename = basename(CParsedFilename);
 
-    OutFilePath = "/tmp/" + std::string(Basename);
+    std::string OutputDir =
+        Options.OutputDir.empty() ? "/tmp" : Options.OutputDir;
+    OutFilePath = OutputDir + "/" + std::string(Basename);
     free(CParsedFilename);
   }
-  llvm::outs() << "Modified File at " << OutFilePath << "\n";
-  std::error_code ErrorCode;
-  llvm::raw_fd_ostream OutFile(OutFilePath, ErrorCode, llvm::sys::fs::OF_None);
-  if (!ErrorCode) {
-    // print to terminal
-    // TheRewriter.getEditBuffer(SM.getMainFileID()).write(llvm::outs());
-    // write to OutFile
-    TheRewriter.getEditBuffer(FID).write(OutFile);
-  } else {
-    llvm::outs() << "Could not create file\n";
+  {
+    // Opening truncates the file, so it is only opened under the lock.
+    std::lock_guard<std::mutex> Lock(OutputMutex);
+    if (!WrittenFiles.insert(OutFilePath).second) {
+      DiagnosticsEngine &DiagEngine = Context.getDiagnostics();
+      const unsigned int DiagID = DiagEngine.getCustomDiagID(
+          DiagnosticsEngine::Error,
+          "'%0' was already written for another input, not overwriting it");
+      DiagEngine.Report(DiagID) << OutFilePath;
+    } else {
+      std::error_code ErrorCode;
+      llvm::raw_fd_ostream OutFile(OutFilePath, ErrorCode,
+                                   llvm::sys::fs::OF_None);
+      llvm::outs() << "Modified File at " << OutFilePath << "\n";
+      if (!ErrorCode) {
+        // print to terminal
+        // TheRewriter.getEditBuffer(SM.getMainFileID()).write(llvm::outs());
+        // write to OutFile
+        TheRewriter.getEditBuffer(FID).write(OutFile);
+      } else {
+        llvm::outs() << "Could not create file\n";
+      }
+      OutFile.close();
+    }
   }
-  OutFile.close();
+  RewriteTimer.reset();
+
+  if (Options.TimeReport)
+    printTimeReport(llvm::errs());
+  if (Options.Stats)
+    printStatistics(llvm::errs());
+  if (!Options.StatsJSON.empty() && !writeStatisticsJSON(Options.StatsJSON))
+    llvm::errs() << "warning: unable to write statistics to '"
+                 << Options.StatsJSON << "'\n";
 }
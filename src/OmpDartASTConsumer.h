@@ -3,24 +3,28 @@
 
 #include "clang/Rewrite/Core/Rewriter.h"
 
+#include "LibrarySummaries.h"
 #include "OmpDartASTVisitor.h"
+#include "OmpDartOptions.h"
+#include "OmpDartPragma.h"
 
 using namespace clang;
 
 class OmpDartASTConsumer : public ASTConsumer {
   ASTContext *Context;
   SourceManager *SM;
+  LibrarySummaries Library;
+  std::vector<OmpDartPragma> Pragmas;
   OmpDartASTVisitor *Visitor;
   Rewriter TheRewriter;
-  std::string OutFilePath;
-  bool Aggressive;
+  OmpDartOptions Options;
 
   std::vector<DataTracker *> &FunctionTrackers;
   std::vector<Kernel *> &Kernels;
 
 public:
   explicit OmpDartASTConsumer(CompilerInstance *CI,
-                              const std::string *OutFilePath, bool Aggressive);
+                              const OmpDartOptions &Options);
 
   virtual void HandleTranslationUnit(ASTContext &Context);
 
@@ -3,11 +3,17 @@
 #include "clang/AST/ParentMapContext.h"
 
 #include "CommonUtils.h"
+#include "Statistics.h"
 
 using namespace clang;
 
-OmpDartASTVisitor::OmpDartASTVisitor(CompilerInstance *CI)
-    : Context(&(CI->getASTContext())), SM(&(Context->getSourceManager())) {
+OMPDART_STATISTIC(NumLibraryCalls,
+                  "Calls whose arguments were taken from library summaries");
+
+OmpDartASTVisitor::OmpDartASTVisitor(CompilerInstance *CI,
+                                     const LibrarySummaries *Library)
+    : Context(&(CI->getASTContext())), SM(&(Context->getSourceManager())),
+      Library(Library) {
   LastKernel = NULL;
   LastFunction = NULL;
 }
@@ -59,6 +65,9 @@ bool OmpDartASTVisitor::VisitVarDecl(VarDecl *VD) {
     LastFunction->recordLocal(VD);
     uint8_t Flags = VD->hasInit() ? A_WRONLY : A_NOP;
     LastFunction->recordAccess(VD, VD->getLocation(), LastStmt, Flags, true);
+    if (VD->getType()->isPointerType() && VD->hasInit())
+      LastFunction->recordPointerDefinition(VD, VD->getInit(),
+                                            VD->getLocation());
     return true;
   }
 
@@ -75,6 +84,12 @@ bool OmpDartASTVisitor::VisitCallExpr(CallExpr *CE) {
     return true;
 
   LastFunction->recordCallExpr(CE);
+  if (Library && !SM->isInMainFile(Callee->getLocation())) {
+    if (const LibrarySummary *Summary = Library->lookup(Callee)) {
+      recordLibraryCall(CE, *Summary);
+      return true;
+    }
+  }
   Expr **Args = CE->getArgs();
 
   for (int I = 0; I < Callee->getNumParams(); ++I) {
@@ -106,11 +121,60 @@ bool OmpDartASTVisitor::VisitCallExpr(CallExpr *CE) {
       AccessType = A_NOP;
     }
     LastFunction->recordAccess(VD, DRE->getLocation(), CE, AccessType, true);
+    // The callee may point the pointer elsewhere.
+    if (VD->getType()->isPointerType() && ParamType->isReferenceType() &&
+        !ParamType->getPointeeType().isConstQualified())
+      LastFunction->recordPointerDefinition(VD, nullptr, DRE->getLocation());
   }
 
   return true;
 }
 
+/* Records the arguments of a call to a function with a library summary. The
+ * data behind a pointer or reference argument is accessed as the summary says,
+ * anything else is read. A write leaves the data it does not reach as it was,
+ * so it is also recorded as a read. Only a write through the variable itself,
+ * not a + i or &a[i], whose extent is later found to cover all of it is a
+ * write only.
+ */
+void OmpDartASTVisitor::recordLibraryCall(CallExpr *CE,
+                                          const LibrarySummary &Summary) {
+  const FunctionDecl *Callee = CE->getDirectCallee();
+  for (unsigned I = 0; I < CE->getNumArgs(); ++I) {
+    // An array passed through an ellipsis decays to a pointer, which only
+    // shows before its casts are stripped.
+    QualType ParamType = I < Callee->getNumParams()
+                             ? Callee->getParamDecl(I)->getType()
+                             : CE->getArg(I)->getType();
+    const Expr *Arg = CE->getArg(I)->IgnoreParenCasts();
+    bool ByAddress = ParamType->isPointerType() || ParamType->isReferenceType();
+
+    const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Arg);
+    bool Whole = DRE != nullptr;
+    if (const auto *UO = dyn_cast<UnaryOperator>(Arg)) {
+      if (UO->getOpcode() == UO_AddrOf) {
+        DRE = dyn_cast<DeclRefExpr>(UO->getSubExpr()->IgnoreParens());
+        Whole = DRE != nullptr;
+      }
+    }
+    if (!DRE && ByAddress)
+      DRE = getLeftmostDecl(Arg);
+    if (!DRE || isa<FunctionDecl>(DRE->getDecl()))
+      continue;
+
+    uint8_t AccessType = ByAddress ? Summary.getMode(I) : A_RDONLY;
+    const LibraryExtent *Extent = Summary.getExtent(I);
+    if (Whole && AccessType == A_WRONLY && Extent)
+      LastFunction->recordLibraryWrite(DRE->getDecl(), DRE->getLocation(), CE,
+                                       I, *Extent);
+    if (AccessType & A_WRONLY)
+      AccessType |= A_RDONLY;
+    LastFunction->recordAccess(DRE->getDecl(), DRE->getLocation(), CE,
+                               AccessType, true);
+  }
+  ++NumLibraryCalls;
+}
+
 bool OmpDartASTVisitor::VisitBinaryOperator(BinaryOperator *BO) {
   if (!BO->getBeginLoc().isValid() || !SM->isInMainFile(BO->getBeginLoc()))
     return true;
@@ -134,12 +198,29 @@ bool OmpDartASTVisitor::VisitBinaryOperator(BinaryOperator *BO) {
   }
 
   LastFunction->recordAccess(VD, DRE->getLocation(), BO, AccessType, true);
+
+  const DeclRefExpr *LHS =
+      dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParenImpCasts());
+  if (LHS && LHS->getDecl() == VD && VD->getType()->isPointerType()) {
+    const Expr *Value = BO->getOpcode() == BO_Assign ? BO->getRHS() : nullptr;
+    LastFunction->recordPointerDefinition(VD, Value, DRE->getLocation());
+  }
   return true;
 }
 
 bool OmpDartASTVisitor::VisitUnaryOperator(UnaryOperator *UO) {
   if (!UO->getBeginLoc().isValid() || !SM->isInMainFile(UO->getBeginLoc()))
     return true;
+  if (UO->getOpcode() == UO_AddrOf) {
+    // A pointer may be reassigned through its address.
+    const DeclRefExpr *Operand =
+        dyn_cast<DeclRefExpr>(UO->getSubExpr()->IgnoreParens());
+    if (Operand && Operand->getType()->isPointerType() &&
+        inLastFunction(UO->getBeginLoc()))
+      LastFunction->recordPointerDefinition(Operand->getDecl(), nullptr,
+                                            Operand->getLocation());
+    return true;
+  }
   if (!(UO->isPostfix() || UO->isPrefix()))
     return true;
   if (!inLastFunction(UO->getBeginLoc()))
@@ -149,6 +230,9 @@ bool OmpDartASTVisitor::VisitUnaryOperator(UnaryOperator *UO) {
   const ValueDecl *VD = DRE->getDecl();
 
   LastFunction->recordAccess(VD, DRE->getLocation(), UO, A_RDWR, true);
+  if (VD->getType()->isPointerType() &&
+      UO->getSubExpr()->IgnoreParenImpCasts() == DRE)
+    LastFunction->recordPointerDefinition(VD, nullptr, DRE->getLocation());
   return true;
 }
 
@@ -5,6 +5,7 @@
 #include "clang/Frontend/CompilerInstance.h"
 
 #include "DataTracker.h"
+#include "LibrarySummaries.h"
 
 using namespace clang;
 
@@ -12,6 +13,7 @@ class OmpDartASTVisitor : public RecursiveASTVisitor<OmpDartASTVisitor> {
 private:
   ASTContext *Context;
   SourceManager *SM;
+  const LibrarySummaries *Library;
 
   // each DataTracker keeps track of data access within the scope of a single
   // function
@@ -24,9 +26,10 @@ private:
 
   bool inLastTargetRegion(SourceLocation Loc);
   bool inLastFunction(SourceLocation Loc);
+  void recordLibraryCall(CallExpr *CE, const LibrarySummary &Summary);
 
 public:
-  explicit OmpDartASTVisitor(CompilerInstance *CI);
+  OmpDartASTVisitor(CompilerInstance *CI, const LibrarySummaries *Library);
 
   std::vector<DataTracker *> &getFunctionTrackers();
   std::vector<Kernel *> &getTargetRegions(); 
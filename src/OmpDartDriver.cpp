@@ -0,0 +1,281 @@
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "OmpDartASTConsumer.h"
+#include "Statistics.h"
+#include "SummaryDatabase.h"
+
+using namespace clang;
+using namespace clang::tooling;
+
+static llvm::cl::OptionCategory OmpDartCategory("ompdart options");
+
+static llvm::cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
+static llvm::cl::extrahelp MoreHelp(
+    "\nRuns on every file of the compilation database when no source files "
+    "are\ngiven. Rewritten files are written to --output-dir under their path "
+    "relative\nto the deepest directory containing every input, or to /tmp "
+    "under their\nbasename.\n");
+
+static llvm::cl::opt<std::string>
+    OutFilePath("o", llvm::cl::desc("Output file (single input only)"),
+                llvm::cl::value_desc("file"), llvm::cl::cat(OmpDartCategory));
+static llvm::cl::alias OutFilePathLong("output",
+                                       llvm::cl::aliasopt(OutFilePath));
+
+static llvm::cl::opt<std::string>
+    OutputDir("output-dir",
+              llvm::cl::desc("Directory the rewritten files are written to"),
+              llvm::cl::value_desc("dir"), llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool> Aggressive(
+    "aggressive-cross-function",
+    llvm::cl::desc("Leave data mapping of offload-only parameters to callers"),
+    llvm::cl::cat(OmpDartCategory));
+static llvm::cl::alias AggressiveShort("a", llvm::cl::aliasopt(Aggressive));
+
+static llvm::cl::opt<bool> ReuseDeviceBuffers(
+    "reuse-device-buffers",
+    llvm::cl::desc("Share device allocations between arrays with disjoint "
+                   "device lifetimes"),
+    llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool>
+    Async("async",
+          llvm::cl::desc("Overlap updates with host code and other kernels"),
+          llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool> EnterExitData(
+    "enter-exit-data",
+    llvm::cl::desc("Keep buffers on the device from their allocation until "
+                   "they are freed"),
+    llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool> HoistCalleeRegions(
+    "hoist-callee-regions",
+    llvm::cl::desc("Map the data of callees called in loops around the loops"),
+    llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool> CloneFunctions(
+    "clone-functions",
+    llvm::cl::desc("Copy callees for calls that already mapped their data "
+                   "(implies --hoist-callee-regions)"),
+    llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<unsigned>
+    Jobs("j",
+         llvm::cl::desc("Number of files processed at once (default: all "
+                        "hardware threads)"),
+         llvm::cl::init(0), llvm::cl::cat(OmpDartCategory));
+static llvm::cl::alias JobsLong("jobs", llvm::cl::aliasopt(Jobs));
+
+static llvm::cl::opt<std::string> EmitSummaries(
+    "emit-summaries",
+    llvm::cl::desc("Write the summaries of every processed file's functions "
+                   "to one summary database"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::list<std::string> LoadSummaries(
+    "load-summaries",
+    llvm::cl::desc("Summary database used for calls to functions defined in "
+                   "other files (may be repeated)"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::list<std::string> LibrarySummaryFiles(
+    "library-summaries",
+    llvm::cl::desc("YAML file describing how library functions access their "
+                   "arguments (may be repeated)"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<std::string> CacheDir(
+    "cache-dir",
+    llvm::cl::desc("Reuse the analysis of functions that are unchanged since "
+                   "an earlier run, keeping results in <dir>"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool>
+    TimeReport("time-report",
+               llvm::cl::desc("Print the time spent in each phase"),
+               llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<bool> Stats("stats",
+                                 llvm::cl::desc("Print analysis statistics"),
+                                 llvm::cl::cat(OmpDartCategory));
+
+static llvm::cl::opt<std::string>
+    StatsJSON("stats-json",
+              llvm::cl::desc("Write phase times and statistics as JSON"),
+              llvm::cl::value_desc("file"), llvm::cl::cat(OmpDartCategory));
+
+class OmpDartFrontendAction : public ASTFrontendAction {
+private:
+  const OmpDartOptions &Options;
+
+public:
+  explicit OmpDartFrontendAction(const OmpDartOptions &Options)
+      : Options(Options) {}
+
+protected:
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 llvm::StringRef) override {
+    return std::make_unique<OmpDartASTConsumer>(&CI, Options);
+  }
+}; // end class OmpDartFrontendAction
+
+class OmpDartActionFactory : public FrontendActionFactory {
+private:
+  OmpDartOptions Options;
+
+public:
+  explicit OmpDartActionFactory(const OmpDartOptions &Options)
+      : Options(Options) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<OmpDartFrontendAction>(Options);
+  }
+}; // end class OmpDartActionFactory
+
+/* Returns true if Path is Dir or is inside it.
+ */
+static bool isWithin(llvm::StringRef Path, llvm::StringRef Dir) {
+  auto P = llvm::sys::path::begin(Path), PE = llvm::sys::path::end(Path);
+  for (auto D = llvm::sys::path::begin(Dir), DE = llvm::sys::path::end(Dir);
+       D != DE; ++D, ++P) {
+    if (P == PE || *P != *D)
+      return false;
+  }
+  return true;
+}
+
+/* Returns the deepest directory containing every one of Files, by their real
+ * paths, or an empty string if one of them cannot be resolved.
+ */
+static std::string getInputRoot(const std::vector<std::string> &Files) {
+  std::string Root;
+  for (const std::string &File : Files) {
+    llvm::SmallString<256> Path;
+    if (llvm::sys::fs::real_path(File, Path))
+      return "";
+    llvm::StringRef Dir = llvm::sys::path::parent_path(Path);
+    if (&File == &Files.front())
+      Root = Dir.str();
+    while (!isWithin(Dir, Root))
+      Root = llvm::sys::path::parent_path(Root).str();
+  }
+  return Root;
+}
+
+int main(int argc, const char **argv) {
+  auto ExpectedParser = CommonOptionsParser::create(
+      argc, argv, OmpDartCategory, llvm::cl::ZeroOrMore);
+  if (!ExpectedParser) {
+    llvm::errs() << ExpectedParser.takeError();
+    return 1;
+  }
+  CommonOptionsParser &OptionsParser = ExpectedParser.get();
+  const CompilationDatabase &Compilations = OptionsParser.getCompilations();
+
+  std::vector<std::string> Files = OptionsParser.getSourcePathList();
+  if (Files.empty())
+    Files = Compilations.getAllFiles();
+  if (Files.empty()) {
+    llvm::errs() << "error: no input files\n";
+    return 1;
+  }
+  if (!OutFilePath.empty() && Files.size() > 1) {
+    llvm::errs() << "error: -o can only be used with a single input file, use "
+                    "--output-dir instead\n";
+    return 1;
+  }
+
+  std::sort(Files.begin(), Files.end());
+  Files.erase(std::unique(Files.begin(), Files.end()), Files.end());
+
+  OmpDartOptions Options;
+  Options.OutFilePath = OutFilePath;
+  Options.OutputDir = OutputDir;
+  // Files with the same name in different directories would otherwise be
+  // written to the same output.
+  if (!OutputDir.empty())
+    Options.InputRoot = getInputRoot(Files);
+  Options.Aggressive = Aggressive;
+  Options.ReuseDeviceBuffers = ReuseDeviceBuffers;
+  Options.Async = Async;
+  Options.EnterExitData = EnterExitData;
+  Options.HoistCalleeRegions = HoistCalleeRegions;
+  Options.CloneFunctions = CloneFunctions;
+  Options.LoadSummaries = LoadSummaries;
+  Options.LibrarySummaryFiles = LibrarySummaryFiles;
+  Options.CacheDir = CacheDir;
+  // Phase times and counters are reported once for all files below rather
+  // than by each file's consumer.
+  if (TimeReport || !StatsJSON.empty())
+    enableTiming();
+  SummaryDatabaseBuilder Summaries;
+  Summaries.setAggressive(Aggressive);
+  if (!EmitSummaries.empty())
+    Options.SummarySink = &Summaries;
+
+  // Files are split into one shard per worker. Each shard is run by its own
+  // ClangTool, which reuses its FileManager for every file in the shard, so
+  // headers shared by the files of a shard are only read and stat'ed once.
+  unsigned NumShards = llvm::hardware_concurrency(Jobs).compute_thread_count();
+  NumShards = std::max(1u, std::min<unsigned>(NumShards, Files.size()));
+  // Parallelism comes from processing several files at once. Analyzing the
+  // functions of each file in parallel too would only oversubscribe.
+  Options.Jobs = NumShards > 1 ? 1 : Jobs;
+
+  std::vector<std::vector<std::string>> Shards(NumShards);
+  for (size_t I = 0; I < Files.size(); ++I)
+    Shards[I % NumShards].push_back(Files[I]);
+
+  OmpDartActionFactory Factory(Options);
+  std::atomic<int> Status(0);
+  auto RunShard = [&](const std::vector<std::string> &Shard) {
+    // The real file system is process wide and changing its working directory
+    // calls chdir, so every shard gets a physical file system of its own.
+    ClangTool Tool(Compilations, Shard,
+                   std::make_shared<PCHContainerOperations>(),
+                   llvm::vfs::createPhysicalFileSystem());
+    // OpenMP must be enabled for the target directives to be parsed.
+    Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+        "-fopenmp", ArgumentInsertPosition::END));
+    if (int Result = Tool.run(&Factory))
+      Status = Result;
+  };
+
+  if (NumShards == 1) {
+    RunShard(Shards[0]);
+  } else {
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumShards));
+    for (const std::vector<std::string> &Shard : Shards)
+      Pool.async([&RunShard, &Shard] { RunShard(Shard); });
+    Pool.wait();
+  }
+
+  if (TimeReport)
+    printTimeReport(llvm::errs());
+  if (Stats)
+    printStatistics(llvm::errs());
+  if (!StatsJSON.empty() && !writeStatisticsJSON(StatsJSON))
+    llvm::errs() << "warning: unable to write statistics to '" << StatsJSON
+                 << "'\n";
+
+  if (!EmitSummaries.empty() && !Summaries.writeToFile(EmitSummaries)) {
+    llvm::errs() << "error: unable to write summary database '"
+                 << EmitSummaries << "'\n";
+    return 1;
+  }
+  return Status;
+}
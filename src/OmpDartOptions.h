@@ -0,0 +1,58 @@
+#ifndef OMPDARTOPTIONS_H
+#define OMPDARTOPTIONS_H
+
+#include <string>
+#include <vector>
+
+class SummaryDatabaseBuilder;
+
+// Settings shared by the clang plugin and the standalone driver.
+struct OmpDartOptions {
+  // File the rewritten source is written to. When empty the input's basename
+  // is used inside OutputDir, or /tmp if OutputDir is empty too.
+  std::string OutFilePath;
+  std::string OutputDir;
+  // Directory containing every input. When set, inputs keep their path
+  // relative to it inside OutputDir rather than only their basename.
+  std::string InputRoot;
+  bool Aggressive = false;
+  // Share one device allocation between arrays that are only used on the
+  // device and are never mapped at the same time.
+  bool ReuseDeviceBuffers = false;
+  // Emit updates with nowait, ordered with the kernels and host code that use
+  // the data through depend clauses and taskwaits.
+  bool Async = false;
+  // Keep buffers on the device from their allocation until they are freed,
+  // with target enter/exit data at the allocation and free sites.
+  bool EnterExitData = false;
+  // Map the data of callees that only use it on the device around the loops
+  // they are called in, rather than on every call.
+  bool HoistCalleeRegions = false;
+  // Also give the calls that mapped more of a callee's data than its other
+  // calls a copy of the callee relying on that. Implies HoistCalleeRegions.
+  bool CloneFunctions = false;
+  // Number of threads used to analyze functions. 0 uses every hardware thread.
+  unsigned Jobs = 0;
+  // Summary database the summaries of this translation unit's functions are
+  // written to, for use by other translation units.
+  std::string EmitSummaries;
+  // When set, summaries are added here instead of being written to
+  // EmitSummaries. Lets the driver collect every file into one database.
+  SummaryDatabaseBuilder *SummarySink = nullptr;
+  // Summary databases consulted for functions defined elsewhere. Earlier
+  // databases take precedence.
+  std::vector<std::string> LoadSummaries;
+  // YAML files describing how library functions access their arguments, on
+  // top of the built-in descriptions. Later files take precedence.
+  std::vector<std::string> LibrarySummaryFiles;
+  // Directory holding the analysis results of earlier runs. Functions that
+  // are unchanged since then are not analyzed again. Empty disables caching.
+  std::string CacheDir;
+  // Reports printed once the translation unit is done. Timing must also be
+  // turned on with enableTiming() for phase times to be collected.
+  bool TimeReport = false;
+  bool Stats = false;
+  std::string StatsJSON;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include "OmpDartPragma.h"
+
+#include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/StringSwitch.h"
+
+#include "AccessInfo.h"
+
+OmpDartPragmaHandler::OmpDartPragmaHandler(std::vector<OmpDartPragma> &Pragmas)
+    : PragmaHandler("ompdart"), Pragmas(Pragmas) {}
+
+void OmpDartPragmaHandler::HandlePragma(Preprocessor &PP,
+                                        PragmaIntroducer Introducer,
+                                        Token &FirstToken) {
+  DiagnosticsEngine &DiagEngine = PP.getDiagnostics();
+  auto Malformed = [&](Token &Tok, const char *Expected) {
+    const unsigned int DiagID = DiagEngine.getCustomDiagID(
+        DiagnosticsEngine::Warning,
+        "expected %0 in '#pragma ompdart' - ignoring directive");
+    DiagEngine.Report(Tok.getLocation(), DiagID) << Expected;
+    if (Tok.isNot(tok::eod))
+      PP.DiscardUntilEndOfDirective();
+  };
+
+  // Clauses are only kept once the whole directive has been read.
+  std::vector<OmpDartPragma> Clauses;
+  Token Tok;
+  PP.Lex(Tok);
+  while (Tok.isNot(tok::eod)) {
+    uint8_t Properties = 0;
+    if (Tok.is(tok::identifier)) {
+      llvm::StringRef Name = Tok.getIdentifierInfo()->getName();
+      Properties = llvm::StringSwitch<uint8_t>(Name)
+                       .Case("readonly", P_READONLY)
+                       .Case("device_resident", P_DEVICE_RESIDENT)
+                       .Case("host_dead", P_HOST_DEAD)
+                       .Default(0);
+    }
+    if (!Properties) {
+      Malformed(Tok, "'readonly', 'device_resident' or 'host_dead'");
+      return;
+    }
+    OmpDartPragma Clause{Introducer.Loc, Properties, {}};
+
+    PP.Lex(Tok);
+    if (Tok.isNot(tok::l_paren)) {
+      Malformed(Tok, "'('");
+      return;
+    }
+    do {
+      PP.Lex(Tok);
+      if (Tok.isNot(tok::identifier)) {
+        Malformed(Tok, "a variable name");
+        return;
+      }
+      Clause.Names.push_back(Tok.getIdentifierInfo()->getName().str());
+      PP.Lex(Tok);
+    } while (Tok.is(tok::comma));
+    if (Tok.isNot(tok::r_paren)) {
+      Malformed(Tok, "')'");
+      return;
+    }
+    Clauses.push_back(std::move(Clause));
+    PP.Lex(Tok);
+  }
+  Pragmas.insert(Pragmas.end(), Clauses.begin(), Clauses.end());
+}
@@ -0,0 +1,37 @@
+#ifndef OMPDARTPRAGMA_H
+#define OMPDARTPRAGMA_H
+
+#include <string>
+#include <vector>
+
+#include "clang/Lex/Pragma.h"
+
+using namespace clang;
+
+// One clause of a `#pragma ompdart`, asserting Properties (P_* flags) of the
+// data of the variables named in it.
+struct OmpDartPragma {
+  SourceLocation Loc;
+  uint8_t Properties;
+  std::vector<std::string> Names;
+};
+
+/* Parses directives of the form
+ *
+ *   #pragma ompdart readonly(a, b) device_resident(c) host_dead(d)
+ *
+ * into Pragmas, one entry per clause. Malformed directives are reported and
+ * ignored.
+ */
+class OmpDartPragmaHandler : public PragmaHandler {
+private:
+  std::vector<OmpDartPragma> &Pragmas;
+
+public:
+  explicit OmpDartPragmaHandler(std::vector<OmpDartPragma> &Pragmas);
+
+  void HandlePragma(Preprocessor &PP, PragmaIntroducer Introducer,
+                    Token &FirstToken) override;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "Statistics.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+
+static std::atomic<bool> TimingEnabled(false);
+
+// Counters and phases register themselves during static initialization. The
+// registries are function local so they exist before the first registration.
+static std::vector<OmpDartStatistic *> &getStatistics() {
+  static std::vector<OmpDartStatistic *> Statistics;
+  return Statistics;
+}
+
+static std::vector<OmpDartPhase *> &getPhases() {
+  static std::vector<OmpDartPhase *> Phases;
+  return Phases;
+}
+
+OmpDartStatistic::OmpDartStatistic(const char *Name, const char *Desc)
+    : Name(Name), Desc(Desc), Value(0) {
+  getStatistics().push_back(this);
+}
+
+void OmpDartStatistic::updateMax(uint64_t N) {
+  uint64_t Current = Value.load(std::memory_order_relaxed);
+  while (Current < N &&
+         !Value.compare_exchange_weak(Current, N, std::memory_order_relaxed)) {
+  }
+}
+
+OmpDartPhase::OmpDartPhase(const char *Name, const char *Desc)
+    : Name(Name), Desc(Desc) {
+  getPhases().push_back(this);
+}
+
+void OmpDartPhase::add(const llvm::TimeRecord &Time) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Total += Time;
+}
+
+llvm::TimeRecord OmpDartPhase::getTotal() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Total;
+}
+
+PhaseTimeRegion::PhaseTimeRegion(OmpDartPhase &Phase)
+    : Phase(isTimingEnabled() ? &Phase : nullptr) {
+  if (this->Phase)
+    Start = llvm::TimeRecord::getCurrentTime(true);
+}
+
+PhaseTimeRegion::~PhaseTimeRegion() {
+  if (!Phase)
+    return;
+  llvm::TimeRecord Elapsed = llvm::TimeRecord::getCurrentTime(false);
+  Elapsed -= Start;
+  Phase->add(Elapsed);
+}
+
+void enableTiming() { TimingEnabled = true; }
+
+bool isTimingEnabled() { return TimingEnabled; }
+
+void printTimeReport(llvm::raw_ostream &OS) {
+  llvm::StringMap<llvm::TimeRecord> Records;
+  for (OmpDartPhase *Phase : getPhases())
+    Records[Phase->getName()] = Phase->getTotal();
+  llvm::TimerGroup Group("ompdart", "OMPDart phase timing report", Records);
+  Group.print(OS);
+}
+
+void printStatistics(llvm::raw_ostream &OS) {
+  std::vector<OmpDartStatistic *> Statistics = getStatistics();
+  std::sort(Statistics.begin(), Statistics.end(),
+            [](const OmpDartStatistic *A, const OmpDartStatistic *B) {
+              return llvm::StringRef(A->getName()) < B->getName();
+            });
+
+  OS << "===" << std::string(73, '-') << "===\n"
+     << "                          OMPDart statistics\n"
+     << "===" << std::string(73, '-') << "===\n\n";
+  for (const OmpDartStatistic *Stat : Statistics) {
+    OS << llvm::format_decimal(Stat->getValue(), 10) << "  "
+       << llvm::left_justify(Stat->getName(), 28) << "- " << Stat->getDesc()
+       << "\n";
+  }
+  OS << "\n";
+  OS.flush();
+}
+
+bool writeStatisticsJSON(llvm::StringRef Path) {
+  llvm::json::Object Counters;
+  for (const OmpDartStatistic *Stat : getStatistics())
+    Counters[Stat->getName()] = int64_t(Stat->getValue());
+
+  llvm::json::Object Phases;
+  for (OmpDartPhase *Phase : getPhases()) {
+    llvm::TimeRecord Total = Phase->getTotal();
+    Phases[Phase->getName()] = llvm::json::Object{
+        {"wall", Total.getWallTime()},
+        {"user", Total.getUserTime()},
+        {"system", Total.getSystemTime()},
+    };
+  }
+
+  std::error_code ErrorCode;
+  llvm::raw_fd_ostream OutFile(Path, ErrorCode, llvm::sys::fs::OF_None);
+  if (ErrorCode)
+    return false;
+  OutFile << llvm::formatv(
+      "{0:2}\n", llvm::json::Value(llvm::json::Object{
+                     {"counters", std::move(Counters)},
+                     {"times", std::move(Phases)},
+                 }));
+  OutFile.close();
+  return !OutFile.has_error();
+}
@@ -0,0 +1,80 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <atomic>
+#include <mutex>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// A named counter in the style of llvm::Statistic. Unlike llvm::Statistic it
+// is counted in release builds of LLVM as well, and may be updated from the
+// analysis threads.
+class OmpDartStatistic {
+private:
+  const char *Name;
+  const char *Desc;
+  std::atomic<uint64_t> Value;
+
+public:
+  OmpDartStatistic(const char *Name, const char *Desc);
+
+  const char *getName() const { return Name; }
+  const char *getDesc() const { return Desc; }
+  uint64_t getValue() const { return Value.load(std::memory_order_relaxed); }
+
+  OmpDartStatistic &operator++() {
+    Value.fetch_add(1, std::memory_order_relaxed);
+    return *this;
+  }
+  OmpDartStatistic &operator+=(uint64_t N) {
+    Value.fetch_add(N, std::memory_order_relaxed);
+    return *this;
+  }
+  void updateMax(uint64_t N);
+};
+
+// Time spent in one phase of the tool, summed over every thread and
+// translation unit that ran it.
+class OmpDartPhase {
+private:
+  const char *Name;
+  const char *Desc;
+  std::mutex Mutex;
+  llvm::TimeRecord Total;
+
+public:
+  OmpDartPhase(const char *Name, const char *Desc);
+
+  const char *getName() const { return Name; }
+  const char *getDesc() const { return Desc; }
+  void add(const llvm::TimeRecord &Time);
+  llvm::TimeRecord getTotal();
+};
+
+#define OMPDART_STATISTIC(VARNAME, DESC)                                       \
+  static OmpDartStatistic VARNAME(#VARNAME, DESC)
+#define OMPDART_PHASE(VARNAME, NAME, DESC)                                     \
+  static OmpDartPhase VARNAME(NAME, DESC)
+
+/* Adds the time from construction to destruction to Phase. Does nothing unless
+ * timing was enabled with enableTiming().
+ */
+class PhaseTimeRegion {
+private:
+  OmpDartPhase *Phase;
+  llvm::TimeRecord Start;
+
+public:
+  explicit PhaseTimeRegion(OmpDartPhase &Phase);
+  ~PhaseTimeRegion();
+};
+
+void enableTiming();
+bool isTimingEnabled();
+void printTimeReport(llvm::raw_ostream &OS);
+void printStatistics(llvm::raw_ostream &OS);
+bool writeStatisticsJSON(llvm::StringRef Path);
+
+#endif
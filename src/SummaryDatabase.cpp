@@ -0,0 +1,214 @@
+#include "SummaryDatabase.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AccessInfo.h"
+
+using namespace summary_format;
+
+/* Mode of data that is accessed as described by both A and B. The data is
+ * only offloaded if it is offloaded in both.
+ */
+static uint8_t mergeModes(uint8_t A, uint8_t B) {
+  return ((A | B) & ~A_OFFLD) | (A & B & A_OFFLD);
+}
+
+void SummaryDatabaseBuilder::setAggressive(bool Aggressive) {
+  this->Aggressive = Aggressive;
+}
+
+void SummaryDatabaseBuilder::add(const std::string &Name,
+                                 ExternalSummary Summary) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Inserted = Summaries.try_emplace(Name, std::move(Summary));
+  if (Inserted.second)
+    return;
+
+  ExternalSummary &Existing = Inserted.first->second;
+  if (Existing.ParamModes.size() != Summary.ParamModes.size())
+    return;
+  for (size_t I = 0; I < Existing.ParamModes.size(); ++I) {
+    Existing.ParamModes[I] =
+        mergeModes(Existing.ParamModes[I], Summary.ParamModes[I]);
+  }
+  for (const auto &Global : Summary.GlobalModes) {
+    auto It = std::find_if(
+        Existing.GlobalModes.begin(), Existing.GlobalModes.end(),
+        [&](const auto &Other) { return Other.first == Global.first; });
+    if (It == Existing.GlobalModes.end())
+      Existing.GlobalModes.push_back(Global);
+    else
+      It->second = mergeModes(It->second, Global.second);
+  }
+}
+
+bool SummaryDatabaseBuilder::writeToFile(llvm::StringRef Path) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  std::vector<SummaryFunctionRecord> FunctionRecords;
+  std::vector<SummaryGlobalRecord> GlobalRecords;
+  std::string ModeBytes;
+  std::string Strings;
+  auto AddString = [&Strings](const std::string &S) {
+    uint32_t Offset = Strings.size();
+    Strings += S;
+    return Offset;
+  };
+
+  // std::map iterates in name order, which is the order lookups rely on.
+  for (const auto &Entry : Summaries) {
+    const ExternalSummary &Summary = Entry.second;
+    SummaryFunctionRecord Record;
+    Record.NameOffset = AddString(Entry.first);
+    Record.NameSize = Entry.first.size();
+    Record.ParamsOffset = ModeBytes.size();
+    Record.NumParams = Summary.ParamModes.size();
+    Record.GlobalsBegin = GlobalRecords.size();
+    Record.NumGlobals = Summary.GlobalModes.size();
+    FunctionRecords.push_back(Record);
+
+    ModeBytes.append(Summary.ParamModes.begin(), Summary.ParamModes.end());
+    for (const auto &Global : Summary.GlobalModes) {
+      SummaryGlobalRecord GlobalRecord;
+      GlobalRecord.NameOffset = AddString(Global.first);
+      GlobalRecord.NameSize = Global.first.size();
+      GlobalRecord.Mode = Global.second;
+      GlobalRecords.push_back(GlobalRecord);
+    }
+  }
+  uint32_t ModesSize = ModeBytes.size();
+  ModeBytes.resize((ModeBytes.size() + 3) & ~size_t(3), '\0');
+
+  SummaryFileHeader Header;
+  std::memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = Version;
+  Header.Flags = Aggressive ? FlagAggressive : 0;
+  Header.NumFunctions = FunctionRecords.size();
+  Header.NumGlobals = GlobalRecords.size();
+  Header.ModesOffset = sizeof(SummaryFileHeader) +
+                       FunctionRecords.size() * sizeof(SummaryFunctionRecord) +
+                       GlobalRecords.size() * sizeof(SummaryGlobalRecord);
+  Header.ModesSize = ModesSize;
+  Header.StringsOffset = Header.ModesOffset + ModeBytes.size();
+  Header.StringsSize = Strings.size();
+
+  std::error_code ErrorCode;
+  llvm::raw_fd_ostream OutFile(Path, ErrorCode, llvm::sys::fs::OF_None);
+  if (ErrorCode)
+    return false;
+  OutFile.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+  OutFile.write(reinterpret_cast<const char *>(FunctionRecords.data()),
+                FunctionRecords.size() * sizeof(SummaryFunctionRecord));
+  OutFile.write(reinterpret_cast<const char *>(GlobalRecords.data()),
+                GlobalRecords.size() * sizeof(SummaryGlobalRecord));
+  OutFile << ModeBytes << Strings;
+  OutFile.close();
+  return !OutFile.has_error();
+}
+
+std::unique_ptr<SummaryDatabase> SummaryDatabase::load(llvm::StringRef Path,
+                                                       std::string &Error) {
+  // Without the null terminator requirement the file is mapped rather than
+  // read when it is large enough for that to pay off.
+  auto BufferOrError = llvm::MemoryBuffer::getFile(
+      Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!BufferOrError) {
+    Error = BufferOrError.getError().message();
+    return nullptr;
+  }
+
+  std::unique_ptr<SummaryDatabase> DB(new SummaryDatabase());
+  DB->Buffer = std::move(*BufferOrError);
+  const char *Data = DB->Buffer->getBufferStart();
+  size_t Size = DB->Buffer->getBufferSize();
+
+  if (Size < sizeof(SummaryFileHeader) ||
+      std::memcmp(Data, Magic, sizeof(Magic)) != 0) {
+    Error = "not an ompdart summary database";
+    return nullptr;
+  }
+  DB->Header = reinterpret_cast<const SummaryFileHeader *>(Data);
+  const SummaryFileHeader &Header = *DB->Header;
+  if (Header.Version != Version) {
+    Error = "unsupported summary database version";
+    return nullptr;
+  }
+
+  uint64_t RecordsEnd =
+      sizeof(SummaryFileHeader) +
+      uint64_t(Header.NumFunctions) * sizeof(SummaryFunctionRecord) +
+      uint64_t(Header.NumGlobals) * sizeof(SummaryGlobalRecord);
+  if (RecordsEnd > Header.ModesOffset ||
+      uint64_t(Header.ModesOffset) + Header.ModesSize > Header.StringsOffset ||
+      uint64_t(Header.StringsOffset) + Header.StringsSize > Size) {
+    Error = "truncated summary database";
+    return nullptr;
+  }
+
+  DB->Functions = llvm::ArrayRef<SummaryFunctionRecord>(
+      reinterpret_cast<const SummaryFunctionRecord *>(
+          Data + sizeof(SummaryFileHeader)),
+      Header.NumFunctions);
+  DB->Globals = llvm::ArrayRef<SummaryGlobalRecord>(
+      reinterpret_cast<const SummaryGlobalRecord *>(DB->Functions.end()),
+      Header.NumGlobals);
+  DB->Modes = llvm::ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(Data + Header.ModesOffset),
+      Header.ModesSize);
+  DB->Strings =
+      llvm::StringRef(Data + Header.StringsOffset, Header.StringsSize);
+
+  // Check every reference once here so lookups do not have to.
+  auto ValidString = [&](uint32_t Offset, uint32_t Size) {
+    return uint64_t(Offset) + Size <= Header.StringsSize;
+  };
+  for (const SummaryFunctionRecord &Record : DB->Functions) {
+    if (!ValidString(Record.NameOffset, Record.NameSize) ||
+        uint64_t(Record.ParamsOffset) + Record.NumParams > Header.ModesSize ||
+        uint64_t(Record.GlobalsBegin) + Record.NumGlobals > Header.NumGlobals) {
+      Error = "corrupt summary database";
+      return nullptr;
+    }
+  }
+  for (const SummaryGlobalRecord &Record : DB->Globals) {
+    if (!ValidString(Record.NameOffset, Record.NameSize)) {
+      Error = "corrupt summary database";
+      return nullptr;
+    }
+  }
+  return DB;
+}
+
+llvm::StringRef SummaryDatabase::getString(uint32_t Offset,
+                                           uint32_t Size) const {
+  return Strings.substr(Offset, Size);
+}
+
+bool SummaryDatabase::isAggressive() const {
+  return Header->Flags & FlagAggressive;
+}
+
+bool SummaryDatabase::lookup(llvm::StringRef Name,
+                             ExternalSummary &Summary) const {
+  auto It = std::lower_bound(
+      Functions.begin(), Functions.end(), Name,
+      [this](const SummaryFunctionRecord &Record, llvm::StringRef Name) {
+        return getString(Record.NameOffset, Record.NameSize) < Name;
+      });
+  if (It == Functions.end() || getString(It->NameOffset, It->NameSize) != Name)
+    return false;
+
+  Summary.ParamModes.assign(Modes.begin() + It->ParamsOffset,
+                            Modes.begin() + It->ParamsOffset + It->NumParams);
+  Summary.GlobalModes.clear();
+  for (const SummaryGlobalRecord &Global :
+       Globals.slice(It->GlobalsBegin, It->NumGlobals)) {
+    Summary.GlobalModes.emplace_back(
+        getString(Global.NameOffset, Global.NameSize).str(), Global.Mode);
+  }
+  return true;
+}
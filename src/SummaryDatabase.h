@@ -0,0 +1,112 @@
+#ifndef SUMMARYDATABASE_H
+#define SUMMARYDATABASE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/* On-disk layout of a summary database. Every field is a little endian 32 bit
+ * integer so the file can be used directly from a memory mapping.
+ *
+ *   SummaryFileHeader
+ *   SummaryFunctionRecord[NumFunctions]  sorted by name
+ *   SummaryGlobalRecord[NumGlobals]
+ *   uint8_t ParamModes[ModesSize]        padded to a multiple of 4
+ *   char Strings[StringsSize]
+ */
+namespace summary_format {
+using u32 = llvm::support::ulittle32_t;
+
+constexpr char Magic[8] = {'O', 'M', 'P', 'D', 'S', 'U', 'M', '\0'};
+constexpr uint32_t Version = 1;
+// The summaries were produced with aggressive cross function offloading, so
+// callees expect their callers to map parameters that are only offloaded.
+constexpr uint32_t FlagAggressive = 0x1;
+
+struct SummaryFileHeader {
+  char Magic[8];
+  u32 Version;
+  u32 Flags;
+  u32 NumFunctions;
+  u32 NumGlobals;
+  u32 ModesOffset;
+  u32 ModesSize;
+  u32 StringsOffset;
+  u32 StringsSize;
+};
+
+struct SummaryFunctionRecord {
+  u32 NameOffset; // into Strings
+  u32 NameSize;
+  u32 ParamsOffset; // into ParamModes
+  u32 NumParams;
+  u32 GlobalsBegin; // index of the first SummaryGlobalRecord
+  u32 NumGlobals;
+};
+
+struct SummaryGlobalRecord {
+  u32 NameOffset; // into Strings
+  u32 NameSize;
+  u32 Mode;
+};
+} // namespace summary_format
+
+// Access summary of a function as seen by its callers. Functions and globals
+// are named by their mangled names so they can be matched across translation
+// units. A mode keeps A_OFFLD only if the data is exclusively used on the
+// target device.
+struct ExternalSummary {
+  std::vector<uint8_t> ParamModes;
+  std::vector<std::pair<std::string, uint8_t>> GlobalModes;
+};
+
+/* Collects summaries and writes them out as a summary database. Summaries may
+ * be added from several threads.
+ */
+class SummaryDatabaseBuilder {
+private:
+  std::mutex Mutex;
+  std::map<std::string, ExternalSummary> Summaries;
+  bool Aggressive = false;
+
+public:
+  void setAggressive(bool Aggressive);
+  // The same function may be summarized by more than one translation unit,
+  // for example when it is defined inline in a header. Those summaries are
+  // merged so the result covers every definition.
+  void add(const std::string &Name, ExternalSummary Summary);
+  bool writeToFile(llvm::StringRef Path);
+};
+
+/* Read only view of a summary database file.
+ */
+class SummaryDatabase {
+private:
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  const summary_format::SummaryFileHeader *Header;
+  llvm::ArrayRef<summary_format::SummaryFunctionRecord> Functions;
+  llvm::ArrayRef<summary_format::SummaryGlobalRecord> Globals;
+  llvm::ArrayRef<uint8_t> Modes;
+  llvm::StringRef Strings;
+
+  SummaryDatabase() = default;
+  llvm::StringRef getString(uint32_t Offset, uint32_t Size) const;
+
+public:
+  // Returns nullptr and sets Error if Path is not a valid summary database.
+  static std::unique_ptr<SummaryDatabase> load(llvm::StringRef Path,
+                                               std::string &Error);
+
+  bool isAggressive() const;
+  // Returns false if there is no summary for the function named Name.
+  bool lookup(llvm::StringRef Name, ExternalSummary &Summary) const;
+};
+
+#endif
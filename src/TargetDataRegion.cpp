@@ -1,11 +1,13 @@
 #include "TargetDataRegion.h"
 
+#include <algorithm>
+
 using namespace clang;
 
 TargetDataRegion::TargetDataRegion(SourceLocation BeginLoc,
                                    SourceLocation EndLoc,
                                    const FunctionDecl *FD)
-    : BeginLoc(BeginLoc), EndLoc(EndLoc), FD(FD) {}
+    : BeginLoc(BeginLoc), EndLoc(EndLoc), FD(FD), Parent(nullptr) {}
 
 SourceLocation TargetDataRegion::getBeginLoc() const { return BeginLoc; }
 
@@ -15,12 +17,18 @@ const FunctionDecl *TargetDataRegion::getContainingFunction() const {
   return FD;
 }
 
+const TargetDataRegion *TargetDataRegion::getParent() const { return Parent; }
+
 void TargetDataRegion::print(llvm::raw_ostream &OS,
                              const SourceManager &SM) const {
   llvm::outs() << "\n|-- Location: ";
   BeginLoc.print(llvm::outs(), SM);
   llvm::outs() << "\n|             ";
   EndLoc.print(llvm::outs(), SM);
+  if (Parent) {
+    llvm::outs() << "\n|-- Nested in region at ";
+    Parent->BeginLoc.print(llvm::outs(), SM);
+  }
 
   llvm::outs() << "\n|-- Data";
   if (MapTo.size())
@@ -71,6 +79,13 @@ void TargetDataRegion::print(llvm::raw_ostream &OS,
     Access.Loc.print(llvm::outs(), SM);
     llvm::outs() << " id: " << Access.VD->getID();
   }
+  if (Sections.size())
+    llvm::outs() << "\n|   |-- sections";
+  for (const auto &Section : Sections) {
+    llvm::outs() << "\n|   |   |-- " << Section.first->getNameAsString();
+    for (const SectionDim &Dim : Section.second.Dims)
+      llvm::outs() << "[" << Dim.Lower << ":" << Dim.Length << "]";
+  }
   llvm::outs() << "\n";
 
   return;
@@ -112,3 +127,52 @@ const std::vector<const OMPExecutableDirective *> &
 TargetDataRegion::getKernels() const {
   return Kernels;
 }
+
+const ArraySection *
+TargetDataRegion::getArraySection(const ValueDecl *VD) const {
+  auto It = Sections.find(VD);
+  if (It == Sections.end())
+    return nullptr;
+  return &It->second;
+}
+
+const ArraySection *TargetDataRegion::getUpdateToSection(size_t Index) const {
+  if (Index >= UpdateToSections.size() ||
+      UpdateToSections[Index].Dims.empty())
+    return nullptr;
+  return &UpdateToSections[Index];
+}
+
+const ArraySection *
+TargetDataRegion::getUpdateFromSection(size_t Index) const {
+  if (Index >= UpdateFromSections.size() ||
+      UpdateFromSections[Index].Dims.empty())
+    return nullptr;
+  return &UpdateFromSections[Index];
+}
+
+bool TargetDataRegion::isUpdateToAsync(size_t Index) const {
+  return Index < UpdateToAsync.size() && UpdateToAsync[Index];
+}
+
+bool TargetDataRegion::isUpdateFromAsync(size_t Index) const {
+  return Index < UpdateFromAsync.size() && UpdateFromAsync[Index];
+}
+
+const std::vector<ClauseInfo> &TargetDataRegion::getDependIn() const {
+  return DependIn;
+}
+
+const std::vector<const Stmt *> &TargetDataRegion::getTaskWaits() const {
+  return TaskWaits;
+}
+
+bool TargetDataRegion::isPresentOnEntry(const ValueDecl *VD) const {
+  return std::find(PresentOnEntry.begin(), PresentOnEntry.end(), VD) !=
+         PresentOnEntry.end();
+}
+
+bool TargetDataRegion::isAssumedPresent(const ValueDecl *VD) const {
+  return std::find(AssumedPresent.begin(), AssumedPresent.end(), VD) !=
+         AssumedPresent.end();
+}
@@ -3,6 +3,8 @@
 
 #include <vector>
 
+#include "llvm/ADT/DenseMap.h"
+
 #include "AccessInfo.h"
 #include "ClauseInfo.h"
 
@@ -13,6 +15,8 @@ private:
   SourceLocation BeginLoc;
   SourceLocation EndLoc;
   const FunctionDecl *FD;
+  // The region this one is nested in, if any.
+  const TargetDataRegion *Parent;
 
   std::vector<AccessInfo> MapTo;
   std::vector<AccessInfo> MapFrom;
@@ -23,6 +27,28 @@ private:
   std::vector<ClauseInfo> Private;
   std::vector<ClauseInfo> FirstPrivate;
   std::vector<const OMPExecutableDirective *> Kernels;
+  // Sections of the arrays mapped by the region. Arrays without an entry are
+  // mapped as a whole.
+  llvm::DenseMap<const ValueDecl *, ArraySection> Sections;
+  // Sections of the updates at the same positions in UpdateTo and UpdateFrom.
+  // An update without a section, or without any dimensions, is of the section
+  // mapped by the region.
+  std::vector<ArraySection> UpdateToSections;
+  std::vector<ArraySection> UpdateFromSections;
+  // Whether the updates at the same positions in UpdateTo and UpdateFrom may
+  // run asynchronously, the kernels that wait for them through a depend
+  // clause, and the statements preceded by a taskwait for them. Only set by
+  // DataTracker::planAsyncUpdates().
+  std::vector<bool> UpdateToAsync;
+  std::vector<bool> UpdateFromAsync;
+  std::vector<ClauseInfo> DependIn;
+  std::vector<const Stmt *> TaskWaits;
+  // Mapped variables whose buffer may already be on the device when the region
+  // begins, kept there from its allocation by `target enter data`.
+  std::vector<const ValueDecl *> PresentOnEntry;
+  // Mapped variables every caller maps around its calls already, so the region
+  // only looks up their device data.
+  std::vector<const ValueDecl *> AssumedPresent;
 
   // will directly update
   friend class DataTracker;
@@ -34,6 +60,7 @@ public:
   SourceLocation getBeginLoc() const;
   SourceLocation getEndLoc() const;
   const FunctionDecl *getContainingFunction() const;
+  const TargetDataRegion *getParent() const;
   void print(llvm::raw_ostream &OS, const SourceManager &SM) const;
 
   const std::vector<AccessInfo> &getMapTo() const;
@@ -45,6 +72,24 @@ public:
   const std::vector<ClauseInfo> &getPrivate() const;
   const std::vector<ClauseInfo> &getFirstPrivate() const;
   const std::vector<const OMPExecutableDirective *> &getKernels() const;
+  const ArraySection *getArraySection(const ValueDecl *VD) const;
+  const ArraySection *getUpdateToSection(size_t Index) const;
+  const ArraySection *getUpdateFromSection(size_t Index) const;
+  bool isUpdateToAsync(size_t Index) const;
+  bool isUpdateFromAsync(size_t Index) const;
+  const std::vector<ClauseInfo> &getDependIn() const;
+  const std::vector<const Stmt *> &getTaskWaits() const;
+  bool isPresentOnEntry(const ValueDecl *VD) const;
+  bool isAssumedPresent(const ValueDecl *VD) const;
+};
+
+// A buffer kept on the device from its allocation until it is freed, by a
+// `target enter data` after Alloc and a `target exit data` before Release.
+struct DeviceAllocation {
+  const ValueDecl *VD;
+  const Stmt *Alloc;
+  const Stmt *Release;
+  ArraySection Section;
 };
 
 #endif